@@ -0,0 +1,37 @@
+#include "arena.h"
+
+namespace reg {
+
+Arena::Arena(size_t initial_size, std::pmr::memory_resource *upstream)
+    : blocks_ {initial_size, upstream}, allocated_ {0} {}
+
+void Arena::release() {
+    std::lock_guard lock(mutex_);
+    blocks_.release();
+    allocated_ = 0;
+}
+
+size_t Arena::allocated() const {
+    std::lock_guard lock(mutex_);
+    return allocated_;
+}
+
+void *Arena::do_allocate(size_t bytes, size_t alignment) {
+    std::lock_guard lock(mutex_);
+    void *p = blocks_.allocate(bytes, alignment);
+    allocated_ += bytes;
+    return p;
+}
+
+void Arena::do_deallocate(void *p, size_t bytes, size_t alignment) {
+    (void) p;
+    (void) bytes;
+    (void) alignment;
+}
+
+bool Arena::do_is_equal(
+    const std::pmr::memory_resource &other) const noexcept {
+    return this == &other;
+}
+
+} // namespace reg
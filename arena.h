@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory_resource>
+#include <mutex>
+
+namespace reg {
+
+// Monotonic arena which several threads may allocate from at once, e.g. the
+// tasks of a parallel scan. Memory is handed out from blocks growing
+// geometrically and is only given back all at once, by release() or the
+// destructor; deallocating is a no-op. One lock per allocation, which costs
+// far less than the registry call producing the data.
+class Arena : public std::pmr::memory_resource {
+  public:
+    // The first block has `initial_size` bytes, blocks come from `upstream`
+    explicit Arena(
+        size_t initial_size = 64 * 1024,
+        std::pmr::memory_resource *upstream = std::pmr::get_default_resource());
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // Frees every allocation; nothing allocated from the arena may be used
+    // afterwards
+    void release();
+
+    // Bytes handed out since construction or the last release()
+    size_t allocated() const;
+
+  private:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal(
+        const std::pmr::memory_resource &other) const noexcept override;
+
+    mutable std::mutex mutex_;
+    std::pmr::monotonic_buffer_resource blocks_;
+    size_t allocated_;
+};
+
+} // namespace reg
@@ -0,0 +1,72 @@
+#include "async.h"
+
+namespace reg {
+
+Executor::Executor(size_t threads) : pool_ {threads} {}
+
+void Executor::post(std::coroutine_handle<> h) {
+    {
+        std::lock_guard lock(mutex_);
+        ready_.push_back(h);
+    }
+    ready_cv_.notify_one();
+}
+
+void Executor::resume_next() {
+    std::coroutine_handle<> h;
+    {
+        std::unique_lock lock(mutex_);
+        ready_cv_.wait(lock, [this] { return !ready_.empty(); });
+        h = ready_.front();
+        ready_.pop_front();
+    }
+    h.resume();
+}
+
+namespace async {
+
+Task<Key> open_key(Executor &ex, const Key &parent, std::string subkey_name,
+                   Access access) {
+    co_return co_await ex.offload(
+        [&] { return Key(parent, subkey_name, access); });
+}
+
+Task<ReadResult<uint32_t>> get_subkeys_count(Executor &ex, const Key &key) {
+    co_return co_await ex.offload([&] { return key.get_subkeys_count(); });
+}
+
+Task<ReadResult<std::string>> enum_subkey_names(Executor &ex, const Key &key,
+                                                uint32_t idx) {
+    co_return co_await ex.offload(
+        [&] { return key.enum_subkey_names(idx); });
+}
+
+Task<ReadResult<uint32_t>> read_u32_value(Executor &ex, const Key &key,
+                                          std::string value_name) {
+    co_return co_await ex.offload(
+        [&] { return key.read_u32_value(value_name); });
+}
+
+Task<ReadResult<std::vector<uint32_t>>>
+read_u32_values(Executor &ex, const Key &key,
+                std::vector<std::string> value_names) {
+    co_return co_await ex.offload(
+        [&] { return key.read_u32_values(value_names); });
+}
+
+Task<ReadResult<std::string>> read_string_value(Executor &ex, const Key &key,
+                                                std::string value_name) {
+    co_return co_await ex.offload(
+        [&] { return key.read_string_value(value_name); });
+}
+
+Task<ReadResult<std::vector<std::string>>>
+read_string_values(Executor &ex, const Key &key,
+                   std::vector<std::string> value_names) {
+    co_return co_await ex.offload(
+        [&] { return key.read_string_values(value_names); });
+}
+
+} // namespace async
+
+} // namespace reg
@@ -0,0 +1,267 @@
+#pragma once
+
+#include "pool.h"
+#include "reg.h"
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace reg {
+
+class Executor;
+
+// Lazily started coroutine producing a T (not void). It starts when awaited
+// or run by an Executor and resumes its awaiter when it finishes.
+template <typename T> class [[nodiscard]] Task {
+  public:
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr exception;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() {
+            return Task(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        auto final_suspend() noexcept {
+            struct FinalAwaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(
+                    std::coroutine_handle<promise_type> h) noexcept {
+                    const std::coroutine_handle<> c =
+                        h.promise().continuation;
+                    return c ? c : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+            return FinalAwaiter {};
+        }
+
+        void return_value(T v) {
+            value.emplace(std::move(v));
+        }
+
+        void unhandled_exception() {
+            exception = std::current_exception();
+        }
+    };
+
+    Task(Task &&other) : h_ {std::exchange(other.h_, {})} {}
+
+    Task &operator=(Task &&other) {
+        if (this != &other) {
+            if (h_) {
+                h_.destroy();
+            }
+            h_ = std::exchange(other.h_, {});
+        }
+        return *this;
+    }
+
+    ~Task() {
+        if (h_) {
+            h_.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) {
+        h_.promise().continuation = c;
+        return h_;
+    }
+
+    T await_resume() {
+        if (h_.promise().exception) {
+            std::rethrow_exception(h_.promise().exception);
+        }
+        return std::move(*h_.promise().value);
+    }
+
+  private:
+    friend class Executor;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : h_ {h} {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+// Runs coroutines on the thread which calls run() and blocking backend calls
+// on a pool of worker threads. A coroutine awaiting offload() is suspended
+// until a worker has made the call, meanwhile others go on, so one thread
+// keeps as many backend calls in flight as there are workers.
+class Executor {
+  public:
+    explicit Executor(size_t threads);
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    // Runs a task and everything it awaits to completion
+    template <typename T> T run(Task<T> task) {
+        task.h_.resume();
+        while (!task.h_.done()) {
+            resume_next();
+        }
+        return task.await_resume();
+    }
+
+    // Awaitable which calls `f` on a worker and resumes the awaiting
+    // coroutine on the executor thread with its result
+    template <typename F> auto offload(F f) {
+        using R = std::invoke_result_t<F &>;
+        struct Awaiter {
+            Executor &ex;
+            F f;
+            std::optional<R> result;
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<> h) {
+                ex.pool_.submit([this, h] {
+                    result.emplace(f());
+                    ex.post(h);
+                });
+            }
+
+            R await_resume() {
+                return std::move(*result);
+            }
+        };
+        return Awaiter {*this, std::move(f), std::nullopt};
+    }
+
+  private:
+    // Queues a coroutine to be resumed on the executor thread
+    void post(std::coroutine_handle<> h);
+    // Waits for a queued coroutine and resumes it
+    void resume_next();
+
+    std::mutex mutex_;
+    std::condition_variable ready_cv_;
+    std::deque<std::coroutine_handle<>> ready_;
+    // Last, so its workers are done before the queue goes away
+    ThreadPool pool_;
+};
+
+namespace detail {
+
+// Coroutine which starts at once and frees itself when it ends
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+struct Join {
+    size_t pending;
+    std::coroutine_handle<> parent;
+};
+
+template <typename T>
+Detached join_one(Task<T> &task, std::optional<T> &result, Join &join) {
+    result.emplace(co_await task);
+    if (--join.pending == 0) {
+        join.parent.resume();
+    }
+}
+
+} // namespace detail
+
+// Runs tasks concurrently and returns their results in order
+template <typename T>
+Task<std::vector<T>> when_all(std::vector<Task<T>> tasks) {
+    std::vector<std::optional<T>> results(tasks.size());
+    struct Awaiter {
+        std::vector<Task<T>> &tasks;
+        std::vector<std::optional<T>> &results;
+        // One more than the tasks, so none can resume the parent while they
+        // are still being started
+        detail::Join join;
+
+        bool await_ready() const noexcept {
+            return tasks.empty();
+        }
+
+        bool await_suspend(std::coroutine_handle<> parent) {
+            join.parent = parent;
+            for (size_t i = 0; i < tasks.size(); i++) {
+                detail::join_one(tasks[i], results[i], join);
+            }
+            return --join.pending > 0;
+        }
+
+        void await_resume() const noexcept {}
+    };
+    co_await Awaiter {
+        tasks,
+        results,
+        {.pending = tasks.size() + 1, .parent = {}},
+    };
+
+    std::vector<T> values;
+    values.reserve(results.size());
+    for (std::optional<T> &result : results) {
+        values.push_back(std::move(*result));
+    }
+    co_return values;
+}
+
+// Awaitable versions of the reg::Key calls. The backend calls are made on the
+// executor's workers, the key must stay alive until the task is done.
+namespace async {
+
+Task<Key> open_key(Executor &ex, const Key &parent, std::string subkey_name,
+                   Access access = Access::ReadWrite);
+Task<ReadResult<uint32_t>> get_subkeys_count(Executor &ex, const Key &key);
+Task<ReadResult<std::string>> enum_subkey_names(Executor &ex, const Key &key,
+                                                uint32_t idx);
+Task<ReadResult<uint32_t>> read_u32_value(Executor &ex, const Key &key,
+                                          std::string value_name);
+Task<ReadResult<std::vector<uint32_t>>>
+read_u32_values(Executor &ex, const Key &key,
+                std::vector<std::string> value_names);
+Task<ReadResult<std::string>> read_string_value(Executor &ex, const Key &key,
+                                                std::string value_name);
+Task<ReadResult<std::vector<std::string>>>
+read_string_values(Executor &ex, const Key &key,
+                   std::vector<std::string> value_names);
+
+} // namespace async
+
+} // namespace reg
@@ -0,0 +1,299 @@
+#include "mem_backend.h"
+#include "reg.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <new>
+#include <optional>
+#include <print>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+// Heap allocations made by the whole program so far
+std::atomic<uint64_t> allocations {0};
+
+using Clock = std::chrono::steady_clock;
+
+// Shape of the synthetic tree: `depth` levels of keys with `fanout` subkeys
+// each. Every leaf key has `values` u32 values and as many string values.
+struct Options {
+    size_t fanout;
+    size_t depth;
+    size_t values;
+    size_t iterations;
+};
+
+std::optional<Options> parse_options(std::span<char *> args) {
+    Options options {
+        .fanout = 8,
+        .depth = 3,
+        .values = 4,
+        .iterations = 200'000,
+    };
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string_view arg = args[i];
+        size_t *option = nullptr;
+        if (arg == "--fanout") {
+            option = &options.fanout;
+        } else if (arg == "--depth") {
+            option = &options.depth;
+        } else if (arg == "--values") {
+            option = &options.values;
+        } else if (arg == "--iterations") {
+            option = &options.iterations;
+        }
+        if (option == nullptr || i + 1 == args.size()) {
+            return std::nullopt;
+        }
+        const std::string_view value = args[++i];
+        const auto [conv_end, err] = std::from_chars(
+            value.data(), value.data() + value.size(), *option);
+        if (err != std::errc {} || conv_end != value.data() + value.size() ||
+            *option == 0) {
+            return std::nullopt;
+        }
+    }
+    return options;
+}
+
+std::string key_name(size_t idx) {
+    return std::format("key{:04}", idx);
+}
+
+// Tree in the in-memory backend, built the same way on every run
+struct Tree {
+    reg::MemBackend backend;
+    // Paths of all leaf keys, relative to the system key
+    std::vector<std::string> leaves;
+    // Paths of all keys which have subkeys
+    std::vector<std::string> parents;
+    std::vector<std::string> u32_names;
+    std::vector<std::string> string_names;
+};
+
+void fill(Tree &tree, const Options &options, const std::string &path,
+          size_t level) {
+    const reg::Key root(tree.backend, reg::SystemKey::LocalMachine);
+    if (level == options.depth) {
+        tree.leaves.push_back(path);
+        const reg::Key leaf(root, path);
+        for (size_t i = 0; i < options.values; i++) {
+            leaf.write_u32_value(tree.u32_names[i], (uint32_t) i);
+            leaf.write_string_value(tree.string_names[i],
+                                    std::format("string value {}", i));
+        }
+        return;
+    }
+    tree.parents.push_back(path);
+    for (size_t i = 0; i < options.fanout; i++) {
+        const std::string subkey_path =
+            path.empty() ? key_name(i) : path + "\\" + key_name(i);
+        tree.backend.create_key(subkey_path);
+        fill(tree, options, subkey_path, level + 1);
+    }
+}
+
+struct Measurement {
+    double ops_per_s;
+    double mean_ns;
+    double p50_ns;
+    double p99_ns;
+    double allocs_per_op;
+};
+
+// Times every call separately, so the latency distribution is known. The
+// samples are allocated up front and do not count as allocations of `op`.
+template <typename Op>
+Measurement measure(size_t iterations, std::vector<double> &samples, Op op) {
+    samples.assign(iterations, 0.0);
+    const uint64_t allocs_start = allocations.load();
+    const Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        const Clock::time_point op_start = Clock::now();
+        op(i);
+        samples[i] = std::chrono::duration<double, std::nano>(Clock::now() -
+                                                              op_start)
+                         .count();
+    }
+    const Clock::time_point end = Clock::now();
+    const uint64_t allocs = allocations.load() - allocs_start;
+    const double total_ns =
+        std::chrono::duration<double, std::nano>(end - start).count();
+
+    std::ranges::sort(samples);
+    return Measurement {
+        .ops_per_s = (double) iterations * 1e9 / total_ns,
+        .mean_ns = total_ns / (double) iterations,
+        .p50_ns = samples[iterations / 2],
+        .p99_ns = samples[iterations * 99 / 100],
+        .allocs_per_op = (double) allocs / (double) iterations,
+    };
+}
+
+void report(std::string_view name, const Measurement &m) {
+    std::println("{:<28} {:>12.0f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.2f}",
+                 name, m.ops_per_s, m.mean_ns, m.p50_ns, m.p99_ns,
+                 m.allocs_per_op);
+}
+
+} // namespace
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+
+int main(int argc, char *argv[]) {
+    const auto options = parse_options(std::span(argv + 1, argv + argc));
+    if (!options.has_value()) {
+        std::println(stderr,
+                     "Usage: {} [--fanout N] [--depth N] [--values N] "
+                     "[--iterations N]",
+                     argv[0]);
+        return EXIT_FAILURE;
+    }
+    const size_t iterations = options->iterations;
+
+    Tree tree;
+    for (size_t i = 0; i < options->values; i++) {
+        tree.u32_names.push_back(std::format("U32Value{}", i));
+        tree.string_names.push_back(std::format("StringValue{}", i));
+    }
+    fill(tree, *options, "", 0);
+
+    const reg::Key root(tree.backend, reg::SystemKey::LocalMachine);
+    std::vector<reg::Key> leaves;
+    for (const std::string &leaf : tree.leaves) {
+        leaves.emplace_back(root, leaf);
+    }
+    std::vector<reg::Key> parents;
+    for (const std::string &parent : tree.parents) {
+        parents.emplace_back(root, parent);
+    }
+    const auto leaf = [&](size_t i) -> const reg::Key & {
+        return leaves[i % leaves.size()];
+    };
+
+    std::println("Tree: fanout {}, depth {}, {} values per leaf, {} leaves, "
+                 "{} iterations",
+                 options->fanout, options->depth, options->values,
+                 leaves.size(), iterations);
+    std::println("{:<28} {:>12} {:>10} {:>10} {:>10} {:>10}", "operation",
+                 "ops/s", "mean ns", "p50 ns", "p99 ns", "allocs/op");
+
+    std::vector<double> samples;
+    // Keeps the results from being optimized out
+    uint64_t sink = 0;
+
+    report("Key open", measure(iterations, samples, [&](size_t i) {
+               const reg::Key k(root, tree.leaves[i % tree.leaves.size()]);
+               sink += k.valid();
+           }));
+    reg::Key moved(root, tree.leaves[0]);
+    report("Key move", measure(iterations, samples, [&](size_t) {
+               reg::Key k(std::move(moved));
+               moved = std::move(k);
+           }));
+    report("enum_subkey_names", measure(iterations, samples, [&](size_t i) {
+               const reg::Key &k = parents[i % parents.size()];
+               sink += k.enum_subkey_names((uint32_t) (i % options->fanout))
+                           .value_or("")
+                           .size();
+           }));
+    report("subkeys (whole key)", measure(iterations, samples, [&](size_t i) {
+               for (std::string_view name :
+                    parents[i % parents.size()].subkeys()) {
+                   sink += name.size();
+               }
+           }));
+    report("read_u32_value", measure(iterations, samples, [&](size_t i) {
+               sink += leaf(i)
+                           .read_u32_value(
+                               tree.u32_names[i % tree.u32_names.size()])
+                           .value_or(0);
+           }));
+    report("read_u32_values", measure(iterations, samples, [&](size_t i) {
+               sink += leaf(i).read_u32_values(tree.u32_names)->size();
+           }));
+    report("read_string_value", measure(iterations, samples, [&](size_t i) {
+               sink += leaf(i)
+                           .read_string_value(
+                               tree.string_names[i % tree.string_names.size()])
+                           .value_or("")
+                           .size();
+           }));
+    report("read_string_values", measure(iterations, samples, [&](size_t i) {
+               sink += leaf(i).read_string_values(tree.string_names)->size();
+           }));
+
+    // The same reads against a packed copy of the whole tree
+    auto snapshot = reg::Snapshot::load(root);
+    if (!snapshot.has_value()) {
+        std::println(stderr, "{}", snapshot.error().msg());
+        return EXIT_FAILURE;
+    }
+    const reg::Key snapshot_root(*snapshot, reg::SystemKey::LocalMachine);
+    std::vector<reg::Key> snapshot_leaves;
+    for (const std::string &path : tree.leaves) {
+        snapshot_leaves.emplace_back(snapshot_root, path);
+    }
+    report("Key open (snapshot)", measure(iterations, samples, [&](size_t i) {
+               const reg::Key k(snapshot_root,
+                                tree.leaves[i % tree.leaves.size()]);
+               sink += k.valid();
+           }));
+    report("read_u32_values (snapshot)",
+           measure(iterations, samples, [&](size_t i) {
+               sink += snapshot_leaves[i % snapshot_leaves.size()]
+                           .read_u32_values(tree.u32_names)
+                           ->size();
+           }));
+    std::println("Snapshot: {} keys, {} values, {} bytes",
+                 snapshot->keys_count(), snapshot->values_count(),
+                 snapshot->memory_size());
+
+    report("write_u32_value", measure(iterations, samples, [&](size_t i) {
+               sink += leaf(i)
+                           .write_u32_value(
+                               tree.u32_names[i % tree.u32_names.size()],
+                               (uint32_t) i)
+                           .fail;
+           }));
+    const std::array<uint8_t, 4> binary = {0xff, 0xff, 0xff, 0xff};
+    report("write_binary_value", measure(iterations, samples, [&](size_t i) {
+               sink += leaf(i)
+                           .write_binary_value(
+                               tree.u32_names[i % tree.u32_names.size()],
+                               binary)
+                           .fail;
+           }));
+    report("write_subkey_u32_value",
+           measure(iterations, samples, [&](size_t i) {
+               sink += root.write_subkey_u32_value(
+                               tree.leaves[i % tree.leaves.size()],
+                               tree.u32_names[i % tree.u32_names.size()],
+                               (uint32_t) i)
+                           .fail;
+           }));
+    return sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
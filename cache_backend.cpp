@@ -0,0 +1,243 @@
+#include "cache_backend.h"
+#include <cctype>
+#include <utility>
+
+namespace {
+
+uint64_t entry_id(uint32_t path_id, reg::Access access) {
+    return ((uint64_t) path_id << 32) | std::to_underlying(access);
+}
+
+// Appends a subkey path in canonical form, lower case with single separators
+void append_path(std::string &path, std::string_view subkey_name) {
+    for (;;) {
+        const std::string_view name = reg::next_path_component(subkey_name);
+        if (name.empty()) {
+            return;
+        }
+        path += '\\';
+        for (char c : name) {
+            path += (char) std::tolower((unsigned char) c);
+        }
+    }
+}
+
+} // namespace
+
+namespace reg {
+
+CachingBackend::CachingBackend(Backend &inner, size_t capacity)
+    : inner_ {inner}, capacity_ {capacity}, next_path_id_ {0}, stats_ {} {}
+
+CachingBackend::~CachingBackend() {
+    for (const auto &[id, e] : entries_) {
+        if (!e->system) {
+            inner_.close(e->inner);
+        }
+    }
+}
+
+CachingBackend::Stats CachingBackend::stats() const {
+    std::lock_guard lock(mutex_);
+    Stats stats = stats_;
+    stats.paths = paths_.size();
+    return stats;
+}
+
+Handle CachingBackend::root(SystemKey sk) {
+    std::lock_guard lock(mutex_);
+    // System keys get paths which no subkey path can collide with
+    scratch_ = std::to_string(std::to_underlying(sk));
+    auto &path = intern(scratch_);
+    const uint64_t id = entry_id(path.second.id, Access::ReadWrite);
+    const auto it = entries_.find(id);
+    if (it != entries_.end()) {
+        return (Handle) it->second.get();
+    }
+    return (Handle) add_entry(path, id, inner_.root(sk), 0, true);
+}
+
+int32_t CachingBackend::open(Handle parent, const char *subkey_name,
+                             Access access, Handle &k) {
+    const Entry *p = (const Entry *) parent;
+    if (p == nullptr) {
+        return status::InvalidHandle;
+    }
+    std::string path;
+    {
+        std::lock_guard lock(mutex_);
+        scratch_ = p->path->first;
+        append_path(scratch_, subkey_name);
+        const auto path_it = paths_.find(scratch_);
+        if (path_it != paths_.end()) {
+            const auto it =
+                entries_.find(entry_id(path_it->second.id, access));
+            if (it != entries_.end()) {
+                Entry *e = it->second.get();
+                if (e->refs++ == 0 && !e->system) {
+                    idle_.erase(e->lru);
+                }
+                stats_.hits++;
+                k = (Handle) e;
+                return status::Success;
+            }
+        }
+        stats_.misses++;
+        // Interned only once the key is open, the path may be gone by then
+        path = scratch_;
+    }
+
+    // Other keys can be served while the backend opens this one
+    Handle h = InvalidHandle;
+    const int32_t res = inner_.open(p->inner, subkey_name, access, h);
+    if (res != status::Success) {
+        return res;
+    }
+
+    std::lock_guard lock(mutex_);
+    auto &interned = intern(path);
+    const uint64_t id = entry_id(interned.second.id, access);
+    const auto it = entries_.find(id);
+    if (it != entries_.end()) {
+        // Someone else has opened the same key in the meantime
+        inner_.close(h);
+        Entry *e = it->second.get();
+        if (e->refs++ == 0 && !e->system) {
+            idle_.erase(e->lru);
+        }
+        k = (Handle) e;
+        return status::Success;
+    }
+    k = (Handle) add_entry(interned, id, h, 1, false);
+    stats_.open_handles++;
+    evict();
+    return status::Success;
+}
+
+int32_t CachingBackend::create(Handle parent, const char *subkey_name,
+                               Access access, Handle &k) {
+    const Entry *p = (const Entry *) parent;
+    if (p == nullptr) {
+        return status::InvalidHandle;
+    }
+    // Made to exist in the wrapped backend, then opened through the cache
+    // like any other key
+    Handle h = InvalidHandle;
+    const int32_t res = inner_.create(p->inner, subkey_name, access, h);
+    if (res != status::Success) {
+        return res;
+    }
+    inner_.close(h);
+    return open(parent, subkey_name, access, k);
+}
+
+void CachingBackend::close(Handle k) {
+    Entry *e = (Entry *) k;
+    std::lock_guard lock(mutex_);
+    if (e->system || --e->refs > 0) {
+        return;
+    }
+    idle_.push_front(e);
+    e->lru = idle_.begin();
+    evict();
+}
+
+int32_t CachingBackend::query_info(Handle k, KeyInfo &info) {
+    return inner_.query_info(inner(k), info);
+}
+
+int32_t CachingBackend::enum_subkey(Handle k, uint32_t idx, char *name,
+                                    uint32_t &size) {
+    return inner_.enum_subkey(inner(k), idx, name, size);
+}
+
+int32_t CachingBackend::enum_value(Handle k, uint32_t idx, char *name,
+                                   uint32_t &name_size, ValueType &type,
+                                   void *data, uint32_t &size) {
+    return inner_.enum_value(inner(k), idx, name, name_size, type, data,
+                             size);
+}
+
+int32_t CachingBackend::get_value(Handle k, const char *value_name,
+                                  ValueType type, void *data,
+                                  uint32_t &size) {
+    return inner_.get_value(inner(k), value_name, type, data, size);
+}
+
+int32_t CachingBackend::get_values(Handle k, std::span<ValueEntry> entries,
+                                   void *data, uint32_t &size) {
+    return inner_.get_values(inner(k), entries, data, size);
+}
+
+int32_t CachingBackend::set_value(Handle k, const char *subkey_name,
+                                  const char *value_name, ValueType type,
+                                  const void *data, uint32_t size) {
+    return inner_.set_value(inner(k), subkey_name, value_name, type, data,
+                            size);
+}
+
+int32_t CachingBackend::set_values(Handle k,
+                                   std::span<const ValueWrite> writes) {
+    return inner_.set_values(inner(k), writes);
+}
+
+int32_t CachingBackend::delete_value(Handle k, const char *value_name) {
+    return inner_.delete_value(inner(k), value_name);
+}
+
+int32_t CachingBackend::watch(Handle k, Handle &w) {
+    return inner_.watch(inner(k), w);
+}
+
+int32_t CachingBackend::wait_change(Handle w, uint32_t timeout_ms) {
+    return inner_.wait_change(w, timeout_ms);
+}
+
+void CachingBackend::unwatch(Handle w) {
+    inner_.unwatch(w);
+}
+
+Handle CachingBackend::inner(Handle k) {
+    return k == InvalidHandle ? InvalidHandle : ((const Entry *) k)->inner;
+}
+
+CachingBackend::Paths::value_type &
+CachingBackend::intern(const std::string &path) {
+    const auto [it, inserted] = paths_.try_emplace(path);
+    if (inserted) {
+        it->second = {.id = next_path_id_++, .entries = 0};
+    }
+    return *it;
+}
+
+CachingBackend::Entry *CachingBackend::add_entry(Paths::value_type &path,
+                                                 uint64_t id, Handle h,
+                                                 size_t refs, bool system) {
+    path.second.entries++;
+    auto &e = entries_[id];
+    e = std::make_unique<Entry>(Entry {
+        .inner = h,
+        .path = &path,
+        .id = id,
+        .refs = refs,
+        .system = system,
+        .lru = {},
+    });
+    return e.get();
+}
+
+void CachingBackend::evict() {
+    while (stats_.open_handles > capacity_ && !idle_.empty()) {
+        Entry *e = idle_.back();
+        idle_.pop_back();
+        inner_.close(e->inner);
+        stats_.open_handles--;
+        stats_.evictions++;
+        if (--e->path->second.entries == 0) {
+            paths_.erase(paths_.find(e->path->first));
+        }
+        entries_.erase(e->id);
+    }
+}
+
+} // namespace reg
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "reg.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace reg {
+
+// Backend wrapper which keeps keys of another backend open after reg::Key
+// closes them, so reopening a hot key is a hash lookup instead of a backend
+// call. Keys are identified by their interned, case-folded path and access
+// mask. At most `capacity` handles stay open; unused ones are closed least
+// recently used first, while the ones still used by some reg::Key are never
+// closed and may push the count over the bound. All methods are safe to call
+// concurrently.
+class CachingBackend : public Backend {
+  public:
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+        size_t open_handles;
+        // Paths kept for lookups, the ones of system keys included
+        size_t paths;
+    };
+
+    CachingBackend(Backend &inner, size_t capacity);
+
+    // Closes all cached handles, every reg::Key using them must be gone
+    ~CachingBackend();
+
+    CachingBackend(const CachingBackend &) = delete;
+    CachingBackend &operator=(const CachingBackend &) = delete;
+
+    Stats stats() const;
+
+    Handle root(SystemKey sk) override;
+    int32_t open(Handle parent, const char *subkey_name, Access access,
+                 Handle &k) override;
+    int32_t create(Handle parent, const char *subkey_name, Access access,
+                   Handle &k) override;
+    void close(Handle k) override;
+    int32_t query_info(Handle k, KeyInfo &info) override;
+    int32_t enum_subkey(Handle k, uint32_t idx, char *name,
+                        uint32_t &size) override;
+    int32_t enum_value(Handle k, uint32_t idx, char *name,
+                       uint32_t &name_size, ValueType &type, void *data,
+                       uint32_t &size) override;
+    int32_t get_value(Handle k, const char *value_name, ValueType type,
+                      void *data, uint32_t &size) override;
+    int32_t get_values(Handle k, std::span<ValueEntry> entries, void *data,
+                       uint32_t &size) override;
+    int32_t set_value(Handle k, const char *subkey_name,
+                      const char *value_name, ValueType type, const void *data,
+                      uint32_t size) override;
+    int32_t set_values(Handle k,
+                       std::span<const ValueWrite> writes) override;
+    int32_t delete_value(Handle k, const char *value_name) override;
+    // Watch handles are the ones of the wrapped backend
+    int32_t watch(Handle k, Handle &w) override;
+    int32_t wait_change(Handle w, uint32_t timeout_ms) override;
+    void unwatch(Handle w) override;
+
+  private:
+    // Interned paths are dropped with the last entry using them, so their
+    // ids come from a counter rather than from the count of paths
+    struct PathRefs {
+        uint32_t id;
+        size_t entries;
+    };
+    using Paths = std::unordered_map<std::string, PathRefs>;
+
+    // Handles given out are addresses of entries, so forwarding a call needs
+    // no lookup
+    struct Entry {
+        Handle inner;
+        Paths::value_type *path;
+        uint64_t id;
+        size_t refs;
+        bool system;
+        std::list<Entry *>::iterator lru;
+    };
+
+    static Handle inner(Handle k);
+
+    // Expect the mutex to be held by the caller
+    Paths::value_type &intern(const std::string &path);
+    // Makes an entry for a newly opened handle and counts it for its path
+    Entry *add_entry(Paths::value_type &path, uint64_t id, Handle h,
+                     size_t refs, bool system);
+    void evict();
+
+    Backend &inner_;
+    size_t capacity_;
+    mutable std::mutex mutex_;
+    Paths paths_;
+    uint32_t next_path_id_;
+    std::unordered_map<uint64_t, std::unique_ptr<Entry>> entries_;
+    // Entries not used by any reg::Key, most recently used first
+    std::list<Entry *> idle_;
+    // Reused for building paths, so that hits do not allocate
+    std::string scratch_;
+    Stats stats_;
+};
+
+} // namespace reg
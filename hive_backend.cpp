@@ -0,0 +1,806 @@
+#include "hive_backend.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <format>
+#include <utility>
+
+namespace {
+
+using Cell = std::span<const uint8_t>;
+
+constexpr size_t BaseBlockSize = 0x1000;
+constexpr uint32_t NoCell = UINT32_MAX;
+constexpr uint32_t DataInline = 0x80000000;
+constexpr uint32_t BigDataSegmentSize = 16344;
+// Key names have at most 255 UTF-16 chars, which is at most 765 UTF-8 bytes.
+// Longer value names are cut, which is fine for any sane lookup.
+constexpr size_t MaxNameSize = 1024;
+
+// Field offsets of the records, relative to the cell data
+namespace base {
+constexpr size_t Signature = 0x00;
+constexpr size_t PrimarySequence = 0x04;
+constexpr size_t SecondarySequence = 0x08;
+constexpr size_t LastWriteTime = 0x0C;
+constexpr size_t Major = 0x14;
+constexpr size_t Type = 0x1C;
+constexpr size_t RootCell = 0x24;
+constexpr size_t BinsSize = 0x28;
+constexpr size_t Checksum = 0x1FC;
+} // namespace base
+
+namespace nk {
+constexpr size_t Flags = 0x02;
+constexpr size_t LastWriteTime = 0x04;
+constexpr size_t SubkeysCount = 0x14;
+constexpr size_t SubkeysList = 0x1C;
+constexpr size_t ValuesCount = 0x24;
+constexpr size_t ValuesList = 0x28;
+constexpr size_t MaxSubkeyNameLen = 0x34;
+constexpr size_t NameLen = 0x48;
+constexpr size_t Name = 0x4C;
+constexpr uint16_t CompName = 0x0020;
+} // namespace nk
+
+namespace vk {
+constexpr size_t NameLen = 0x02;
+constexpr size_t DataSize = 0x04;
+constexpr size_t Data = 0x08;
+constexpr size_t Type = 0x0C;
+constexpr size_t Flags = 0x10;
+constexpr size_t Name = 0x14;
+constexpr uint16_t CompName = 0x0001;
+} // namespace vk
+
+// Reads a little-endian field, out of bounds fields read as 0
+template <typename T> T load(Cell c, size_t offset) {
+    T v {};
+    if (offset + sizeof(T) <= c.size()) {
+        std::memcpy(&v, c.data() + offset, sizeof(T));
+    }
+    return v;
+}
+
+template <typename T> void store(uint8_t *p, size_t offset, T v) {
+    std::memcpy(p + offset, &v, sizeof(T));
+}
+
+// XOR of the dwords before the checksum field of the base block
+uint32_t base_checksum(Cell base_block) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < base::Checksum; i += 4) {
+        sum ^= load<uint32_t>(base_block, i);
+    }
+    if (sum == UINT32_MAX) {
+        return UINT32_MAX - 1;
+    }
+    return sum == 0 ? 1 : sum;
+}
+
+// Current time as a FILETIME, in 100 ns units since 1601
+uint64_t filetime_now() {
+    constexpr uint64_t UnixEpoch = 116444736000000000;
+    using Ticks = std::chrono::duration<int64_t, std::ratio<1, 10000000>>;
+    const Ticks since_epoch = std::chrono::duration_cast<Ticks>(
+        std::chrono::system_clock::now().time_since_epoch());
+    return UnixEpoch + (uint64_t) since_epoch.count();
+}
+
+bool has_signature(Cell c, const char (&sig)[3]) {
+    return c.size() >= 2 && c[0] == sig[0] && c[1] == sig[1];
+}
+
+// Returns the data of an allocated cell, empty if there is no such cell
+Cell cell(Cell bins, uint32_t offset) {
+    if (offset == NoCell || (size_t) offset + 4 > bins.size()) {
+        return {};
+    }
+    const int32_t size = load<int32_t>(bins, offset);
+    if (size >= 0) {
+        return {}; // free cell
+    }
+    const size_t len = (size_t) -(int64_t) size;
+    if (len < 4 || offset + len > bins.size()) {
+        return {};
+    }
+    return bins.subspan(offset + 4, len - 4);
+}
+
+// Returns a cell holding a record with given signature and a fixed part of
+// given size
+Cell record(Cell bins, uint32_t offset, const char (&sig)[3],
+            size_t fixed_size) {
+    const Cell c = cell(bins, offset);
+    if (c.size() < fixed_size || !has_signature(c, sig)) {
+        return {};
+    }
+    return c;
+}
+
+Cell key_record(Cell bins, uint32_t offset) {
+    const Cell c = record(bins, offset, "nk", nk::Name);
+    if (c.size() < nk::Name + load<uint16_t>(c, nk::NameLen)) {
+        return {};
+    }
+    return c;
+}
+
+Cell value_record(Cell bins, uint32_t offset) {
+    const Cell c = record(bins, offset, "vk", vk::Name);
+    if (c.size() < vk::Name + load<uint16_t>(c, vk::NameLen)) {
+        return {};
+    }
+    return c;
+}
+
+// Output of decoded data. Writes only what fits in the buffer but keeps
+// counting, so the required size is known after a single pass.
+struct Sink {
+    uint8_t *out;
+    size_t capacity;
+    size_t size;
+    size_t trailing_nuls;
+
+    void put_byte(uint8_t b) {
+        if (size < capacity) {
+            out[size] = b;
+        }
+        size++;
+    }
+
+    void put(uint32_t cp) {
+        if (cp < 0x80) {
+            put_byte((uint8_t) cp);
+        } else if (cp < 0x800) {
+            put_byte((uint8_t) (0xc0 | (cp >> 6)));
+            put_byte((uint8_t) (0x80 | (cp & 0x3f)));
+        } else if (cp < 0x10000) {
+            put_byte((uint8_t) (0xe0 | (cp >> 12)));
+            put_byte((uint8_t) (0x80 | ((cp >> 6) & 0x3f)));
+            put_byte((uint8_t) (0x80 | (cp & 0x3f)));
+        } else {
+            put_byte((uint8_t) (0xf0 | (cp >> 18)));
+            put_byte((uint8_t) (0x80 | ((cp >> 12) & 0x3f)));
+            put_byte((uint8_t) (0x80 | ((cp >> 6) & 0x3f)));
+            put_byte((uint8_t) (0x80 | (cp & 0x3f)));
+        }
+        trailing_nuls = cp == 0 ? trailing_nuls + 1 : 0;
+    }
+
+    void append(Cell bytes) {
+        if (size + bytes.size() <= capacity) {
+            std::memcpy(out + size, bytes.data(), bytes.size());
+        }
+        size += bytes.size();
+    }
+};
+
+// Decodes UTF-16LE text which may be split into chunks. A high surrogate
+// ending a chunk is kept in `pending` until the next one.
+void decode_utf16(Cell bytes, Sink &sink, uint32_t &pending) {
+    for (size_t i = 0; i + 1 < bytes.size(); i += 2) {
+        const uint32_t unit = load<uint16_t>(bytes, i);
+        if (pending != 0) {
+            if (unit >= 0xdc00 && unit < 0xe000) {
+                sink.put(0x10000 + ((pending - 0xd800) << 10) +
+                         (unit - 0xdc00));
+                pending = 0;
+                continue;
+            }
+            sink.put(0xfffd);
+            pending = 0;
+        }
+        if (unit >= 0xd800 && unit < 0xdc00) {
+            pending = unit;
+        } else if (unit >= 0xdc00 && unit < 0xe000) {
+            sink.put(0xfffd);
+        } else {
+            sink.put(unit);
+        }
+    }
+}
+
+// Decodes a key or value name into a buffer of MaxNameSize chars
+std::string_view decode_name(Cell raw, bool compressed, char *buf) {
+    Sink sink {(uint8_t *) buf, MaxNameSize, 0, 0};
+    if (compressed) {
+        for (uint8_t c : raw) {
+            sink.put(c); // Latin-1
+        }
+    } else {
+        uint32_t pending = 0;
+        decode_utf16(raw, sink, pending);
+    }
+    return {buf, std::min(sink.size, MaxNameSize)};
+}
+
+std::string_view key_name(Cell nk_cell, char *buf) {
+    const size_t len = load<uint16_t>(nk_cell, nk::NameLen);
+    const bool compressed = load<uint16_t>(nk_cell, nk::Flags) & nk::CompName;
+    return decode_name(nk_cell.subspan(nk::Name, len), compressed, buf);
+}
+
+std::string_view value_name(Cell vk_cell, char *buf) {
+    const size_t len = load<uint16_t>(vk_cell, vk::NameLen);
+    const bool compressed = load<uint16_t>(vk_cell, vk::Flags) & vk::CompName;
+    return decode_name(vk_cell.subspan(vk::Name, len), compressed, buf);
+}
+
+// Hash stored in "lh" subkey lists, computed only for ASCII names
+bool name_hash(std::string_view name, uint32_t &hash) {
+    hash = 0;
+    for (char c : name) {
+        if ((unsigned char) c >= 0x80) {
+            return false;
+        }
+        hash = hash * 37 + (uint32_t) std::toupper((unsigned char) c);
+    }
+    return true;
+}
+
+// Number of entries of a subkey list, the stored count cut to what the cell
+// holds, so that a broken or crafted count is never looped over
+uint32_t list_count(Cell list) {
+    size_t entry_size;
+    if (has_signature(list, "lf") || has_signature(list, "lh")) {
+        entry_size = 8;
+    } else if (has_signature(list, "li") || has_signature(list, "ri")) {
+        entry_size = 4;
+    } else {
+        return 0;
+    }
+    const size_t capacity =
+        list.size() < 4 ? 0 : (list.size() - 4) / entry_size;
+    return (uint32_t) std::min<size_t>(load<uint16_t>(list, 2), capacity);
+}
+
+// Returns an entry of a leaf subkey list ("lf", "lh" or "li")
+uint32_t leaf_entry(Cell list, uint32_t idx) {
+    if (idx >= list_count(list)) {
+        return NoCell;
+    }
+    if (has_signature(list, "lf") || has_signature(list, "lh")) {
+        return load<uint32_t>(list, 4 + 8 * (size_t) idx);
+    }
+    if (has_signature(list, "li")) {
+        return load<uint32_t>(list, 4 + 4 * (size_t) idx);
+    }
+    return NoCell;
+}
+
+uint32_t subkey_at(Cell bins, uint32_t list_offset, uint32_t idx) {
+    const Cell list = cell(bins, list_offset);
+    if (!has_signature(list, "ri")) {
+        return leaf_entry(list, idx);
+    }
+    // Index root, a list of leaf lists
+    const uint32_t count = list_count(list);
+    for (uint32_t i = 0; i < count; i++) {
+        const Cell leaf = cell(bins, load<uint32_t>(list, 4 + 4 * (size_t) i));
+        const uint32_t leaf_count = list_count(leaf);
+        if (idx < leaf_count) {
+            return leaf_entry(leaf, idx);
+        }
+        idx -= leaf_count;
+    }
+    return NoCell;
+}
+
+// Reads the subkeys count of a key, fails if its list holds fewer entries
+bool subkeys_count(Cell bins, Cell nk_cell, uint32_t &count) {
+    count = load<uint32_t>(nk_cell, nk::SubkeysCount);
+    if (count == 0) {
+        return true;
+    }
+    const Cell list = cell(bins, load<uint32_t>(nk_cell, nk::SubkeysList));
+    if (!has_signature(list, "ri")) {
+        return count <= list_count(list);
+    }
+    uint64_t entries = 0;
+    const uint32_t leaves = list_count(list);
+    for (uint32_t i = 0; i < leaves; i++) {
+        entries +=
+            list_count(cell(bins, load<uint32_t>(list, 4 + 4 * (size_t) i)));
+    }
+    return count <= entries;
+}
+
+// Finds the value list of a key, fails if it is shorter than the values count
+bool value_list(Cell bins, Cell nk_cell, Cell &list, uint32_t &count) {
+    count = load<uint32_t>(nk_cell, nk::ValuesCount);
+    list = count == 0 ? Cell {}
+                      : cell(bins, load<uint32_t>(nk_cell, nk::ValuesList));
+    return count <= list.size() / 4;
+}
+
+uint32_t find_in_leaf(Cell bins, Cell leaf, std::string_view name,
+                      bool hashed, uint32_t hash) {
+    const bool lh = has_signature(leaf, "lh");
+    const uint32_t count = list_count(leaf);
+    char buf[MaxNameSize];
+    for (uint32_t i = 0; i < count; i++) {
+        if (lh && hashed && load<uint32_t>(leaf, 8 + 8 * (size_t) i) != hash) {
+            continue; // skip without touching the subkey cell
+        }
+        const uint32_t offset = leaf_entry(leaf, i);
+        const Cell subkey = key_record(bins, offset);
+        if (!subkey.empty() && reg::equal_names(key_name(subkey, buf), name)) {
+            return offset;
+        }
+    }
+    return NoCell;
+}
+
+int32_t find_value(Cell bins, Cell nk_cell, std::string_view name, Cell &v) {
+    Cell list;
+    uint32_t count;
+    if (!value_list(bins, nk_cell, list, count)) {
+        return reg::status::BadDb;
+    }
+    char buf[MaxNameSize];
+    for (uint32_t i = 0; i < count; i++) {
+        v = value_record(bins, load<uint32_t>(list, 4 * (size_t) i));
+        if (!v.empty() && reg::equal_names(value_name(v, buf), name)) {
+            return reg::status::Success;
+        }
+    }
+    v = {};
+    return reg::status::FileNotFound;
+}
+
+// Calls fn for every chunk of value data, returns false if the data is broken
+template <typename Fn> bool for_each_data_chunk(Cell bins, Cell v, Fn &&fn) {
+    const uint32_t raw_size = load<uint32_t>(v, vk::DataSize);
+    const uint32_t size = raw_size & ~DataInline;
+    if (raw_size & DataInline) {
+        if (size > sizeof(uint32_t)) {
+            return false;
+        }
+        fn(v.subspan(vk::Data, size));
+        return true;
+    }
+    if (size == 0) {
+        return true;
+    }
+    const Cell data = cell(bins, load<uint32_t>(v, vk::Data));
+    if (size > BigDataSegmentSize && has_signature(data, "db")) {
+        const uint16_t count = load<uint16_t>(data, 2);
+        const Cell segments = cell(bins, load<uint32_t>(data, 4));
+        uint32_t remaining = size;
+        for (uint16_t i = 0; i < count && remaining > 0; i++) {
+            const Cell segment =
+                cell(bins, load<uint32_t>(segments, 4 * (size_t) i));
+            const uint32_t len = std::min(remaining, BigDataSegmentSize);
+            if (segment.size() < len) {
+                return false;
+            }
+            fn(segment.first(len));
+            remaining -= len;
+        }
+        return remaining == 0;
+    }
+    if (data.size() < size) {
+        return false;
+    }
+    fn(data.first(size));
+    return true;
+}
+
+bool is_text(reg::ValueType type) {
+    return type == reg::ValueType::String ||
+           type == reg::ValueType::ExpandString ||
+           type == reg::ValueType::MultiString;
+}
+
+// Puts value data into a sink, converting text to UTF-8. Returned strings are
+// always terminated, like with RegGetValue.
+bool read_data(Cell bins, Cell v, Sink &sink) {
+    const reg::ValueType type = (reg::ValueType) load<uint32_t>(v, vk::Type);
+    const bool text = is_text(type);
+    uint32_t pending = 0;
+    sink.trailing_nuls = 0;
+    const bool intact = for_each_data_chunk(bins, v, [&](Cell chunk) {
+        if (text) {
+            decode_utf16(chunk, sink, pending);
+        } else {
+            sink.append(chunk);
+        }
+    });
+    if (!intact) {
+        return false;
+    }
+    if (text) {
+        if (pending != 0) {
+            sink.put(0xfffd);
+        }
+        const size_t nuls = type == reg::ValueType::MultiString ? 2 : 1;
+        while (sink.trailing_nuls < nuls) {
+            sink.put(0);
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+namespace reg {
+
+HiveBackend::HiveBackend(const std::string &path, MappedFile::Mode mode)
+    : file_ {path, mode}, bins_ {}, root_cell_ {NoCell},
+      error_ {file_.error()}, dirty_ {false} {
+    if (!file_.valid()) {
+        return;
+    }
+    const Cell data = file_.data();
+    if (data.size() < BaseBlockSize ||
+        std::memcmp(data.data() + base::Signature, "regf", 4) != 0 ||
+        load<uint32_t>(data, base::Major) != 1 ||
+        load<uint32_t>(data, base::Type) != 0) {
+        error_ = status::BadDb;
+        return;
+    }
+    const size_t bins_size = std::min<size_t>(
+        load<uint32_t>(data, base::BinsSize), data.size() - BaseBlockSize);
+    bins_ = data.subspan(BaseBlockSize, bins_size);
+    root_cell_ = load<uint32_t>(data, base::RootCell);
+    if (key_record(bins_, root_cell_).empty()) {
+        error_ = status::BadDb;
+        bins_ = {};
+        root_cell_ = NoCell;
+    }
+}
+
+HiveBackend::~HiveBackend() {
+    flush();
+}
+
+bool HiveBackend::valid() const {
+    return error_ == status::Success;
+}
+
+int32_t HiveBackend::error() const {
+    return error_;
+}
+
+int32_t HiveBackend::flush() {
+    if (!dirty_) {
+        return status::Success;
+    }
+    // Equal sequence numbers tell the hive is consistent
+    uint8_t *base_block = file_.writable_data().data();
+    store<uint32_t>(base_block, base::SecondarySequence,
+                    load<uint32_t>(file_.data(), base::PrimarySequence));
+    store<uint32_t>(base_block, base::Checksum, base_checksum(file_.data()));
+    dirty_ = false;
+    return file_.flush();
+}
+
+Handle HiveBackend::root(SystemKey sk) {
+    (void) sk; // the hive has only one root
+    return valid() ? (Handle) root_cell_ : InvalidHandle;
+}
+
+int32_t HiveBackend::open(Handle parent, const char *subkey_name,
+                          Access access, Handle &k) {
+    (void) access; // the mapping mode decides about writes
+    if (key_record(bins_, (uint32_t) parent).empty()) {
+        return status::InvalidHandle;
+    }
+    uint32_t offset = (uint32_t) parent;
+    std::string_view path = subkey_name;
+    for (;;) {
+        const std::string_view name = next_path_component(path);
+        if (name.empty()) {
+            break;
+        }
+        uint32_t next = find_subkey(offset, name);
+        if (next == NoCell && offset == root_cell_ &&
+            equal_names(name, "CurrentControlSet")) {
+            next = current_control_set();
+        }
+        if (next == NoCell) {
+            return status::FileNotFound;
+        }
+        offset = next;
+    }
+    k = offset;
+    return status::Success;
+}
+
+int32_t HiveBackend::create(Handle parent, const char *subkey_name,
+                            Access access, Handle &k) {
+    (void) parent;
+    (void) subkey_name;
+    (void) access;
+    (void) k;
+    return file_.writable_data().empty() ? status::AccessDenied
+                                         : status::NotSupported;
+}
+
+void HiveBackend::close(Handle k) {
+    (void) k;
+}
+
+int32_t HiveBackend::query_info(Handle k, KeyInfo &info) {
+    const Cell c = key_record(bins_, (uint32_t) k);
+    if (c.empty()) {
+        return status::InvalidHandle;
+    }
+    // Callers size their loops and buffers by the counts
+    uint32_t subkeys;
+    Cell values_list;
+    uint32_t values;
+    if (!subkeys_count(bins_, c, subkeys) ||
+        !value_list(bins_, c, values_list, values)) {
+        return status::BadDb;
+    }
+    info = {
+        .subkeys_count = subkeys,
+        // Stored in bytes of UTF-16 in the low word
+        .max_subkey_name_len =
+            (load<uint32_t>(c, nk::MaxSubkeyNameLen) & 0xffff) / 2,
+        .values_count = values,
+        .last_write_time = load<uint64_t>(c, nk::LastWriteTime),
+    };
+    return status::Success;
+}
+
+int32_t HiveBackend::enum_subkey(Handle k, uint32_t idx, char *name,
+                                 uint32_t &size) {
+    const Cell c = key_record(bins_, (uint32_t) k);
+    if (c.empty()) {
+        return status::InvalidHandle;
+    }
+    uint32_t count;
+    if (!subkeys_count(bins_, c, count)) {
+        return status::BadDb;
+    }
+    if (idx >= count) {
+        return status::NoMoreItems;
+    }
+    const Cell subkey = key_record(
+        bins_, subkey_at(bins_, load<uint32_t>(c, nk::SubkeysList), idx));
+    if (subkey.empty()) {
+        return status::BadDb;
+    }
+    char buf[MaxNameSize];
+    const std::string_view subkey_name = key_name(subkey, buf);
+    if (size <= subkey_name.size()) {
+        return status::MoreData;
+    }
+    std::memcpy(name, subkey_name.data(), subkey_name.size());
+    name[subkey_name.size()] = '\0';
+    size = (uint32_t) subkey_name.size();
+    return status::Success;
+}
+
+int32_t HiveBackend::enum_value(Handle k, uint32_t idx, char *name,
+                                uint32_t &name_size, ValueType &type,
+                                void *data, uint32_t &size) {
+    const Cell c = key_record(bins_, (uint32_t) k);
+    if (c.empty()) {
+        return status::InvalidHandle;
+    }
+    Cell list;
+    uint32_t count;
+    if (!value_list(bins_, c, list, count)) {
+        return status::BadDb;
+    }
+    if (idx >= count) {
+        return status::NoMoreItems;
+    }
+    const Cell v = value_record(bins_, load<uint32_t>(list, 4 * (size_t) idx));
+    if (v.empty()) {
+        return status::BadDb;
+    }
+    char buf[MaxNameSize];
+    const std::string_view vname = value_name(v, buf);
+    Sink sink {(uint8_t *) data, data != nullptr ? size : 0, 0, 0};
+    if (!read_data(bins_, v, sink)) {
+        return status::BadDb;
+    }
+    const uint32_t name_capacity = name_size;
+    const uint32_t capacity = size;
+    name_size = (uint32_t) vname.size();
+    size = (uint32_t) sink.size;
+    if (name_capacity <= vname.size() || sink.size > capacity) {
+        return status::MoreData;
+    }
+    type = (ValueType) load<uint32_t>(v, vk::Type);
+    std::memcpy(name, vname.data(), vname.size());
+    name[vname.size()] = '\0';
+    return status::Success;
+}
+
+int32_t HiveBackend::get_value(Handle k, const char *value_name,
+                               ValueType type, void *data, uint32_t &size) {
+    const Cell c = key_record(bins_, (uint32_t) k);
+    if (c.empty()) {
+        return status::InvalidHandle;
+    }
+    Cell v;
+    const int32_t res = find_value(bins_, c, value_name, v);
+    if (res != status::Success) {
+        return res;
+    }
+    const ValueType stored = (ValueType) load<uint32_t>(v, vk::Type);
+    const uint32_t stored_size = load<uint32_t>(v, vk::DataSize) & ~DataInline;
+    if (!value_type_matches(type, stored, stored_size)) {
+        return status::UnsupportedType;
+    }
+
+    Sink sink {(uint8_t *) data, data != nullptr ? size : 0, 0, 0};
+    if (!read_data(bins_, v, sink)) {
+        return status::BadDb;
+    }
+    const uint32_t capacity = size;
+    size = (uint32_t) sink.size;
+    if (data == nullptr) {
+        return status::Success;
+    }
+    return sink.size > capacity ? status::MoreData : status::Success;
+}
+
+int32_t HiveBackend::get_values(Handle k, std::span<ValueEntry> entries,
+                                void *data, uint32_t &size) {
+    const Cell c = key_record(bins_, (uint32_t) k);
+    if (c.empty()) {
+        return status::InvalidHandle;
+    }
+    Sink sink {(uint8_t *) data, data != nullptr ? size : 0, 0, 0};
+    for (ValueEntry &entry : entries) {
+        Cell v;
+        const int32_t res = find_value(bins_, c, entry.name, v);
+        if (res != status::Success) {
+            return res;
+        }
+        entry.type = (ValueType) load<uint32_t>(v, vk::Type);
+        entry.offset = (uint32_t) sink.size;
+        if (!read_data(bins_, v, sink)) {
+            return status::BadDb;
+        }
+        entry.size = (uint32_t) sink.size - entry.offset;
+    }
+    const uint32_t capacity = size;
+    size = (uint32_t) sink.size;
+    if (data == nullptr) {
+        return status::Success;
+    }
+    return sink.size > capacity ? status::MoreData : status::Success;
+}
+
+int32_t HiveBackend::set_value(Handle k, const char *subkey_name,
+                               const char *value_name, ValueType type,
+                               const void *data, uint32_t size) {
+    if (file_.writable_data().empty()) {
+        return status::AccessDenied;
+    }
+    Handle target = k;
+    if (subkey_name != nullptr && *subkey_name != '\0') {
+        const int32_t res = open(k, subkey_name, Access::Write, target);
+        if (res != status::Success) {
+            return res;
+        }
+    }
+    const Cell c = key_record(bins_, (uint32_t) target);
+    if (c.empty()) {
+        return status::InvalidHandle;
+    }
+    Cell v;
+    if (find_value(bins_, c, value_name, v) == status::BadDb) {
+        return status::BadDb;
+    }
+    const ValueType stored = (ValueType) load<uint32_t>(v, vk::Type);
+    // Text is stored as UTF-16, so its size changes on the way in
+    if (v.empty() || is_text(type) || is_text(stored)) {
+        return status::NotSupported;
+    }
+
+    const uint32_t raw_size = load<uint32_t>(v, vk::DataSize);
+    uint8_t *vk_cell = writable(v);
+    uint8_t *dest;
+    if (raw_size & DataInline) {
+        if (size > sizeof(uint32_t)) {
+            return status::NotSupported;
+        }
+        dest = vk_cell + vk::Data;
+        std::memset(dest, 0, sizeof(uint32_t));
+    } else {
+        // Big data is split into segments, which is not worth handling here
+        const Cell old_data = cell(bins_, load<uint32_t>(v, vk::Data));
+        if ((raw_size & ~DataInline) > BigDataSegmentSize ||
+            size > BigDataSegmentSize || old_data.size() < size) {
+            return status::NotSupported;
+        }
+        dest = writable(old_data);
+    }
+
+    begin_write();
+    std::memcpy(dest, data, size);
+    store<uint32_t>(vk_cell, vk::DataSize, size | (raw_size & DataInline));
+    store<uint32_t>(vk_cell, vk::Type, std::to_underlying(type));
+    store<uint64_t>(writable(c), nk::LastWriteTime, filetime_now());
+    return status::Success;
+}
+
+int32_t HiveBackend::delete_value(Handle k, const char *value_name) {
+    (void) k;
+    (void) value_name;
+    return file_.writable_data().empty() ? status::AccessDenied
+                                         : status::NotSupported;
+}
+
+int32_t HiveBackend::watch(Handle k, Handle &w) {
+    // The mapping is a snapshot of the file, it never changes
+    (void) k;
+    (void) w;
+    return status::NotSupported;
+}
+
+int32_t HiveBackend::wait_change(Handle w, uint32_t timeout_ms) {
+    (void) w;
+    (void) timeout_ms;
+    return status::InvalidHandle;
+}
+
+void HiveBackend::unwatch(Handle w) {
+    (void) w;
+}
+
+uint32_t HiveBackend::find_subkey(uint32_t nk_offset,
+                                  std::string_view name) const {
+    const Cell c = key_record(bins_, nk_offset);
+    uint32_t hash;
+    const bool hashed = name_hash(name, hash);
+    const Cell list = cell(bins_, load<uint32_t>(c, nk::SubkeysList));
+    if (!has_signature(list, "ri")) {
+        return find_in_leaf(bins_, list, name, hashed, hash);
+    }
+    const uint32_t count = list_count(list);
+    for (uint32_t i = 0; i < count; i++) {
+        const Cell leaf =
+            cell(bins_, load<uint32_t>(list, 4 + 4 * (size_t) i));
+        const uint32_t offset = find_in_leaf(bins_, leaf, name, hashed, hash);
+        if (offset != NoCell) {
+            return offset;
+        }
+    }
+    return NoCell;
+}
+
+uint8_t *HiveBackend::writable(std::span<const uint8_t> part) const {
+    return file_.writable_data().data() + (part.data() - file_.data().data());
+}
+
+void HiveBackend::begin_write() {
+    if (dirty_) {
+        return;
+    }
+    uint8_t *base_block = file_.writable_data().data();
+    const Cell base_view = file_.data();
+    store<uint32_t>(base_block, base::PrimarySequence,
+                    load<uint32_t>(base_view, base::PrimarySequence) + 1);
+    store<uint64_t>(base_block, base::LastWriteTime, filetime_now());
+    store<uint32_t>(base_block, base::Checksum, base_checksum(base_view));
+    dirty_ = true;
+}
+
+uint32_t HiveBackend::current_control_set() const {
+    const Cell select = key_record(bins_, find_subkey(root_cell_, "Select"));
+    Cell current;
+    find_value(bins_, select, "Current", current);
+    uint32_t value = 0;
+    for_each_data_chunk(bins_, current, [&](Cell chunk) {
+        if (chunk.size() == sizeof(value)) {
+            value = load<uint32_t>(chunk, 0);
+        }
+    });
+    if (value == 0) {
+        return NoCell;
+    }
+    return find_subkey(root_cell_, std::format("ControlSet{:03}", value));
+}
+
+} // namespace reg
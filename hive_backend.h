@@ -0,0 +1,80 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "reg.h"
+
+namespace reg {
+
+// Backend serving an offline REGF hive file (e.g. an exported SYSTEM hive).
+// The file is mapped into memory and every call reads the cells it needs
+// straight from the mapping, so nothing is parsed or copied up front and only
+// the touched pages are ever loaded. The system key stands for the root key
+// of the hive. A missing CurrentControlSet key is resolved to the control set
+// selected in the hive, like the live registry does.
+//
+// Mapped with MappedFile::Mode::ReadWrite, existing values of non-text types
+// can be overwritten in place, as long as the new data fits where the old
+// one is stored (e.g. a 4 byte value over another one). Anything which would
+// change the layout of the hive (new keys or values, text, growing data) is
+// refused with status::NotSupported. Writes go straight to the mapping and
+// must not run concurrently with other calls; the header is completed and
+// the file flushed by flush() or at destruction.
+class HiveBackend : public Backend {
+  public:
+    explicit HiveBackend(const std::string &path,
+                         MappedFile::Mode mode = MappedFile::Mode::Read);
+
+    // Flushes pending writes
+    ~HiveBackend() override;
+
+    // Whether the file has been mapped and looks like a primary hive file
+    bool valid() const;
+    // Status code of the failed load, status::Success if valid
+    int32_t error() const;
+    // Marks the hive as consistent again after writes and stores them in the
+    // file
+    int32_t flush();
+
+    Handle root(SystemKey sk) override;
+    int32_t open(Handle parent, const char *subkey_name, Access access,
+                 Handle &k) override;
+    int32_t create(Handle parent, const char *subkey_name, Access access,
+                   Handle &k) override;
+    void close(Handle k) override;
+    int32_t query_info(Handle k, KeyInfo &info) override;
+    int32_t enum_subkey(Handle k, uint32_t idx, char *name,
+                        uint32_t &size) override;
+    int32_t enum_value(Handle k, uint32_t idx, char *name,
+                       uint32_t &name_size, ValueType &type, void *data,
+                       uint32_t &size) override;
+    int32_t get_value(Handle k, const char *value_name, ValueType type,
+                      void *data, uint32_t &size) override;
+    int32_t get_values(Handle k, std::span<ValueEntry> entries, void *data,
+                       uint32_t &size) override;
+    int32_t set_value(Handle k, const char *subkey_name,
+                      const char *value_name, ValueType type, const void *data,
+                      uint32_t size) override;
+    int32_t delete_value(Handle k, const char *value_name) override;
+    int32_t watch(Handle k, Handle &w) override;
+    int32_t wait_change(Handle w, uint32_t timeout_ms) override;
+    void unwatch(Handle w) override;
+
+  private:
+    uint32_t find_subkey(uint32_t nk, std::string_view name) const;
+    uint32_t current_control_set() const;
+    // Writable bytes of a part of the mapping
+    uint8_t *writable(std::span<const uint8_t> part) const;
+    // Bumps the primary sequence number before the first write, so that an
+    // interrupted update is recognized as such
+    void begin_write();
+
+    MappedFile file_;
+    // Hive bins following the base block, cell offsets are relative to it
+    std::span<const uint8_t> bins_;
+    uint32_t root_cell_;
+    int32_t error_;
+    // Written since the last flush
+    bool dirty_;
+};
+
+} // namespace reg
@@ -0,0 +1,166 @@
+#include "inventory.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <system_error>
+
+namespace {
+
+// Native byte order, the cache never leaves the machine which wrote it
+constexpr char Magic[8] = {'M', 'E', 'D', 'I', 'N', 'V', '0', '1'};
+
+enum StringField : uint8_t {
+    SubkeyName,
+    DriverDesc,
+    DriverVersion,
+    DriverDate,
+    ProviderName,
+    StringFieldCount,
+};
+
+struct Header {
+    char magic[8];
+    uint32_t count;
+    uint32_t strings_size;
+};
+
+// Followed by the records and then by the string area
+struct Record {
+    uint64_t main_write_time;
+    uint64_t ps_write_time;
+    // Offset into the string area and length of every string
+    uint32_t strings[StringFieldCount][2];
+    uint32_t ps[3];
+    uint32_t reserved;
+};
+
+static_assert(sizeof(Header) == 16 && sizeof(Record) == 72);
+
+std::string_view string_at(const Record &r, StringField field,
+                           std::string_view strings, bool &ok) {
+    const uint32_t offset = r.strings[field][0];
+    const uint32_t size = r.strings[field][1];
+    if ((size_t) offset + size > strings.size()) {
+        ok = false;
+        return {};
+    }
+    return strings.substr(offset, size);
+}
+
+} // namespace
+
+MediaInventory::MediaInventory(const std::string &path)
+    : file_ {path}, valid_ {false}, count_ {0}, records_ {}, strings_ {} {
+    const std::span<const uint8_t> data = file_.data();
+    Header header;
+    if (data.size() < sizeof(header)) {
+        return;
+    }
+    std::memcpy(&header, data.data(), sizeof(header));
+    const size_t records_size = (size_t) header.count * sizeof(Record);
+    if (std::memcmp(header.magic, Magic, sizeof(Magic)) != 0 ||
+        data.size() != sizeof(header) + records_size + header.strings_size) {
+        return;
+    }
+    valid_ = true;
+    count_ = header.count;
+    records_ = data.subspan(sizeof(header), records_size);
+    strings_ = std::string_view(
+        (const char *) data.data() + sizeof(header) + records_size,
+        header.strings_size);
+}
+
+bool MediaInventory::valid() const {
+    return valid_;
+}
+
+size_t MediaInventory::size() const {
+    return count_;
+}
+
+bool MediaInventory::restore(std::string_view subkey_name, size_t hint,
+                             uint64_t main_write_time, uint64_t ps_write_time,
+                             Driver &drv, PowerSettings &ps) const {
+    for (size_t n = 0; n < count_; n++) {
+        const size_t idx = (hint + n) % count_;
+        Record r;
+        std::memcpy(&r, records_.data() + idx * sizeof(Record), sizeof(r));
+        bool ok = true;
+        if (!reg::equal_names(string_at(r, SubkeyName, strings_, ok),
+                              subkey_name) ||
+            !ok) {
+            continue;
+        }
+        if (r.main_write_time != main_write_time ||
+            r.ps_write_time != ps_write_time) {
+            return false;
+        }
+        const std::string_view desc = string_at(r, DriverDesc, strings_, ok);
+        const std::string_view version =
+            string_at(r, DriverVersion, strings_, ok);
+        const std::string_view date = string_at(r, DriverDate, strings_, ok);
+        const std::string_view provider_name =
+            string_at(r, ProviderName, strings_, ok);
+        if (!ok) {
+            return false;
+        }
+        // Assigned, so the strings stay with the allocator of `drv`
+        drv.desc = desc;
+        drv.version = version;
+        drv.date = date;
+        drv.provider_name = provider_name;
+        ps = PowerSettings {
+            .cons_idle_time = r.ps[0],
+            .perf_idle_time = r.ps[1],
+            .idle_power_state = r.ps[2],
+        };
+        return true;
+    }
+    return false;
+}
+
+bool save_inventory(const std::string &path, const MediaScan &scan) {
+    std::vector<Record> records;
+    std::string strings;
+    records.reserve(scan.media_infos.size());
+    for (const MediaInfo &mi : scan.media_infos) {
+        Record r {
+            .main_write_time = mi.main_write_time,
+            .ps_write_time = mi.ps_write_time,
+            .strings = {},
+            .ps = {mi.ps.cons_idle_time, mi.ps.perf_idle_time,
+                   mi.ps.idle_power_state},
+            .reserved = 0,
+        };
+        const std::string_view fields[StringFieldCount] = {
+            mi.main_key.path_node()->name, mi.drv.desc, mi.drv.version,
+            mi.drv.date, mi.drv.provider_name};
+        for (uint8_t f = 0; f < StringFieldCount; f++) {
+            r.strings[f][0] = (uint32_t) strings.size();
+            r.strings[f][1] = (uint32_t) fields[f].size();
+            strings += fields[f];
+        }
+        records.push_back(r);
+    }
+    Header header {
+        .magic = {},
+        .count = (uint32_t) records.size(),
+        .strings_size = (uint32_t) strings.size(),
+    };
+    std::memcpy(header.magic, Magic, sizeof(Magic));
+
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write((const char *) &header, sizeof(header));
+        out.write((const char *) records.data(),
+                  (std::streamsize) (records.size() * sizeof(Record)));
+        out.write(strings.data(), (std::streamsize) strings.size());
+        if (!out.flush()) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp_path, path, ec);
+    return !ec;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "mapped_file.h"
+#include "media.h"
+
+// On-disk cache of the media instances found by a scan: the driver strings
+// and power settings of every instance, tagged with the last write times of
+// its key and of its PowerSettings key. The file is mapped as a whole and
+// read in place, nothing is parsed up front.
+class MediaInventory {
+  public:
+    // Maps a file written by save_inventory(). A missing or broken file
+    // gives an empty inventory, which simply restores nothing.
+    explicit MediaInventory(const std::string &path);
+
+    bool valid() const;
+    // Number of cached instances
+    size_t size() const;
+
+    // Fills in the driver and power settings of an instance from the cache
+    // if neither of its keys has been written since. Instances are looked
+    // up by subkey name, `hint` is the index tried first.
+    bool restore(std::string_view subkey_name, size_t hint,
+                 uint64_t main_write_time, uint64_t ps_write_time,
+                 Driver &drv, PowerSettings &ps) const;
+
+  private:
+    reg::MappedFile file_;
+    bool valid_;
+    size_t count_;
+    std::span<const uint8_t> records_;
+    std::string_view strings_;
+};
+
+// Writes the instances of a scan made with an inventory. The file is
+// replaced through a temporary one, so a reader never sees half of it; the
+// inventory read from it must be destroyed first. Returns false on failure.
+bool save_inventory(const std::string &path, const MediaScan &scan);
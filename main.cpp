@@ -1,92 +1,155 @@
+#include "arena.h"
+#include "cache_backend.h"
+#include "inventory.h"
+#include "media.h"
+#include "overlay_backend.h"
 #include "reg.h"
+#include "regfile.h"
+#include "stats.h"
+#include "write_plan.h"
 
 #include <array>
+#include <chrono>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <optional>
 #include <print>
-
-enum class DriverValue : uint8_t {
-    Desc,
-    Version,
-    Date,
-    ProviderName,
-    _Count,
-};
-
-enum class PowerSettingsValue : uint8_t {
-    ConsIdleTime,
-    PerfIdleTime,
-    IdlePowerState,
-    _Count,
-};
-
-struct Driver {
-    std::string desc;
-    std::string version;
-    std::string date;
-    std::string provider_name;
-
-    using enum DriverValue;
-
-    Driver(std::span<const std::string> data)
-        : desc {data[std::to_underlying(Desc)]},
-          version {data[std::to_underlying(Version)]},
-          date {data[std::to_underlying(Date)]},
-          provider_name {data[std::to_underlying(ProviderName)]} {}
-
-    static auto create_value_names() {
-        std::array<std::string, std::to_underlying(_Count)> arr;
-        arr[std::to_underlying(Desc)] = "DriverDesc";
-        arr[std::to_underlying(Version)] = "DriverVersion";
-        arr[std::to_underlying(Date)] = "DriverDate";
-        arr[std::to_underlying(ProviderName)] = "ProviderName";
-        return arr;
-    }
+#include <string_view>
+#include <thread>
+
+struct Options {
+    size_t jobs;
+    // Only report the instances whose settings differ from the desired ones
+    bool check;
+    // Update every instance which differs once, without asking, and exit
+    bool apply;
+    // Keep every instance at the desired settings until killed
+    bool watch;
+    // Keys kept open between the passes of --watch, none if 0
+    size_t key_cache;
+    // Print the statistics of registry calls after every scan
+    bool stats;
+    // Time a serial scan too and print the speedup over it
+    bool speedup;
+    // Back up the media class key to a .reg file, or apply one, and exit
+    std::string export_path;
+    std::string import_path;
+    // List instances of every device class with a shorter idle time and exit
+    std::optional<uint32_t> find_idle_below;
+    // Patch these offline SYSTEM hives instead of the live registry, only
+    // the instances selected by the filter
+    std::vector<std::string> hives;
+    DriverFilter filter;
+    // Inventory cache file of the live scans, none if empty
+    std::string cache_path;
+    // Write an update or an import to an overlay and only print it
+    bool dry_run;
 };
 
-struct PowerSettings {
-    uint32_t cons_idle_time;
-    uint32_t perf_idle_time;
-    uint32_t idle_power_state;
-
-    using enum PowerSettingsValue;
-
-    constexpr PowerSettings(std::span<const uint32_t> data)
-        : PowerSettings(data[std::to_underlying(ConsIdleTime)],
-                        data[std::to_underlying(PerfIdleTime)],
-                        data[std::to_underlying(IdlePowerState)]) {}
-
-    constexpr PowerSettings(uint32_t cons_idle_time, uint32_t perf_idle_time,
-                            uint32_t idle_power_state)
-        : cons_idle_time {cons_idle_time}, perf_idle_time {perf_idle_time},
-          idle_power_state {idle_power_state} {}
-
-    static auto create_value_names() {
-        std::array<std::string, std::to_underlying(_Count)> arr;
-        arr[std::to_underlying(ConsIdleTime)] = "ConservationIdleTime";
-        arr[std::to_underlying(PerfIdleTime)] = "PerformanceIdleTime";
-        arr[std::to_underlying(IdlePowerState)] = "IdlePowerState";
-        return arr;
+std::optional<Options> parse_options(std::span<char *> args) {
+    Options options {
+        .jobs = std::max(std::thread::hardware_concurrency(), 1U),
+        .check = false,
+        .apply = false,
+        .watch = false,
+        .key_cache = 0,
+        .stats = false,
+        .speedup = false,
+        .export_path = {},
+        .import_path = {},
+        .find_idle_below = std::nullopt,
+        .hives = {},
+        .filter = {},
+        .cache_path = {},
+        .dry_run = false,
+    };
+    for (size_t i = 0; i < args.size(); i++) {
+        const std::string_view arg = args[i];
+        if (arg == "--jobs" && i + 1 < args.size()) {
+            const std::string_view value = args[++i];
+            const auto [conv_end, err] = std::from_chars(
+                value.data(), value.data() + value.size(), options.jobs);
+            if (err != std::errc {} ||
+                conv_end != value.data() + value.size() || options.jobs == 0) {
+                return std::nullopt;
+            }
+        } else if (arg == "--check") {
+            options.check = true;
+        } else if (arg == "--apply") {
+            options.apply = true;
+        } else if (arg == "--watch") {
+            options.watch = true;
+        } else if (arg == "--key-cache" && i + 1 < args.size()) {
+            const std::string_view value = args[++i];
+            const auto [conv_end, err] = std::from_chars(
+                value.data(), value.data() + value.size(), options.key_cache);
+            if (err != std::errc {} ||
+                conv_end != value.data() + value.size() ||
+                options.key_cache == 0) {
+                return std::nullopt;
+            }
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--speedup") {
+            options.speedup = true;
+        } else if (arg == "--export" && i + 1 < args.size()) {
+            options.export_path = args[++i];
+        } else if (arg == "--import" && i + 1 < args.size()) {
+            options.import_path = args[++i];
+        } else if (arg == "--find-idle-below" && i + 1 < args.size()) {
+            const std::string_view value = args[++i];
+            uint32_t max_idle;
+            const auto [conv_end, err] = std::from_chars(
+                value.data(), value.data() + value.size(), max_idle);
+            if (err != std::errc {} ||
+                conv_end != value.data() + value.size()) {
+                return std::nullopt;
+            }
+            options.find_idle_below = max_idle;
+        } else if (arg == "--dry-run") {
+            options.dry_run = true;
+        } else if (arg == "--cache" && i + 1 < args.size()) {
+            options.cache_path = args[++i];
+        } else if (arg == "--hive" && i + 1 < args.size()) {
+            options.hives.emplace_back(args[++i]);
+        } else if (arg == "--driver" && i + 1 < args.size()) {
+            options.filter.desc = args[++i];
+        } else if (arg == "--provider" && i + 1 < args.size()) {
+            options.filter.provider_name = args[++i];
+        } else {
+            return std::nullopt;
+        }
     }
-};
-
-struct MediaInfo {
-    size_t id;
-    reg::Key main_key;
-    reg::Key ps_key;
-    Driver drv;
-    PowerSettings ps;
-
-    std::string description() const {
-        return std::format(
-            "#{} {} | version: {} | date: {} | provider name: {}\n"
-            "(registry key path: {})",
-            id, drv.desc, drv.version.c_str(), drv.date.c_str(),
-            drv.provider_name.c_str(), main_key.path());
+    // --check goes with --hive as a dry run
+    const int modes = (options.check || !options.hives.empty()) +
+                      options.apply + options.watch +
+                      !options.export_path.empty() +
+                      !options.import_path.empty() +
+                      options.find_idle_below.has_value();
+    const bool filtered =
+        !options.filter.desc.empty() || !options.filter.provider_name.empty();
+    // --dry-run goes with the interactive update, --apply or --import
+    const bool dry_run_mode =
+        modes == 0 || options.apply || !options.import_path.empty();
+    // --speedup goes with the scans of the live registry which print it,
+    // without the inventory cache, which would skew it
+    const bool speedup_mode = (modes == 0 || options.check || options.apply) &&
+                              options.hives.empty() &&
+                              options.cache_path.empty();
+    if (modes > 1 || (filtered && options.hives.empty()) ||
+        (options.dry_run && !dry_run_mode) ||
+        (options.speedup && !speedup_mode) ||
+        (options.key_cache > 0 && !options.watch)) {
+        return std::nullopt;
     }
-};
+    return options;
+}
 
 void print_error(const reg::Error &err) {
-    std::println(stderr, "{} (error code: {})", err.msg, err.code);
+    std::println(stderr, "{} (error code: {})", err.msg(), err.code);
 }
 
 bool get_input(std::string &input) {
@@ -98,79 +161,387 @@ bool get_input(std::string &input) {
     return true;
 }
 
-constexpr auto create_update_ps_values() {
-    using enum PowerSettingsValue;
-    std::array<uint32_t, std::to_underlying(_Count)> arr;
-    arr[std::to_underlying(ConsIdleTime)] = 0xffffffff;
-    arr[std::to_underlying(PerfIdleTime)] = 0xffffffff;
-    arr[std::to_underlying(IdlePowerState)] = 0x3;
-    return arr;
+void print_stats() {
+    if (!reg::stats::Enabled) {
+        std::println(stderr, "Statistics are not compiled in, build with "
+                             "REG_STATS=1 to get them");
+        return;
+    }
+    const reg::stats::Snapshot snapshot = reg::stats::snapshot();
+    std::println("{:<26} {:>8} {:>10} {:>10} {:>10} {:>10} {}", "operation",
+                 "calls", "p50 us", "p90 us", "p99 us", "max us", "errors");
+    for (size_t i = 0; i < snapshot.ops.size(); i++) {
+        const reg::stats::OperationStats &op = snapshot.ops[i];
+        if (op.calls == 0) {
+            continue;
+        }
+        std::string errors;
+        for (const auto &[code, count] : op.errors) {
+            errors += std::format("{}{} x code {}",
+                                  errors.empty() ? "" : ", ", count, code);
+        }
+        const auto us = [](uint64_t ns) { return (double) ns / 1000; };
+        std::println("{:<26} {:>8} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {}",
+                     reg::stats::operation_name((reg::Operation) i), op.calls,
+                     us(op.latency.percentile(0.5)),
+                     us(op.latency.percentile(0.9)),
+                     us(op.latency.percentile(0.99)), us(op.latency.max_ns),
+                     errors);
+    }
 }
 
-int main() {
-    const std::string media_path = "SYSTEM\\CurrentControlSet\\Control\\Class\\"
-                                   "{4d36e96c-e325-11ce-bfc1-08002be10318}";
-
-    const reg::Key mk(reg::LocalMachine, media_path);
-    if (!mk.valid()) {
-        std::println(stderr, "Could not open a key {}", mk.path());
-        return -1;
+// Scans the media instances, reusing and refreshing an inventory cache file
+// if one is given
+reg::ReadResult<MediaScan> scan_media_cached(const reg::Key &mk, size_t jobs,
+                                             const std::string &cache_path,
+                                             reg::Arena &arena) {
+    if (cache_path.empty()) {
+        return scan_media(mk, jobs, nullptr, &arena);
     }
+    std::optional<MediaInventory> inventory(std::in_place, cache_path);
+    auto scan_res = scan_media(mk, jobs, &*inventory, &arena);
+    if (!scan_res.has_value()) {
+        return scan_res;
+    }
+    // Rewritten only when something has changed
+    const size_t found = scan_res->media_infos.size();
+    const bool stale = !inventory->valid() || inventory->size() != found ||
+                       scan_res->cached != found;
+    // Unmapped first, the file cannot be replaced while it is mapped
+    inventory.reset();
+    if (stale && !save_inventory(cache_path, scan_res.value())) {
+        std::println(stderr, "Could not write an inventory cache {}",
+                     cache_path);
+    }
+    return scan_res;
+}
 
-    const auto msk_count_res = mk.get_subkeys_count();
-    if (!msk_count_res.has_value()) {
-        print_error(msk_count_res.error());
-        return -1;
+void print_changes(std::span<const PowerSettingChange> changes) {
+    static constexpr auto labels = PowerSettings::create_value_labels();
+    for (const PowerSettingChange &change : changes) {
+        std::println("{:>22} = {:#010x} -> {:#010x}",
+                     labels[std::to_underlying(change.value)], change.current,
+                     change.desired);
     }
-    const uint32_t msk_count = msk_count_res.value();
+}
 
-    std::vector<MediaInfo> media_infos;
-    media_infos.reserve(msk_count);
+// Prints what a dry run would have written
+void print_pending(const reg::OverlayBackend &overlay) {
+    const reg::OverlayBackend::Stats stats = overlay.stats();
+    std::println("Dry run, {} keys and {} values would be changed:",
+                 stats.keys, stats.values);
+    overlay.for_each_change([](const reg::OverlayBackend::Change &c) {
+        switch (c.kind) {
+        case reg::OverlayBackend::ChangeKind::CreateKey:
+            std::println("  create {}", c.path);
+            break;
+        case reg::OverlayBackend::ChangeKind::SetValue:
+            if (c.type == reg::ValueType::U32 && c.data.size() == 4) {
+                uint32_t value;
+                std::memcpy(&value, c.data.data(), sizeof(value));
+                std::println("  set {}\\{} = {:#010x}", c.path, c.value_name,
+                             value);
+            } else {
+                std::println("  set {}\\{} ({} bytes)", c.path, c.value_name,
+                             c.data.size());
+            }
+            break;
+        case reg::OverlayBackend::ChangeKind::DeleteValue:
+            std::println("  delete {}\\{}", c.path, c.value_name);
+            break;
+        }
+    });
+}
 
-    for (uint32_t i = 0; i < msk_count; i++) {
-        const auto msk_name_res = mk.enum_subkey_names(i);
-        if (!msk_name_res.has_value()) {
-            print_error(msk_name_res.error());
+// Prints the instances whose settings differ from the desired ones, returns
+// whether all of them are up to date
+bool check_media(std::span<const MediaInfo> media_infos,
+                 const PowerSettings &desired) {
+    size_t drifted = 0;
+    for (const MediaInfo &mi : media_infos) {
+        const auto changes = diff_power_settings(mi.ps, desired);
+        if (changes.empty()) {
             continue;
         }
-        const std::string msk_name = msk_name_res.value();
+        drifted++;
+        std::println("{}", mi.description());
+        print_changes(changes);
+        std::println("");
+    }
+    std::println("{} of {} media instances differ from the desired settings",
+                 drifted, media_infos.size());
+    return drifted == 0;
+}
 
-        reg::Key msk(mk, msk_name);
-        if (!msk.valid()) {
-            std::println(stderr, "Could not open a key '{}'", msk.path());
+// Writes the desired settings to every instance which differs, returns
+// whether all writes have succeeded
+bool reconcile_media(std::span<const MediaInfo> media_infos,
+                     const PowerSettings &desired) {
+    bool ok = true;
+    for (const MediaInfo &mi : media_infos) {
+        const auto changes = diff_power_settings(mi.ps, desired);
+        if (changes.empty()) {
             continue;
         }
+        std::println("Reapplying power settings of {}", mi.description());
+        print_changes(changes);
+        reg::WritePlan plan;
+        plan_power_settings(mi, changes, plan);
+        const auto write_res = plan.apply();
+        if (write_res.fail) {
+            print_error(write_res.error);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int export_media(const reg::Key &mk, const std::string &path) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        std::println(stderr, "Could not create a file {}", path);
+        return -1;
+    }
+    const auto export_res = reg::export_reg(mk, out);
+    if (!export_res.has_value()) {
+        print_error(export_res.error());
+        return -1;
+    }
+    std::println("Exported {} keys and {} values to {}", export_res->keys,
+                 export_res->values, path);
+    return 0;
+}
+
+int import_media(const reg::Key &lm, const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::println(stderr, "Could not open a file {}", path);
+        return -1;
+    }
+    const auto import_res = reg::import_reg(lm, in);
+    if (import_res.fail) {
+        print_error(import_res.error);
+        return -1;
+    }
+    std::println("Imported {}", path);
+    return 0;
+}
 
-        reg::Key psk(msk, "PowerSettings");
-        if (!psk.valid()) {
-            std::println(stderr, "Could not open a key '{}'", psk.path());
+int find_idle(uint32_t max_idle, size_t jobs, bool stats) {
+    const reg::Key ck(reg::LocalMachine,
+                      "SYSTEM\\CurrentControlSet\\Control\\Class");
+    if (!ck.valid()) {
+        std::println(stderr, "Could not open a key {}", ck.path());
+        return -1;
+    }
+    const auto search_res =
+        find_short_idle_times(ck, max_idle, jobs, [](const IdleMatch &m) {
+            std::println("{}\n"
+                         "Conservation Idle Time = {:#010x}\n"
+                         " Performance Idle Time = {:#010x}\n",
+                         m.path, m.ps.cons_idle_time, m.ps.perf_idle_time);
+        });
+    if (!search_res.has_value()) {
+        print_error(search_res.error());
+        return -1;
+    }
+    std::println("Found {} instances with an idle time below {} ({} keys "
+                 "opened, {} skipped, {} unreadable)",
+                 search_res->matches, max_idle, search_res->keys_opened,
+                 search_res->keys_pruned, search_res->errors);
+    if (stats) {
+        print_stats();
+    }
+    return 0;
+}
+
+// Patches every hive and prints one summary, returns 1 with `dry_run` if any
+// hive is not at the desired settings
+int patch_offline_hives(const Options &options, const PowerSettings &desired) {
+    const bool dry_run = options.check;
+    const std::vector<HivePatchReport> reports = patch_hives(
+        options.hives, options.filter, desired, options.jobs, dry_run);
+    size_t failed = 0;
+    size_t patched = 0;
+    for (const HivePatchReport &r : reports) {
+        if (!r.error.empty()) {
+            failed++;
+            std::println(stderr, "{}: {}", r.path, r.error);
             continue;
         }
+        patched += r.patched;
+        std::println("{}: {} matching instances, {} {}, {} values written, "
+                     "{} skipped",
+                     r.path, r.matched, r.patched,
+                     dry_run ? "to update" : "updated", r.values_written,
+                     r.skipped);
+    }
+    std::println("{} hives, {} failed, {} instances {}", reports.size(),
+                 failed, patched, dry_run ? "to update" : "updated");
+    if (options.stats) {
+        print_stats();
+    }
+    if (failed > 0) {
+        return -1;
+    }
+    return dry_run && patched > 0 ? 1 : 0;
+}
 
-        const std::array ps_value_names = PowerSettings::create_value_names();
-        const auto ps_values_res = psk.read_u32_values(ps_value_names);
-        if (!ps_values_res.has_value()) {
-            print_error(ps_values_res.error());
-            continue;
+// Reapplies the desired settings whenever something below the media class key
+// changes. Sleeps in between, there is no polling.
+int watch_media(const reg::Key &mk, size_t jobs, bool stats,
+                const std::string &cache_path,
+                const reg::CachingBackend *key_cache,
+                const PowerSettings &desired) {
+    // Created before the first pass, so changes made during it are not missed
+    reg::Watch watch(mk);
+    if (!watch.valid()) {
+        std::println(stderr, "Could not watch a key {}", mk.path());
+        return -1;
+    }
+    std::println("Watching {} for changes", mk.path());
+    for (;;) {
+        // Everything a pass allocates goes at once when it is done
+        reg::Arena arena;
+        // Instances without power settings are skipped silently, they would
+        // be reported on every change otherwise
+        const auto scan_res = scan_media_cached(mk, jobs, cache_path, arena);
+        if (scan_res.has_value()) {
+            reconcile_media(scan_res->media_infos, desired);
+        } else {
+            print_error(scan_res.error());
+        }
+        if (stats) {
+            print_stats();
+            if (key_cache != nullptr) {
+                const reg::CachingBackend::Stats cs = key_cache->stats();
+                std::println("Key cache: {} hits, {} misses, {} evictions, "
+                             "{} open",
+                             cs.hits, cs.misses, cs.evictions,
+                             cs.open_handles);
+            }
+        }
+        // Output usually goes to a log, which should not lag behind
+        std::fflush(stdout);
+        // Our own writes wake the watch up once more, the next pass then
+        // finds nothing to do
+        for (;;) {
+            const auto wait_res = watch.wait(std::chrono::hours(1));
+            if (!wait_res.has_value()) {
+                print_error(wait_res.error());
+                return -1;
+            }
+            if (wait_res.value()) {
+                break;
+            }
         }
-        const std::vector<uint32_t> ps_values = ps_values_res.value();
+    }
+}
 
-        const std::array drv_value_names = Driver::create_value_names();
-        const auto drv_values_res = msk.read_string_values(drv_value_names);
-        if (!drv_values_res.has_value()) {
-            print_error(drv_values_res.error());
-            continue;
+int main(int argc, char *argv[]) {
+    const auto options = parse_options(std::span(argv + 1, argv + argc));
+    if (!options.has_value()) {
+        std::println(stderr,
+                     "Usage: {0} [--jobs N] [--check | --apply | --watch | "
+                     "--export FILE | --import FILE | --find-idle-below N] "
+                     "[--cache FILE] [--key-cache N] [--dry-run] [--speedup] "
+                     "[--stats]\n"
+                     "       {0} [--jobs N] [--check] --hive FILE [--hive "
+                     "FILE...] [--driver TEXT] [--provider TEXT] [--stats]",
+                     argv[0]);
+        return -1;
+    }
+
+    static constexpr PowerSettings update_ps {
+        .cons_idle_time = 0xffffffff,
+        .perf_idle_time = 0xffffffff,
+        .idle_power_state = 0x3,
+    };
+
+    if (!options->hives.empty()) {
+        return patch_offline_hives(*options, update_ps);
+    }
+    if (options->find_idle_below.has_value()) {
+        return find_idle(*options->find_idle_below, options->jobs,
+                         options->stats);
+    }
+
+    // A dry run reads the live registry through an overlay which takes the
+    // writes, and prints them instead of applying them
+    std::optional<reg::OverlayBackend> overlay;
+    std::optional<reg::Key> overlay_lm;
+    if (options->dry_run) {
+        overlay.emplace(reg::system_backend());
+        overlay_lm.emplace(*overlay, reg::SystemKey::LocalMachine);
+    }
+    // Every pass of --watch reopens the same instance keys, a cache keeps
+    // them open in between
+    std::optional<reg::CachingBackend> key_cache;
+    std::optional<reg::Key> cached_lm;
+    if (options->key_cache > 0) {
+        key_cache.emplace(reg::system_backend(), options->key_cache);
+        cached_lm.emplace(*key_cache, reg::SystemKey::LocalMachine);
+    }
+    const reg::Key &lm = overlay_lm  ? *overlay_lm
+                         : cached_lm ? *cached_lm
+                                     : reg::LocalMachine;
+
+    const reg::Key mk(lm, "SYSTEM\\" + std::string(MediaClassPath));
+    if (!mk.valid()) {
+        std::println(stderr, "Could not open a key {}", mk.path());
+        return -1;
+    }
+
+    if (options->watch) {
+        return watch_media(mk, options->jobs, options->stats,
+                           options->cache_path,
+                           key_cache ? &*key_cache : nullptr, update_ps);
+    }
+    if (!options->export_path.empty()) {
+        return export_media(mk, options->export_path);
+    }
+    if (!options->import_path.empty()) {
+        const int res = import_media(lm, options->import_path);
+        if (overlay) {
+            print_pending(*overlay);
         }
-        const std::vector<std::string> drv_values = drv_values_res.value();
+        return res;
+    }
 
-        media_infos.push_back(MediaInfo {
-            .id = media_infos.size(),
-            .main_key = std::move(msk),
-            .ps_key = std::move(psk),
-            .drv = Driver(drv_values),
-            .ps = PowerSettings(ps_values),
-        });
+    reg::Arena arena;
+    auto scan_res =
+        scan_media_cached(mk, options->jobs, options->cache_path, arena);
+    if (!scan_res.has_value()) {
+        print_error(scan_res.error());
+        return -1;
+    }
+    MediaScan &scan = scan_res.value();
+    for (const std::string &error : scan.errors) {
+        std::println(stderr, "{}", error);
+    }
+    std::print("Scanned {} keys in {:.2f} ms using {} jobs",
+               scan.media_infos.size() + scan.errors.size(), scan.elapsed_ms,
+               scan.jobs);
+    if (options->speedup) {
+        // Timed after the parallel scan, which has warmed up whatever the
+        // backend caches, so the speedup errs on the low side
+        reg::Arena serial_arena;
+        const auto serial_res = scan_media(mk, 1, nullptr, &serial_arena);
+        if (serial_res.has_value() && scan.elapsed_ms > 0) {
+            std::print(" (speedup {:.2f} over {:.2f} ms with 1 job)",
+                       serial_res->elapsed_ms / scan.elapsed_ms,
+                       serial_res->elapsed_ms);
+        }
     }
+    std::println("");
+    if (!options->cache_path.empty()) {
+        std::println("{} of {} instances restored from {}", scan.cached,
+                     scan.media_infos.size(), options->cache_path);
+    }
+    if (options->stats) {
+        print_stats();
+    }
+    const std::span<const MediaInfo> media_infos = scan.media_infos;
 
     const size_t mi_size = media_infos.size();
     if (!mi_size) {
@@ -178,6 +549,19 @@ int main() {
         return 0;
     }
 
+    if (options->check) {
+        return check_media(media_infos, update_ps) ? 0 : 1;
+    }
+    if (options->apply) {
+        // Up to date instances print nothing, so most runs print nothing
+        // but the scan line
+        const bool ok = reconcile_media(media_infos, update_ps);
+        if (overlay) {
+            print_pending(*overlay);
+        }
+        return ok ? 0 : -1;
+    }
+
     std::print("Found {} media instances:\n\n", mi_size);
     for (size_t i = 0; i < mi_size; i++) {
         const auto &mi = media_infos[i];
@@ -205,19 +589,20 @@ int main() {
     }
 
     const MediaInfo &mi = media_infos[choice];
-    static constexpr const std::array update_ps_values =
-        create_update_ps_values();
-    static constexpr const PowerSettings update_ps(update_ps_values);
-
-    std::print("Selected {}\n"
-               "The program is about to update device's power settings to "
-               "the following values:\n"
-               "Conservation Idle Time = {:#010x} -> {:#010x}\n"
-               " Performance Idle Time = {:#010x} -> {:#010x}\n"
-               "      Idle Power State = {:#010x} -> {:#010x}\n\n",
-               mi.description(), mi.ps.cons_idle_time, update_ps.cons_idle_time,
-               mi.ps.perf_idle_time, update_ps.perf_idle_time,
-               mi.ps.idle_power_state, update_ps.idle_power_state);
+    const auto changes = diff_power_settings(mi.ps, update_ps);
+    if (changes.empty()) {
+        std::println("Selected {}\n"
+                     "Device's power settings are already up to date",
+                     mi.description());
+        return 0;
+    }
+
+    std::println("Selected {}\n"
+                 "The program is about to update device's power settings to "
+                 "the following values:",
+                 mi.description());
+    print_changes(changes);
+    std::println("");
 
     bool update;
     for (;;) {
@@ -230,17 +615,19 @@ int main() {
     }
 
     if (update) {
-        const std::array ps_value_names = PowerSettings::create_value_names();
-        for (size_t i = 0; i < update_ps_values.size(); i++) {
-            const uint32_t &value = update_ps_values[i];
-            const auto write_res = mi.ps_key.write_binary_value(
-                ps_value_names[i],
-                std::span((uint8_t *) &value, sizeof(value)));
-            if (write_res.fail) {
-                print_error(write_res.error);
-            }
+        reg::WritePlan plan;
+        plan_power_settings(mi, changes, plan);
+        const auto write_res = plan.apply();
+        if (write_res.fail) {
+            print_error(write_res.error);
+            std::println(stderr, "Settings have been left unchanged");
+            return -1;
+        }
+        if (overlay) {
+            print_pending(*overlay);
+        } else {
+            std::println("Settings have been updated");
         }
-        std::println("Settings have been updated");
     } else {
         std::println("Aborting");
     }
@@ -0,0 +1,208 @@
+#include "mapped_file.h"
+#include "reg.h"
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+#ifndef _WIN32
+int32_t errno_to_status(int err) {
+    switch (err) {
+    case ENOENT:
+        return reg::status::FileNotFound;
+    case EACCES:
+    case EPERM:
+    case EROFS:
+        return reg::status::AccessDenied;
+    default:
+        return reg::status::NotSupported;
+    }
+}
+#endif
+
+} // namespace
+
+namespace reg {
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string &path, Mode mode)
+    : data_ {nullptr}, size_ {0}, mode_ {mode}, error_ {status::Success},
+      file_ {INVALID_HANDLE_VALUE}, mapping_ {nullptr} {
+    const bool write = mode == Mode::ReadWrite;
+    file_ = CreateFileA(path.c_str(),
+                        GENERIC_READ | (write ? GENERIC_WRITE : 0),
+                        FILE_SHARE_READ, 0, OPEN_EXISTING,
+                        FILE_ATTRIBUTE_NORMAL, 0);
+    if (file_ == INVALID_HANDLE_VALUE) {
+        error_ = (int32_t) GetLastError();
+        return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+        error_ = status::InvalidParameter;
+        unmap();
+        return;
+    }
+    mapping_ = CreateFileMappingA(
+        file_, 0, write ? PAGE_READWRITE : PAGE_READONLY, 0, 0, 0);
+    if (mapping_ != nullptr) {
+        data_ = (uint8_t *) MapViewOfFile(
+            mapping_, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+    }
+    if (data_ == nullptr) {
+        error_ = (int32_t) GetLastError();
+        unmap();
+        return;
+    }
+    size_ = (size_t) size.QuadPart;
+}
+
+void MappedFile::unmap() {
+    if (data_ != nullptr) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_ != nullptr) {
+        CloseHandle(mapping_);
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(file_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+int32_t MappedFile::flush() const {
+    if (mode_ != Mode::ReadWrite || data_ == nullptr) {
+        return status::Success;
+    }
+    if (!FlushViewOfFile(data_, size_) || !FlushFileBuffers(file_)) {
+        return (int32_t) GetLastError();
+    }
+    return status::Success;
+}
+
+MappedFile::MappedFile(MappedFile &&other)
+    : data_ {std::exchange(other.data_, nullptr)},
+      size_ {std::exchange(other.size_, 0)}, mode_ {other.mode_},
+      error_ {other.error_},
+      file_ {std::exchange(other.file_, INVALID_HANDLE_VALUE)},
+      mapping_ {std::exchange(other.mapping_, nullptr)} {}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) {
+    if (this != &other) {
+        unmap();
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        mode_ = other.mode_;
+        error_ = other.error_;
+        file_ = std::exchange(other.file_, INVALID_HANDLE_VALUE);
+        mapping_ = std::exchange(other.mapping_, nullptr);
+    }
+    return *this;
+}
+
+#else
+
+MappedFile::MappedFile(const std::string &path, Mode mode)
+    : data_ {nullptr}, size_ {0}, mode_ {mode}, error_ {status::Success},
+      fd_ {-1} {
+    const bool write = mode == Mode::ReadWrite;
+    fd_ = ::open(path.c_str(), write ? O_RDWR : O_RDONLY);
+    if (fd_ < 0) {
+        error_ = errno_to_status(errno);
+        return;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || st.st_size == 0) {
+        error_ = status::InvalidParameter;
+        unmap();
+        return;
+    }
+    void *p = mmap(nullptr, (size_t) st.st_size,
+                   PROT_READ | (write ? PROT_WRITE : 0), MAP_SHARED, fd_, 0);
+    if (p == MAP_FAILED) {
+        error_ = errno_to_status(errno);
+        unmap();
+        return;
+    }
+    data_ = (uint8_t *) p;
+    size_ = (size_t) st.st_size;
+}
+
+void MappedFile::unmap() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+    fd_ = -1;
+}
+
+int32_t MappedFile::flush() const {
+    if (mode_ != Mode::ReadWrite || data_ == nullptr) {
+        return status::Success;
+    }
+    if (msync(data_, size_, MS_SYNC) != 0) {
+        return errno_to_status(errno);
+    }
+    return status::Success;
+}
+
+MappedFile::MappedFile(MappedFile &&other)
+    : data_ {std::exchange(other.data_, nullptr)},
+      size_ {std::exchange(other.size_, 0)}, mode_ {other.mode_},
+      error_ {other.error_}, fd_ {std::exchange(other.fd_, -1)} {}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) {
+    if (this != &other) {
+        unmap();
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+        mode_ = other.mode_;
+        error_ = other.error_;
+        fd_ = std::exchange(other.fd_, -1);
+    }
+    return *this;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+    unmap();
+}
+
+bool MappedFile::valid() const {
+    return data_ != nullptr;
+}
+
+int32_t MappedFile::error() const {
+    return error_;
+}
+
+std::span<const uint8_t> MappedFile::data() const {
+    return {data_, size_};
+}
+
+std::span<uint8_t> MappedFile::writable_data() const {
+    if (mode_ != Mode::ReadWrite) {
+        return {};
+    }
+    return {data_, size_};
+}
+
+} // namespace reg
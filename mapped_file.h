@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+
+namespace reg {
+
+// File mapped into memory as a whole. Pages are loaded by the OS only when
+// they are touched.
+class MappedFile {
+  public:
+    enum class Mode { Read, ReadWrite };
+
+    // Maps an existing file, check valid() and error() for the outcome
+    MappedFile(const std::string &path, Mode mode = Mode::Read);
+
+    // Unmaps the file
+    ~MappedFile();
+
+    MappedFile(MappedFile &&);
+    MappedFile &operator=(MappedFile &&);
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool valid() const;
+    // Status code of the failed mapping, status::Success if valid
+    int32_t error() const;
+    std::span<const uint8_t> data() const;
+    // Mapped bytes, empty unless mapped in ReadWrite mode
+    std::span<uint8_t> writable_data() const;
+    // Writes the changes made through writable_data() to the file and waits
+    // until they are stored
+    int32_t flush() const;
+
+  private:
+    void unmap();
+
+    uint8_t *data_;
+    size_t size_;
+    Mode mode_;
+    int32_t error_;
+#ifdef _WIN32
+    void *file_;
+    void *mapping_;
+#else
+    int fd_;
+#endif
+};
+
+} // namespace reg
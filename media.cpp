@@ -0,0 +1,303 @@
+#include "media.h"
+#include "arena.h"
+#include "hive_backend.h"
+#include "inventory.h"
+#include "pool.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <optional>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Outcome of reading one subkey of the media class key
+struct ScanSlot {
+    std::optional<MediaInfo> media_info;
+    std::string error;
+    bool cached;
+};
+
+std::string format_error(const reg::Error &err) {
+    return std::format("{} (error code: {})", err.msg(), err.code);
+}
+
+void scan_media_instance(const reg::Key &mk, uint32_t idx,
+                         const MediaInventory *inventory,
+                         std::pmr::memory_resource *mr, ScanSlot &slot) {
+    const auto msk_name_res = mk.enum_subkey_names(idx);
+    if (!msk_name_res.has_value()) {
+        slot.error = format_error(msk_name_res.error());
+        return;
+    }
+    const std::string msk_name = msk_name_res.value();
+
+    reg::Key msk(mk, msk_name);
+    if (!msk.valid()) {
+        slot.error = std::format("Could not open a key '{}'", msk.path());
+        return;
+    }
+
+    reg::Key psk(msk, "PowerSettings");
+    if (!psk.valid()) {
+        slot.error = std::format("Could not open a key '{}'", psk.path());
+        return;
+    }
+
+    uint64_t main_write_time = 0;
+    uint64_t ps_write_time = 0;
+    if (inventory != nullptr) {
+        const auto main_info_res = msk.query_info();
+        const auto ps_info_res = psk.query_info();
+        if (!main_info_res.has_value() || !ps_info_res.has_value()) {
+            slot.error = format_error(main_info_res.has_value()
+                                          ? ps_info_res.error()
+                                          : main_info_res.error());
+            return;
+        }
+        main_write_time = main_info_res->last_write_time;
+        ps_write_time = ps_info_res->last_write_time;
+        Driver drv(mr);
+        PowerSettings ps;
+        if (inventory->restore(msk_name, idx, main_write_time, ps_write_time,
+                               drv, ps)) {
+            slot.cached = true;
+            slot.media_info = MediaInfo {
+                .id = 0, // assigned once all instances are known
+                .main_key = std::move(msk),
+                .ps_key = std::move(psk),
+                .drv = std::move(drv),
+                .ps = ps,
+                .main_write_time = main_write_time,
+                .ps_write_time = ps_write_time,
+            };
+            return;
+        }
+    }
+
+    auto ps_res = reg::read_record<PowerSettings>(psk);
+    if (!ps_res.has_value()) {
+        slot.error = format_error(ps_res.error());
+        return;
+    }
+
+    auto drv_res = reg::read_record<Driver>(msk, mr);
+    if (!drv_res.has_value()) {
+        slot.error = format_error(drv_res.error());
+        return;
+    }
+
+    slot.media_info = MediaInfo {
+        .id = 0, // assigned once all instances are known
+        .main_key = std::move(msk),
+        .ps_key = std::move(psk),
+        .drv = std::move(drv_res.value()),
+        .ps = ps_res.value(),
+        .main_write_time = main_write_time,
+        .ps_write_time = ps_write_time,
+    };
+}
+
+double elapsed_ms(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+bool contains_nocase(std::string_view text, std::string_view part) {
+    const auto equal = [](char a, char b) {
+        return std::tolower((unsigned char) a) ==
+               std::tolower((unsigned char) b);
+    };
+    return part.empty() || !std::ranges::search(text, part, equal).empty();
+}
+
+void patch_hive(const DriverFilter &filter, const PowerSettings &desired,
+                bool dry_run, HivePatchReport &report) {
+    reg::HiveBackend backend(report.path,
+                             dry_run ? reg::MappedFile::Mode::Read
+                                     : reg::MappedFile::Mode::ReadWrite);
+    if (!backend.valid()) {
+        report.error = std::format("Could not load a hive (error code: {})",
+                                   backend.error());
+        return;
+    }
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key mk(root, std::string(MediaClassPath));
+    if (!mk.valid()) {
+        report.error = std::format("Could not open a key '{}'", mk.path());
+        return;
+    }
+    // The hive is already one task of the batch
+    reg::Arena arena;
+    const auto scan_res = scan_media(mk, 1, nullptr, &arena);
+    if (!scan_res.has_value()) {
+        report.error = format_error(scan_res.error());
+        return;
+    }
+    report.skipped = scan_res->errors.size();
+
+    reg::WritePlan plan;
+    for (const MediaInfo &mi : scan_res->media_infos) {
+        if (!filter.matches(mi.drv)) {
+            continue;
+        }
+        report.matched++;
+        const auto changes = diff_power_settings(mi.ps, desired);
+        if (!changes.empty()) {
+            report.patched++;
+            plan_power_settings(mi, changes, plan);
+        }
+    }
+    if (dry_run || plan.size() == 0) {
+        return;
+    }
+    const size_t writes = plan.size();
+    const auto write_res = plan.apply();
+    if (write_res.fail) {
+        report.error = format_error(write_res.error);
+        return;
+    }
+    const int32_t flush_res = backend.flush();
+    if (flush_res != reg::status::Success) {
+        report.error =
+            std::format("Could not write a hive (error code: {})", flush_res);
+        return;
+    }
+    report.values_written = writes;
+}
+
+} // namespace
+
+reg::ReadResult<MediaScan> scan_media(const reg::Key &mk, size_t jobs,
+                                      const MediaInventory *inventory,
+                                      std::pmr::memory_resource *mr) {
+    const auto msk_count_res = mk.get_subkeys_count();
+    if (!msk_count_res.has_value()) {
+        return std::unexpected(msk_count_res.error());
+    }
+    const uint32_t msk_count = msk_count_res.value();
+
+    const Clock::time_point start = Clock::now();
+    std::pmr::vector<ScanSlot> slots(msk_count, mr);
+    {
+        reg::ThreadPool pool(jobs);
+        for (uint32_t i = 0; i < msk_count; i++) {
+            pool.submit([&, i] {
+                scan_media_instance(mk, i, inventory, mr, slots[i]);
+            });
+        }
+        pool.wait();
+    }
+    const Clock::time_point end = Clock::now();
+
+    MediaScan scan {
+        .media_infos = std::pmr::vector<MediaInfo>(mr),
+        .errors = {},
+        .jobs = std::max<size_t>(jobs, 1),
+        .cached = 0,
+        .elapsed_ms = elapsed_ms(start, end),
+    };
+    scan.media_infos.reserve(msk_count);
+    for (ScanSlot &slot : slots) {
+        if (slot.media_info.has_value()) {
+            scan.cached += slot.cached;
+            slot.media_info->id = scan.media_infos.size();
+            scan.media_infos.push_back(std::move(*slot.media_info));
+        } else {
+            scan.errors.push_back(std::move(slot.error));
+        }
+    }
+    return scan;
+}
+
+reg::ReadResult<reg::SearchStats>
+find_short_idle_times(const reg::Key &class_key, uint32_t max_idle,
+                      size_t jobs,
+                      const std::function<void(const IdleMatch &)> &on_match) {
+    const reg::SearchFilter filter {
+        // Classes are GUIDs, instances are numbered ("0000"), which skips
+        // e.g. the Properties keys readable only by the system
+        .key_name =
+            [](std::string_view name, uint32_t depth) {
+                if (depth == 1) {
+                    return name.starts_with('{');
+                }
+                return !name.empty() &&
+                       name.find_first_not_of("0123456789") ==
+                           std::string_view::npos;
+            },
+        .key =
+            [max_idle](const reg::Key &key) {
+                const reg::Key psk(key, "PowerSettings", reg::Access::Read);
+                if (!psk.valid()) {
+                    return false;
+                }
+                const auto ps_res = reg::read_record<PowerSettings>(psk);
+                return ps_res.has_value() &&
+                       (ps_res->cons_idle_time < max_idle ||
+                        ps_res->perf_idle_time < max_idle);
+            },
+        .max_depth = 2,
+    };
+    return reg::search(class_key, filter, jobs, [&](const reg::Key &key) {
+        // Matches are rare, reading the settings again is cheaper than
+        // handing them over from the filter
+        const reg::Key psk(key, "PowerSettings", reg::Access::Read);
+        const auto ps_res = reg::read_record<PowerSettings>(psk);
+        if (ps_res.has_value()) {
+            on_match(IdleMatch {.path = key.path(), .ps = ps_res.value()});
+        }
+    });
+}
+
+bool DriverFilter::matches(const Driver &drv) const {
+    return contains_nocase(drv.desc, desc) &&
+           contains_nocase(drv.provider_name, provider_name);
+}
+
+std::vector<HivePatchReport> patch_hives(std::span<const std::string> paths,
+                                         const DriverFilter &filter,
+                                         const PowerSettings &desired,
+                                         size_t jobs, bool dry_run) {
+    std::vector<HivePatchReport> reports(paths.size());
+    reg::ThreadPool pool(std::min(jobs, std::max<size_t>(paths.size(), 1)));
+    for (size_t i = 0; i < paths.size(); i++) {
+        reports[i].path = paths[i];
+        pool.submit(
+            [&, i] { patch_hive(filter, desired, dry_run, reports[i]); });
+    }
+    pool.wait();
+    return reports;
+}
+
+std::vector<PowerSettingChange>
+diff_power_settings(const PowerSettings &current,
+                    const PowerSettings &desired) {
+    std::vector<PowerSettingChange> changes;
+    for (uint8_t i = 0; i < std::to_underlying(PowerSettingsValue::_Count);
+         i++) {
+        const PowerSettingsValue v = (PowerSettingsValue) i;
+        if (current.get(v) != desired.get(v)) {
+            changes.push_back(PowerSettingChange {
+                .value = v,
+                .current = current.get(v),
+                .desired = desired.get(v),
+            });
+        }
+    }
+    return changes;
+}
+
+void plan_power_settings(const MediaInfo &mi,
+                         std::span<const PowerSettingChange> changes,
+                         reg::WritePlan &plan) {
+    for (const PowerSettingChange &change : changes) {
+        // Written as binary, the way the driver stores them
+        const uint32_t value = change.desired;
+        plan.write_binary_value(
+            mi.ps_key,
+            reg::record_value_names<PowerSettings>[std::to_underlying(
+                change.value)],
+            std::span((const uint8_t *) &value, sizeof(value)));
+    }
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "record.h"
+#include "reg.h"
+#include "search.h"
+#include "write_plan.h"
+#include <array>
+#include <format>
+#include <memory_resource>
+#include <string_view>
+#include <utility>
+
+// Media device class key, relative to the root of a SYSTEM hive
+inline constexpr std::string_view MediaClassPath =
+    "CurrentControlSet\\Control\\Class\\"
+    "{4d36e96c-e325-11ce-bfc1-08002be10318}";
+
+enum class PowerSettingsValue : uint8_t {
+    ConsIdleTime,
+    PerfIdleTime,
+    IdlePowerState,
+    _Count,
+};
+
+// Allocator-aware, so that a scan can keep the strings in an arena
+struct Driver {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    std::pmr::string desc;
+    std::pmr::string version;
+    std::pmr::string date;
+    std::pmr::string provider_name;
+
+    Driver() = default;
+    explicit Driver(const allocator_type &alloc)
+        : desc {alloc}, version {alloc}, date {alloc}, provider_name {alloc} {}
+    // Allocator-extended copy and move, for pmr containers and
+    // uses-allocator construction
+    Driver(const Driver &other, const allocator_type &alloc)
+        : desc {other.desc, alloc}, version {other.version, alloc},
+          date {other.date, alloc},
+          provider_name {other.provider_name, alloc} {}
+    Driver(Driver &&other, const allocator_type &alloc)
+        : desc {std::move(other.desc), alloc},
+          version {std::move(other.version), alloc},
+          date {std::move(other.date), alloc},
+          provider_name {std::move(other.provider_name), alloc} {}
+    Driver(const Driver &) = default;
+    Driver(Driver &&) = default;
+    Driver &operator=(const Driver &) = default;
+    Driver &operator=(Driver &&) = default;
+};
+
+struct PowerSettings {
+    uint32_t cons_idle_time;
+    uint32_t perf_idle_time;
+    uint32_t idle_power_state;
+
+    using enum PowerSettingsValue;
+
+    constexpr uint32_t get(PowerSettingsValue v) const {
+        switch (v) {
+        case ConsIdleTime:
+            return cons_idle_time;
+        case PerfIdleTime:
+            return perf_idle_time;
+        default:
+            return idle_power_state;
+        }
+    }
+
+    static constexpr auto create_value_labels() {
+        std::array<std::string_view, std::to_underlying(_Count)> arr;
+        arr[std::to_underlying(ConsIdleTime)] = "Conservation Idle Time";
+        arr[std::to_underlying(PerfIdleTime)] = "Performance Idle Time";
+        arr[std::to_underlying(IdlePowerState)] = "Idle Power State";
+        return arr;
+    }
+};
+
+template <> struct reg::RecordFields<Driver> {
+    static constexpr std::tuple fields {
+        Field {"DriverDesc", &Driver::desc},
+        Field {"DriverVersion", &Driver::version},
+        Field {"DriverDate", &Driver::date},
+        Field {"ProviderName", &Driver::provider_name},
+    };
+};
+
+// In PowerSettingsValue order
+template <> struct reg::RecordFields<PowerSettings> {
+    static constexpr std::tuple fields {
+        Field {"ConservationIdleTime", &PowerSettings::cons_idle_time},
+        Field {"PerformanceIdleTime", &PowerSettings::perf_idle_time},
+        Field {"IdlePowerState", &PowerSettings::idle_power_state},
+    };
+};
+
+struct MediaInfo {
+    size_t id;
+    reg::Key main_key;
+    reg::Key ps_key;
+    Driver drv;
+    PowerSettings ps;
+    // Last write times of the keys, only queried for scans with an inventory
+    uint64_t main_write_time;
+    uint64_t ps_write_time;
+
+    std::string description() const {
+        return std::format(
+            "#{} {} | version: {} | date: {} | provider name: {}\n"
+            "(registry key path: {})",
+            id, drv.desc, drv.version.c_str(), drv.date.c_str(),
+            drv.provider_name.c_str(), main_key.path());
+    }
+};
+
+// Media instances read from the subkeys of the media class key
+struct MediaScan {
+    // Instances in subkey order
+    std::pmr::vector<MediaInfo> media_infos;
+    // Reasons why other subkeys were skipped, in subkey order
+    std::vector<std::string> errors;
+    size_t jobs;
+    // Instances restored from the inventory instead of being read
+    size_t cached;
+    // Wall time of the scan
+    double elapsed_ms;
+};
+
+class MediaInventory;
+
+// Reads all media instances, spreading the subkeys over `jobs` threads. With
+// an inventory, the instances whose keys have not been written since it was
+// saved are taken from it, the others are read. The instances, their driver
+// strings and the scratch buffers of the reads are allocated from `mr`,
+// which the threads use at once (see reg::Arena).
+reg::ReadResult<MediaScan>
+scan_media(const reg::Key &mk, size_t jobs,
+           const MediaInventory *inventory = nullptr,
+           std::pmr::memory_resource *mr = std::pmr::get_default_resource());
+
+// Device instance of any class whose power settings have a short idle time
+struct IdleMatch {
+    std::string path;
+    PowerSettings ps;
+};
+
+// Finds the instances below the device class key (Control\Class) with a
+// conservation or performance idle time below `max_idle`, walking the
+// classes on `jobs` threads. Only class and instance keys are opened, and
+// matches are passed to `on_match` as they are found.
+reg::ReadResult<reg::SearchStats>
+find_short_idle_times(const reg::Key &class_key, uint32_t max_idle,
+                      size_t jobs,
+                      const std::function<void(const IdleMatch &)> &on_match);
+
+// Selects media instances by case-insensitive substrings of their driver
+// description and provider name, empty ones match any
+struct DriverFilter {
+    std::string desc;
+    std::string provider_name;
+
+    bool matches(const Driver &drv) const;
+};
+
+// Outcome of patching one offline hive
+struct HivePatchReport {
+    std::string path;
+    // Instances selected by the filter, and those of them which were not at
+    // the desired settings
+    size_t matched;
+    size_t patched;
+    size_t values_written;
+    // Instances without readable power settings
+    size_t skipped;
+    // Why the hive could not be patched, empty on success
+    std::string error;
+};
+
+// Brings the selected media instances of offline SYSTEM hive files to the
+// desired settings, writing the hives in place. The hives are patched on
+// `jobs` threads, one hive per task; all writes to one hive are applied all
+// or nothing. With `dry_run` the hives are only read. Reports are in the
+// order of `paths`.
+std::vector<HivePatchReport> patch_hives(std::span<const std::string> paths,
+                                         const DriverFilter &filter,
+                                         const PowerSettings &desired,
+                                         size_t jobs, bool dry_run);
+
+// Power setting whose current value differs from the desired one
+struct PowerSettingChange {
+    PowerSettingsValue value;
+    uint32_t current;
+    uint32_t desired;
+};
+
+// Settings which have to be written to reach the desired state, in value
+// order. Empty when the device is already there.
+std::vector<PowerSettingChange>
+diff_power_settings(const PowerSettings &current, const PowerSettings &desired);
+
+// Queues writes of the changed settings of a device
+void plan_power_settings(const MediaInfo &mi,
+                         std::span<const PowerSettingChange> changes,
+                         reg::WritePlan &plan);
@@ -0,0 +1,391 @@
+#include "mem_backend.h"
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+namespace {
+
+uint32_t handle_to_node(reg::Handle k) {
+    return (uint32_t) (k - 1);
+}
+
+reg::Handle node_to_handle(uint32_t node) {
+    return (reg::Handle) node + 1;
+}
+
+} // namespace
+
+namespace reg {
+
+MemBackend::MemBackend() : clock_ {0} {
+    nodes_.push_back(Node {
+        .name = {},
+        .parent = NoNode,
+        .subkeys = {},
+        .values = {},
+        .last_write_time = clock_,
+        .subtree_write_time = clock_,
+    });
+}
+
+Handle MemBackend::create_key(std::string_view path) {
+    std::unique_lock lock(mutex_);
+    return node_to_handle(create_path(0, path));
+}
+
+Handle MemBackend::root(SystemKey sk) {
+    (void) sk; // only one system key for now
+    return node_to_handle(0);
+}
+
+int32_t MemBackend::open(Handle parent, const char *subkey_name,
+                         Access access, Handle &k) {
+    (void) access; // keys have no security
+    std::shared_lock lock(mutex_);
+    if (!valid_node(parent)) {
+        return status::InvalidHandle;
+    }
+    const uint32_t node = find_path(handle_to_node(parent), subkey_name);
+    if (node == NoNode) {
+        return status::FileNotFound;
+    }
+    k = node_to_handle(node);
+    return status::Success;
+}
+
+int32_t MemBackend::create(Handle parent, const char *subkey_name,
+                           Access access, Handle &k) {
+    (void) access;
+    std::unique_lock lock(mutex_);
+    if (!valid_node(parent)) {
+        return status::InvalidHandle;
+    }
+    k = node_to_handle(create_path(handle_to_node(parent), subkey_name));
+    return status::Success;
+}
+
+void MemBackend::close(Handle k) {
+    (void) k;
+}
+
+int32_t MemBackend::query_info(Handle k, KeyInfo &info) {
+    std::shared_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const Node &n = nodes_[handle_to_node(k)];
+    size_t max_len = 0;
+    for (uint32_t subkey : n.subkeys) {
+        max_len = std::max(max_len, nodes_[subkey].name.size());
+    }
+    info = {
+        .subkeys_count = (uint32_t) n.subkeys.size(),
+        .max_subkey_name_len = (uint32_t) max_len,
+        .values_count = (uint32_t) n.values.size(),
+        .last_write_time = n.last_write_time,
+    };
+    return status::Success;
+}
+
+int32_t MemBackend::enum_subkey(Handle k, uint32_t idx, char *name,
+                                uint32_t &size) {
+    std::shared_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const Node &n = nodes_[handle_to_node(k)];
+    if (idx >= n.subkeys.size()) {
+        return status::NoMoreItems;
+    }
+    const std::string &subkey_name = nodes_[n.subkeys[idx]].name;
+    if (size <= subkey_name.size()) {
+        return status::MoreData;
+    }
+    std::memcpy(name, subkey_name.c_str(), subkey_name.size() + 1);
+    size = (uint32_t) subkey_name.size();
+    return status::Success;
+}
+
+int32_t MemBackend::enum_value(Handle k, uint32_t idx, char *name,
+                               uint32_t &name_size, ValueType &type,
+                               void *data, uint32_t &size) {
+    std::shared_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const Node &n = nodes_[handle_to_node(k)];
+    if (idx >= n.values.size()) {
+        return status::NoMoreItems;
+    }
+    const Value &v = values_[n.values[idx]];
+    const uint32_t name_capacity = name_size;
+    const uint32_t capacity = size;
+    name_size = (uint32_t) v.name.size();
+    size = v.data_size;
+    if (name_capacity <= v.name.size() || capacity < v.data_size) {
+        return status::MoreData;
+    }
+    type = v.type;
+    std::memcpy(name, v.name.c_str(), v.name.size() + 1);
+    if (v.data_size > 0) {
+        std::memcpy(data, data_.data() + v.data_offset, v.data_size);
+    }
+    return status::Success;
+}
+
+int32_t MemBackend::get_value(Handle k, const char *value_name,
+                              ValueType type, void *data, uint32_t &size) {
+    std::shared_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const Value *v = find_value(handle_to_node(k), value_name);
+    if (v == nullptr) {
+        return status::FileNotFound;
+    }
+    if (!value_type_matches(type, v->type, v->data_size)) {
+        return status::UnsupportedType;
+    }
+    const uint32_t capacity = size;
+    size = v->data_size;
+    if (data == nullptr) {
+        return status::Success;
+    }
+    if (capacity < v->data_size) {
+        return status::MoreData;
+    }
+    std::memcpy(data, data_.data() + v->data_offset, v->data_size);
+    return status::Success;
+}
+
+int32_t MemBackend::get_values(Handle k, std::span<ValueEntry> entries,
+                               void *data, uint32_t &size) {
+    std::shared_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const uint32_t node = handle_to_node(k);
+    uint32_t total = 0;
+    for (ValueEntry &entry : entries) {
+        const Value *v = find_value(node, entry.name);
+        if (v == nullptr) {
+            return status::FileNotFound;
+        }
+        entry.type = v->type;
+        entry.offset = total;
+        entry.size = v->data_size;
+        total += v->data_size;
+        if (data != nullptr && total <= size) {
+            std::memcpy((uint8_t *) data + entry.offset,
+                        data_.data() + v->data_offset, v->data_size);
+        }
+    }
+    const uint32_t capacity = size;
+    size = total;
+    if (data == nullptr) {
+        return status::Success;
+    }
+    return total > capacity ? status::MoreData : status::Success;
+}
+
+int32_t MemBackend::set_value(Handle k, const char *subkey_name,
+                              const char *value_name, ValueType type,
+                              const void *data, uint32_t size) {
+    std::unique_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const uint32_t node = create_path(handle_to_node(k), subkey_name);
+    store_value(node, value_name, type, data, size);
+    return status::Success;
+}
+
+int32_t MemBackend::set_values(Handle k, std::span<const ValueWrite> writes) {
+    // One lock for the batch, so readers see either none or all of it
+    std::unique_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    for (const ValueWrite &w : writes) {
+        store_value(handle_to_node(k), w.name, w.type, w.data, w.size);
+    }
+    return status::Success;
+}
+
+int32_t MemBackend::delete_value(Handle k, const char *value_name) {
+    std::unique_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    Node &n = nodes_[handle_to_node(k)];
+    // The value record and its data slot are left unused
+    const auto it = std::ranges::find_if(n.values, [&](uint32_t value) {
+        return equal_names(values_[value].name, value_name);
+    });
+    if (it == n.values.end()) {
+        return status::FileNotFound;
+    }
+    n.values.erase(it);
+    touch(handle_to_node(k));
+    return status::Success;
+}
+
+int32_t MemBackend::watch(Handle k, Handle &w) {
+    std::unique_lock lock(mutex_);
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const uint32_t node = handle_to_node(k);
+    const Watch watch {
+        .node = node,
+        .seen = nodes_[node].subtree_write_time,
+    };
+    const auto it = std::ranges::find(watches_, NoNode, &Watch::node);
+    if (it != watches_.end()) {
+        *it = watch;
+        w = (Handle) (it - watches_.begin()) + 1;
+    } else {
+        watches_.push_back(watch);
+        w = (Handle) watches_.size();
+    }
+    return status::Success;
+}
+
+int32_t MemBackend::wait_change(Handle w, uint32_t timeout_ms) {
+    std::shared_lock lock(mutex_);
+    if (!valid_watch(w)) {
+        return status::InvalidHandle;
+    }
+    // Watches may be added while waiting, so the slot is looked up each
+    // time; a watch stopped meanwhile ends the wait
+    const auto changed = [&] {
+        const Watch &watch = watches_[w - 1];
+        return watch.node == NoNode ||
+               nodes_[watch.node].subtree_write_time != watch.seen;
+    };
+    if (timeout_ms == UINT32_MAX) {
+        changed_.wait(lock, changed);
+    } else if (!changed_.wait_for(lock,
+                                  std::chrono::milliseconds(timeout_ms),
+                                  changed)) {
+        return status::Timeout;
+    }
+    // The slot is written under the exclusive lock, so other waiters of the
+    // same watch only ever see a whole update
+    lock.unlock();
+    std::unique_lock write_lock(mutex_);
+    if (!valid_watch(w)) {
+        return status::InvalidHandle;
+    }
+    Watch &watch = watches_[w - 1];
+    watch.seen = nodes_[watch.node].subtree_write_time;
+    return status::Success;
+}
+
+void MemBackend::unwatch(Handle w) {
+    std::unique_lock lock(mutex_);
+    if (valid_watch(w)) {
+        watches_[w - 1].node = NoNode;
+    }
+    // Wakes up the waiters of the watch, they return InvalidHandle
+    changed_.notify_all();
+}
+
+bool MemBackend::valid_node(Handle k) const {
+    return k != InvalidHandle && handle_to_node(k) < nodes_.size();
+}
+
+bool MemBackend::valid_watch(Handle w) const {
+    return w != InvalidHandle && w <= watches_.size() &&
+           watches_[w - 1].node != NoNode;
+}
+
+void MemBackend::touch(uint32_t node) {
+    nodes_[node].last_write_time = ++clock_;
+    for (uint32_t n = node; n != NoNode; n = nodes_[n].parent) {
+        nodes_[n].subtree_write_time = clock_;
+    }
+    changed_.notify_all();
+}
+
+uint32_t MemBackend::find_subkey(uint32_t node, std::string_view name) const {
+    for (uint32_t subkey : nodes_[node].subkeys) {
+        if (equal_names(nodes_[subkey].name, name)) {
+            return subkey;
+        }
+    }
+    return NoNode;
+}
+
+uint32_t MemBackend::find_path(uint32_t node, std::string_view path) const {
+    while (node != NoNode) {
+        const std::string_view name = next_path_component(path);
+        if (name.empty()) {
+            break;
+        }
+        node = find_subkey(node, name);
+    }
+    return node;
+}
+
+uint32_t MemBackend::create_path(uint32_t node, std::string_view path) {
+    for (;;) {
+        const std::string_view name = next_path_component(path);
+        if (name.empty()) {
+            return node;
+        }
+        uint32_t subkey = find_subkey(node, name);
+        if (subkey == NoNode) {
+            subkey = (uint32_t) nodes_.size();
+            nodes_.push_back(Node {
+                .name = std::string {name},
+                .parent = node,
+                .subkeys = {},
+                .values = {},
+                .last_write_time = 0,
+                .subtree_write_time = 0,
+            });
+            nodes_[node].subkeys.push_back(subkey);
+            touch(subkey);
+            nodes_[node].last_write_time = clock_;
+        }
+        node = subkey;
+    }
+}
+
+const MemBackend::Value *MemBackend::find_value(uint32_t node,
+                                                std::string_view name) const {
+    for (uint32_t value : nodes_[node].values) {
+        if (equal_names(values_[value].name, name)) {
+            return &values_[value];
+        }
+    }
+    return nullptr;
+}
+
+void MemBackend::store_value(uint32_t node, std::string_view name,
+                             ValueType type, const void *data, uint32_t size) {
+    Value *v = const_cast<Value *>(find_value(node, name));
+    if (v == nullptr) {
+        nodes_[node].values.push_back((uint32_t) values_.size());
+        v = &values_.emplace_back(Value {
+            .name = std::string {name},
+            .type = type,
+            .data_offset = 0,
+            .data_size = 0,
+        });
+    }
+    // Reuse the old data slot if the new data fits, append otherwise
+    if (size > v->data_size) {
+        v->data_offset = (uint32_t) data_.size();
+        data_.resize(data_.size() + size);
+    }
+    if (size > 0) {
+        std::memcpy(data_.data() + v->data_offset, data, size);
+    }
+    v->type = type;
+    v->data_size = size;
+    touch(node);
+}
+
+} // namespace reg
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "reg.h"
+#include <condition_variable>
+#include <shared_mutex>
+#include <string_view>
+
+namespace reg {
+
+// In-memory registry tree. Nodes, values and value data are kept in flat
+// arrays and addressed by index, so walking the tree touches few cache lines
+// and no real registry is needed. Handles are node indices and stay valid for
+// the lifetime of the backend, closing them is a no-op. All methods are safe
+// to call concurrently.
+class MemBackend : public Backend {
+  public:
+    MemBackend();
+
+    // Creates a key with all missing parents under the system key and returns
+    // its handle
+    Handle create_key(std::string_view path);
+
+    Handle root(SystemKey sk) override;
+    int32_t open(Handle parent, const char *subkey_name, Access access,
+                 Handle &k) override;
+    int32_t create(Handle parent, const char *subkey_name, Access access,
+                   Handle &k) override;
+    void close(Handle k) override;
+    int32_t query_info(Handle k, KeyInfo &info) override;
+    int32_t enum_subkey(Handle k, uint32_t idx, char *name,
+                        uint32_t &size) override;
+    int32_t enum_value(Handle k, uint32_t idx, char *name,
+                       uint32_t &name_size, ValueType &type, void *data,
+                       uint32_t &size) override;
+    int32_t get_value(Handle k, const char *value_name, ValueType type,
+                      void *data, uint32_t &size) override;
+    int32_t get_values(Handle k, std::span<ValueEntry> entries, void *data,
+                       uint32_t &size) override;
+    int32_t set_value(Handle k, const char *subkey_name,
+                      const char *value_name, ValueType type, const void *data,
+                      uint32_t size) override;
+    int32_t set_values(Handle k,
+                       std::span<const ValueWrite> writes) override;
+    int32_t delete_value(Handle k, const char *value_name) override;
+    int32_t watch(Handle k, Handle &w) override;
+    int32_t wait_change(Handle w, uint32_t timeout_ms) override;
+    void unwatch(Handle w) override;
+
+  private:
+    struct Node {
+        std::string name;
+        uint32_t parent;
+        std::vector<uint32_t> subkeys;
+        std::vector<uint32_t> values;
+        uint64_t last_write_time;
+        // Last write to the node or to any node below it
+        uint64_t subtree_write_time;
+    };
+
+    struct Value {
+        std::string name;
+        ValueType type;
+        uint32_t data_offset;
+        uint32_t data_size;
+    };
+
+    // Watched node and its subtree write time when last waited on. Slots of
+    // stopped watches have no node and are reused.
+    struct Watch {
+        uint32_t node;
+        uint64_t seen;
+    };
+
+    static constexpr uint32_t NoNode = UINT32_MAX;
+
+    // Helpers below expect the mutex to be held by the caller
+    bool valid_node(Handle k) const;
+    uint32_t find_subkey(uint32_t node, std::string_view name) const;
+    uint32_t find_path(uint32_t node, std::string_view path) const;
+    uint32_t create_path(uint32_t node, std::string_view path);
+    const Value *find_value(uint32_t node, std::string_view name) const;
+    void store_value(uint32_t node, std::string_view name, ValueType type,
+                     const void *data, uint32_t size);
+    bool valid_watch(Handle w) const;
+    // Records a write to a node and wakes up the watches
+    void touch(uint32_t node);
+
+    std::vector<Node> nodes_;
+    std::vector<Value> values_;
+    std::vector<uint8_t> data_;
+    std::vector<Watch> watches_;
+    uint64_t clock_;
+    mutable std::shared_mutex mutex_;
+    std::condition_variable_any changed_;
+};
+
+} // namespace reg
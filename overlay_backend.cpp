@@ -0,0 +1,675 @@
+#include "overlay_backend.h"
+#include "write_plan.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace {
+
+// Appends the components of a subkey path, case-folded to the id and as
+// given to the path
+void append_path(std::string &id, std::string &path,
+                 std::string_view subkey_name) {
+    for (;;) {
+        const std::string_view name = reg::next_path_component(subkey_name);
+        if (name.empty()) {
+            return;
+        }
+        id += '\\';
+        for (char c : name) {
+            id += (char) std::tolower((unsigned char) c);
+        }
+        if (!path.empty()) {
+            path += '\\';
+        }
+        path += name;
+    }
+}
+
+// Copies data out like get_value(): `size` becomes the data size, and a null
+// buffer only asks for it
+int32_t copy_data(std::span<const uint8_t> data, void *out, uint32_t &size) {
+    const uint32_t capacity = size;
+    size = (uint32_t) data.size();
+    if (out == nullptr) {
+        return reg::status::Success;
+    }
+    if (capacity < data.size()) {
+        return reg::status::MoreData;
+    }
+    std::memcpy(out, data.data(), data.size());
+    return reg::status::Success;
+}
+
+// Copies a value out like enum_value(): both sizes are set, and MoreData is
+// returned if either buffer is too small
+int32_t copy_value(std::string_view name, reg::ValueType type,
+                   std::span<const uint8_t> data, char *name_out,
+                   uint32_t &name_size, reg::ValueType &type_out,
+                   void *data_out, uint32_t &size) {
+    const uint32_t name_capacity = name_size;
+    const uint32_t capacity = size;
+    name_size = (uint32_t) name.size();
+    size = (uint32_t) data.size();
+    if (name_capacity <= name.size() || capacity < data.size()) {
+        return reg::status::MoreData;
+    }
+    type_out = type;
+    std::memcpy(name_out, name.data(), name.size());
+    name_out[name.size()] = '\0';
+    if (!data.empty()) {
+        std::memcpy(data_out, data.data(), data.size());
+    }
+    return reg::status::Success;
+}
+
+} // namespace
+
+namespace reg {
+
+OverlayBackend::OverlayBackend(Backend &inner) : inner_ {inner} {}
+
+OverlayBackend::~OverlayBackend() = default;
+
+OverlayBackend::Stats OverlayBackend::stats() const {
+    std::shared_lock lock(mutex_);
+    Stats stats {.keys = deltas_.size(), .values = 0, .data_bytes = 0};
+    for (const auto &[id, d] : deltas_) {
+        stats.values += d.values.size();
+        for (const ValueDelta &v : d.values) {
+            stats.data_bytes += v.data.size();
+        }
+    }
+    return stats;
+}
+
+void OverlayBackend::for_each_change(
+    const std::function<void(const Change &)> &fn) const {
+    std::shared_lock lock(mutex_);
+    for (const std::string &id : order_) {
+        const KeyDelta &d = deltas_.at(id);
+        if (d.created) {
+            fn(Change {
+                .kind = ChangeKind::CreateKey,
+                .path = d.path,
+                .value_name = {},
+                .type = ValueType::None,
+                .data = {},
+            });
+        }
+        for (const ValueDelta &v : d.values) {
+            fn(Change {
+                .kind = v.deleted ? ChangeKind::DeleteValue
+                                  : ChangeKind::SetValue,
+                .path = d.path,
+                .value_name = v.name,
+                .type = v.type,
+                .data = v.data,
+            });
+        }
+    }
+}
+
+void OverlayBackend::discard() {
+    std::unique_lock lock(mutex_);
+    deltas_.clear();
+    order_.clear();
+}
+
+WriteResult OverlayBackend::commit() {
+    // Nothing may be written to the overlay while it is being emptied
+    std::unique_lock lock(mutex_);
+    // The plan points to the keys, so they must not move
+    std::deque<Key> keys;
+    WritePlan plan;
+    for (const std::string &id : order_) {
+        const KeyDelta &d = deltas_.at(id);
+        if (!d.created && d.values.empty()) {
+            continue; // only has created subkeys, they come on their own
+        }
+        const Key root(inner_, d.sk);
+        auto key_res = d.created ? Key::create(root, d.path)
+                                 : Key::open(root, d.path);
+        if (!key_res.has_value()) {
+            return {
+                .fail = true,
+                .error =
+                    Error {
+                        .code = key_res.error().code,
+                        .op = Operation::CommitOverlay,
+                        .name = d.path,
+                        .index = 0,
+                    },
+            };
+        }
+        const Key &key = keys.emplace_back(std::move(key_res.value()));
+        for (const ValueDelta &v : d.values) {
+            if (v.deleted) {
+                plan.delete_value(key, v.name);
+            } else {
+                plan.write_value(key, v.name, v.type, v.data);
+            }
+        }
+    }
+
+    WriteResult result = plan.apply();
+    if (!result.fail) {
+        deltas_.clear();
+        order_.clear();
+    }
+    return result;
+}
+
+Handle OverlayBackend::root(SystemKey sk) {
+    std::unique_lock lock(mutex_);
+    std::unique_ptr<OpenKey> &root = roots_[sk];
+    if (root == nullptr) {
+        // System keys get ids which no subkey path can collide with
+        root = std::make_unique<OpenKey>(OpenKey {
+            .inner = inner_.root(sk),
+            .sk = sk,
+            .id = std::to_string(std::to_underlying(sk)),
+            .path = {},
+            .system = true,
+        });
+    }
+    return (Handle) root.get();
+}
+
+int32_t OverlayBackend::open(Handle parent, const char *subkey_name,
+                             Access access, Handle &k) {
+    (void) access; // the wrapped backend is only read
+    const OpenKey *p = (const OpenKey *) parent;
+    if (p == nullptr) {
+        return status::InvalidHandle;
+    }
+    auto key = std::make_unique<OpenKey>(OpenKey {
+        .inner = InvalidHandle,
+        .sk = p->sk,
+        .id = p->id,
+        .path = p->path,
+        .system = false,
+    });
+    append_path(key->id, key->path, subkey_name);
+
+    int32_t res = status::FileNotFound;
+    if (p->inner != InvalidHandle) {
+        res = inner_.open(p->inner, subkey_name, Access::Read, key->inner);
+    }
+    if (res == status::FileNotFound) {
+        std::shared_lock lock(mutex_);
+        const KeyDelta *d = find_delta(*key);
+        if (d != nullptr && d->created) {
+            key->inner = InvalidHandle;
+            res = status::Success;
+        }
+    }
+    if (res != status::Success) {
+        return res;
+    }
+    k = (Handle) key.release();
+    return status::Success;
+}
+
+int32_t OverlayBackend::create(Handle parent, const char *subkey_name,
+                               Access access, Handle &k) {
+    const int32_t res = open(parent, subkey_name, access, k);
+    if (res != status::FileNotFound) {
+        return res;
+    }
+    // Walks down the wrapped backend as far as the path exists there and
+    // records every missing key below as created
+    const OpenKey *p = (const OpenKey *) parent;
+    std::unique_lock lock(mutex_);
+    std::string id = p->id;
+    std::string path = p->path;
+    Handle h = p->inner;
+    bool own = false;
+    std::string_view rest = subkey_name;
+    for (;;) {
+        const std::string_view name = next_path_component(rest);
+        if (name.empty()) {
+            break;
+        }
+        const std::string parent_id = id;
+        const std::string parent_path = path;
+        append_path(id, path, name);
+        Handle next = InvalidHandle;
+        if (h != InvalidHandle &&
+            inner_.open(h, std::string(name).c_str(), Access::Read, next) ==
+                status::Success) {
+            if (own) {
+                inner_.close(h);
+            }
+            h = next;
+            own = true;
+            continue;
+        }
+        if (own) {
+            inner_.close(h);
+        }
+        h = InvalidHandle;
+        own = false;
+        KeyDelta &child = delta(p->sk, id, path);
+        if (!child.created) {
+            child.created = true;
+            KeyDelta &parent_delta = delta(p->sk, parent_id, parent_path);
+            parent_delta.new_subkeys.emplace_back(name);
+            parent_delta.writes++;
+        }
+    }
+    if (own) {
+        inner_.close(h);
+    }
+    lock.unlock();
+    return open(parent, subkey_name, access, k);
+}
+
+void OverlayBackend::close(Handle k) {
+    OpenKey *key = (OpenKey *) k;
+    if (key == nullptr || key->system) {
+        return;
+    }
+    if (key->inner != InvalidHandle) {
+        inner_.close(key->inner);
+    }
+    delete key;
+}
+
+int32_t OverlayBackend::query_info(Handle k, KeyInfo &info) {
+    const OpenKey *key = (const OpenKey *) k;
+    if (key == nullptr) {
+        return status::InvalidHandle;
+    }
+    info = {};
+    if (key->inner != InvalidHandle) {
+        const int32_t res = inner_.query_info(key->inner, info);
+        if (res != status::Success) {
+            return res;
+        }
+    }
+    std::shared_lock lock(mutex_);
+    const KeyDelta *d = find_delta(*key);
+    if (d == nullptr) {
+        return status::Success;
+    }
+    info.subkeys_count += (uint32_t) d->new_subkeys.size();
+    for (const std::string &name : d->new_subkeys) {
+        info.max_subkey_name_len =
+            std::max(info.max_subkey_name_len, (uint32_t) name.size());
+    }
+    for (const ValueDelta &v : d->values) {
+        if (v.deleted && v.in_inner) {
+            info.values_count--;
+        } else if (!v.deleted && !v.in_inner) {
+            info.values_count++;
+        }
+    }
+    info.last_write_time += d->writes;
+    return status::Success;
+}
+
+int32_t OverlayBackend::enum_subkey(Handle k, uint32_t idx, char *name,
+                                    uint32_t &size) {
+    const OpenKey *key = (const OpenKey *) k;
+    if (key == nullptr) {
+        return status::InvalidHandle;
+    }
+    uint32_t inner_count = 0;
+    if (key->inner != InvalidHandle) {
+        KeyInfo info;
+        const int32_t res = inner_.query_info(key->inner, info);
+        if (res != status::Success) {
+            return res;
+        }
+        inner_count = info.subkeys_count;
+        if (idx < inner_count) {
+            return inner_.enum_subkey(key->inner, idx, name, size);
+        }
+    }
+    // Created subkeys come after the wrapped ones
+    std::shared_lock lock(mutex_);
+    const KeyDelta *d = find_delta(*key);
+    if (d == nullptr || idx - inner_count >= d->new_subkeys.size()) {
+        return status::NoMoreItems;
+    }
+    const std::string &subkey_name = d->new_subkeys[idx - inner_count];
+    if (size <= subkey_name.size()) {
+        return status::MoreData;
+    }
+    std::memcpy(name, subkey_name.c_str(), subkey_name.size() + 1);
+    size = (uint32_t) subkey_name.size();
+    return status::Success;
+}
+
+int32_t OverlayBackend::enum_value(Handle k, uint32_t idx, char *name,
+                                   uint32_t &name_size, ValueType &type,
+                                   void *data, uint32_t &size) {
+    const OpenKey *key = (const OpenKey *) k;
+    if (key == nullptr) {
+        return status::InvalidHandle;
+    }
+    std::shared_lock lock(mutex_);
+    const KeyDelta *d = find_delta(*key);
+    if (d == nullptr) {
+        lock.unlock();
+        if (key->inner == InvalidHandle) {
+            return status::NoMoreItems;
+        }
+        return inner_.enum_value(key->inner, idx, name, name_size, type, data,
+                                 size);
+    }
+
+    // Wrapped values in their order, overwritten ones in place and deleted
+    // ones skipped, then the added ones. Skipping needs the names of all
+    // values before `idx`, which is fine for the few keys with a delta.
+    uint32_t merged = 0;
+    if (key->inner != InvalidHandle) {
+        std::string name_buf(256, '\0');
+        std::vector<uint8_t> data_buf(256);
+        for (uint32_t i = 0;;) {
+            uint32_t name_len = (uint32_t) name_buf.size();
+            uint32_t data_size = (uint32_t) data_buf.size();
+            ValueType inner_type;
+            const int32_t res =
+                inner_.enum_value(key->inner, i, name_buf.data(), name_len,
+                                  inner_type, data_buf.data(), data_size);
+            if (res == status::MoreData) {
+                // Both sizes are set to ones large enough
+                name_buf.resize(std::max<size_t>(name_len + 1, 256));
+                data_buf.resize(std::max<size_t>(data_size, 256));
+                continue;
+            }
+            if (res == status::NoMoreItems) {
+                break;
+            }
+            if (res != status::Success) {
+                return res;
+            }
+            i++;
+            const std::string_view inner_name(name_buf.data(), name_len);
+            const ValueDelta *v = find_value(d, inner_name);
+            if (v != nullptr && v->deleted) {
+                continue;
+            }
+            if (merged++ != idx) {
+                continue;
+            }
+            if (v != nullptr) {
+                return copy_value(v->name, v->type, v->data, name, name_size,
+                                  type, data, size);
+            }
+            return copy_value(inner_name, inner_type,
+                              std::span(data_buf).first(data_size), name,
+                              name_size, type, data, size);
+        }
+    }
+    for (const ValueDelta &v : d->values) {
+        if (!v.deleted && !v.in_inner && merged++ == idx) {
+            return copy_value(v.name, v.type, v.data, name, name_size, type,
+                              data, size);
+        }
+    }
+    return status::NoMoreItems;
+}
+
+int32_t OverlayBackend::get_value(Handle k, const char *value_name,
+                                  ValueType type, void *data,
+                                  uint32_t &size) {
+    const OpenKey *key = (const OpenKey *) k;
+    if (key == nullptr) {
+        return status::InvalidHandle;
+    }
+    {
+        std::shared_lock lock(mutex_);
+        const ValueDelta *v = find_value(find_delta(*key), value_name);
+        if (v != nullptr) {
+            if (v->deleted) {
+                return status::FileNotFound;
+            }
+            if (!value_type_matches(type, v->type, (uint32_t) v->data.size())) {
+                return status::UnsupportedType;
+            }
+            return copy_data(v->data, data, size);
+        }
+    }
+    if (key->inner == InvalidHandle) {
+        return status::FileNotFound;
+    }
+    return inner_.get_value(key->inner, value_name, type, data, size);
+}
+
+int32_t OverlayBackend::get_values(Handle k, std::span<ValueEntry> entries,
+                                   void *data, uint32_t &size) {
+    const OpenKey *key = (const OpenKey *) k;
+    if (key == nullptr) {
+        return status::InvalidHandle;
+    }
+    std::shared_lock lock(mutex_);
+    const KeyDelta *d = find_delta(*key);
+    if (d == nullptr && key->inner != InvalidHandle) {
+        lock.unlock();
+        return inner_.get_values(key->inner, entries, data, size);
+    }
+
+    // Entry by entry, from the delta or from the wrapped backend
+    uint8_t *out = (uint8_t *) data;
+    const uint32_t capacity = size;
+    uint32_t total = 0;
+    for (ValueEntry &entry : entries) {
+        const ValueDelta *v = find_value(d, entry.name);
+        if (v != nullptr) {
+            if (v->deleted) {
+                return status::FileNotFound;
+            }
+            entry.type = v->type;
+            entry.size = (uint32_t) v->data.size();
+            if (out != nullptr && total + entry.size <= capacity) {
+                std::memcpy(out + total, v->data.data(), v->data.size());
+            }
+        } else {
+            if (key->inner == InvalidHandle) {
+                return status::FileNotFound;
+            }
+            const bool fits = out != nullptr && total <= capacity;
+            uint32_t entry_size = fits ? capacity - total : 0;
+            const int32_t res =
+                inner_.get_values(key->inner, std::span(&entry, 1),
+                                  fits ? out + total : nullptr, entry_size);
+            if (res != status::Success && res != status::MoreData) {
+                return res;
+            }
+            entry.size = entry_size;
+        }
+        entry.offset = total;
+        total += entry.size;
+    }
+    size = total;
+    if (data == nullptr) {
+        return status::Success;
+    }
+    return total > capacity ? status::MoreData : status::Success;
+}
+
+int32_t OverlayBackend::set_value(Handle k, const char *subkey_name,
+                                  const char *value_name, ValueType type,
+                                  const void *data, uint32_t size) {
+    const ValueWrite write {
+        .name = value_name,
+        .type = type,
+        .data = data,
+        .size = size,
+    };
+    if (subkey_name == nullptr || *subkey_name == '\0') {
+        return set_values(k, std::span(&write, 1));
+    }
+    // Like the wrapped backend would, the subkey is created first
+    Handle subkey = InvalidHandle;
+    const int32_t res = create(k, subkey_name, Access::Write, subkey);
+    if (res != status::Success) {
+        return res;
+    }
+    const int32_t write_res = set_values(subkey, std::span(&write, 1));
+    close(subkey);
+    return write_res;
+}
+
+int32_t OverlayBackend::set_values(Handle k,
+                                   std::span<const ValueWrite> writes) {
+    const OpenKey *key = (const OpenKey *) k;
+    if (key == nullptr) {
+        return status::InvalidHandle;
+    }
+    return write_values(*key, writes);
+}
+
+int32_t OverlayBackend::delete_value(Handle k, const char *value_name) {
+    const OpenKey *key = (const OpenKey *) k;
+    if (key == nullptr) {
+        return status::InvalidHandle;
+    }
+    const bool in_inner = inner_has_value(*key, value_name);
+    std::unique_lock lock(mutex_);
+    const ValueDelta *found = find_value(find_delta(*key), value_name);
+    if (found == nullptr && !in_inner) {
+        return status::FileNotFound;
+    }
+    if (found != nullptr && found->deleted) {
+        return status::FileNotFound;
+    }
+    KeyDelta &d = delta(key->sk, key->id, key->path);
+    d.writes++;
+    const auto it = std::ranges::find_if(d.values, [&](const ValueDelta &v) {
+        return equal_names(v.name, value_name);
+    });
+    if (it == d.values.end()) {
+        d.values.push_back(ValueDelta {
+            .name = value_name,
+            .deleted = true,
+            .in_inner = true,
+            .type = ValueType::None,
+            .data = {},
+        });
+    } else if (it->in_inner) {
+        it->deleted = true;
+        it->type = ValueType::None;
+        it->data = {};
+    } else {
+        d.values.erase(it); // added in the overlay only
+    }
+    return status::Success;
+}
+
+int32_t OverlayBackend::watch(Handle k, Handle &w) {
+    const OpenKey *key = (const OpenKey *) k;
+    if (key == nullptr) {
+        return status::InvalidHandle;
+    }
+    if (key->inner == InvalidHandle) {
+        return status::NotSupported;
+    }
+    return inner_.watch(key->inner, w);
+}
+
+int32_t OverlayBackend::wait_change(Handle w, uint32_t timeout_ms) {
+    return inner_.wait_change(w, timeout_ms);
+}
+
+void OverlayBackend::unwatch(Handle w) {
+    inner_.unwatch(w);
+}
+
+const OverlayBackend::KeyDelta *
+OverlayBackend::find_delta(const OpenKey &key) const {
+    const auto it = deltas_.find(key.id);
+    return it != deltas_.end() ? &it->second : nullptr;
+}
+
+OverlayBackend::KeyDelta &OverlayBackend::delta(SystemKey sk,
+                                                const std::string &id,
+                                                const std::string &path) {
+    const auto [it, inserted] = deltas_.try_emplace(id);
+    if (inserted) {
+        it->second = KeyDelta {
+            .sk = sk,
+            .path = path,
+            .created = false,
+            .new_subkeys = {},
+            .values = {},
+            .writes = 0,
+        };
+        order_.push_back(id);
+    }
+    return it->second;
+}
+
+const OverlayBackend::ValueDelta *
+OverlayBackend::find_value(const KeyDelta *d, std::string_view name) {
+    if (d == nullptr) {
+        return nullptr;
+    }
+    const auto it = std::ranges::find_if(d->values, [&](const ValueDelta &v) {
+        return equal_names(v.name, name);
+    });
+    return it != d->values.end() ? &*it : nullptr;
+}
+
+bool OverlayBackend::inner_has_value(const OpenKey &key,
+                                     const char *value_name) {
+    uint32_t size = 0;
+    return key.inner != InvalidHandle &&
+           inner_.get_value(key.inner, value_name, ValueType::None, nullptr,
+                            size) == status::Success;
+}
+
+int32_t OverlayBackend::write_values(const OpenKey &key,
+                                     std::span<const ValueWrite> writes) {
+    // The wrapped backend is asked before taking the lock, and only about
+    // values the delta does not know yet
+    std::vector<bool> in_inner(writes.size());
+    {
+        std::shared_lock lock(mutex_);
+        const KeyDelta *d = find_delta(key);
+        for (size_t i = 0; i < writes.size(); i++) {
+            const ValueDelta *v = find_value(d, writes[i].name);
+            in_inner[i] = v != nullptr ? v->in_inner : false;
+        }
+    }
+    for (size_t i = 0; i < writes.size(); i++) {
+        if (!in_inner[i]) {
+            in_inner[i] = inner_has_value(key, writes[i].name);
+        }
+    }
+
+    // One lock for the batch, so readers see either none or all of it
+    std::unique_lock lock(mutex_);
+    KeyDelta &d = delta(key.sk, key.id, key.path);
+    for (size_t i = 0; i < writes.size(); i++) {
+        const ValueWrite &w = writes[i];
+        const uint8_t *bytes = (const uint8_t *) w.data;
+        d.writes++;
+        const auto it =
+            std::ranges::find_if(d.values, [&](const ValueDelta &v) {
+                return equal_names(v.name, w.name);
+            });
+        if (it != d.values.end()) {
+            it->deleted = false;
+            it->type = w.type;
+            it->data.assign(bytes, bytes + w.size);
+            continue;
+        }
+        d.values.push_back(ValueDelta {
+            .name = w.name,
+            .deleted = false,
+            .in_inner = in_inner[i],
+            .type = w.type,
+            .data = {bytes, bytes + w.size},
+        });
+    }
+    return status::Success;
+}
+
+} // namespace reg
@@ -0,0 +1,148 @@
+#pragma once
+
+#include "reg.h"
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace reg {
+
+// Copy-on-write layer over another backend, for dry runs and previews.
+// Writes, deletes and created keys go to a delta kept in memory; reads see
+// the wrapped backend merged with the delta. The wrapped backend is only
+// ever read (keys are opened there with Access::Read) until the delta is
+// committed, and it is assumed not to change in the meantime. The delta
+// holds the written values and the paths of the changed keys only, so a
+// preview costs memory for what changes and nothing for what is read.
+//
+// Keys written in the overlay report their write time moved on by the
+// number of writes, so caches keyed by it see the change. Watches are those
+// of the wrapped backend and do not fire on overlay writes. All methods are
+// safe to call concurrently.
+class OverlayBackend : public Backend {
+  public:
+    enum class ChangeKind { CreateKey, SetValue, DeleteValue };
+
+    // Pending change, views into the delta
+    struct Change {
+        ChangeKind kind;
+        // Key path below the system key, as first written
+        std::string_view path;
+        std::string_view value_name;
+        ValueType type;
+        std::span<const uint8_t> data;
+    };
+
+    struct Stats {
+        // Keys with pending changes
+        size_t keys;
+        size_t values;
+        size_t data_bytes;
+    };
+
+    explicit OverlayBackend(Backend &inner);
+
+    // Every reg::Key using the overlay must be gone
+    ~OverlayBackend();
+
+    OverlayBackend(const OverlayBackend &) = delete;
+    OverlayBackend &operator=(const OverlayBackend &) = delete;
+
+    Stats stats() const;
+    // Calls `fn` for every pending change: keys in the order they were first
+    // changed, a created key before its values, values in the order they
+    // were first written
+    void for_each_change(const std::function<void(const Change &)> &fn) const;
+    // Drops all pending changes. Keys opened below created keys stay valid
+    // but read as empty.
+    void discard();
+    // Applies the pending changes to the wrapped backend as one WritePlan and
+    // drops them. Created keys are created first; the values are then
+    // written all or nothing, with the writes of every key as one
+    // set_values() batch. On failure the values written so far are restored
+    // and all changes stay pending, only keys already created remain.
+    WriteResult commit();
+
+    Handle root(SystemKey sk) override;
+    int32_t open(Handle parent, const char *subkey_name, Access access,
+                 Handle &k) override;
+    int32_t create(Handle parent, const char *subkey_name, Access access,
+                   Handle &k) override;
+    void close(Handle k) override;
+    int32_t query_info(Handle k, KeyInfo &info) override;
+    int32_t enum_subkey(Handle k, uint32_t idx, char *name,
+                        uint32_t &size) override;
+    int32_t enum_value(Handle k, uint32_t idx, char *name,
+                       uint32_t &name_size, ValueType &type, void *data,
+                       uint32_t &size) override;
+    int32_t get_value(Handle k, const char *value_name, ValueType type,
+                      void *data, uint32_t &size) override;
+    int32_t get_values(Handle k, std::span<ValueEntry> entries, void *data,
+                       uint32_t &size) override;
+    int32_t set_value(Handle k, const char *subkey_name,
+                      const char *value_name, ValueType type, const void *data,
+                      uint32_t size) override;
+    int32_t set_values(Handle k,
+                       std::span<const ValueWrite> writes) override;
+    int32_t delete_value(Handle k, const char *value_name) override;
+    // Watch handles are the ones of the wrapped backend
+    int32_t watch(Handle k, Handle &w) override;
+    int32_t wait_change(Handle w, uint32_t timeout_ms) override;
+    void unwatch(Handle w) override;
+
+  private:
+    // Handles given out are addresses of these. Keys created in the overlay
+    // have no wrapped handle.
+    struct OpenKey {
+        Handle inner;
+        SystemKey sk;
+        // Case-folded, identifies the key in the delta
+        std::string id;
+        // As opened, for commits and previews
+        std::string path;
+        bool system;
+    };
+
+    struct ValueDelta {
+        std::string name;
+        bool deleted;
+        // Whether the wrapped backend has the value, so whether a write
+        // adds a value and a delete removes one
+        bool in_inner;
+        ValueType type;
+        std::vector<uint8_t> data;
+    };
+
+    struct KeyDelta {
+        SystemKey sk;
+        std::string path;
+        // Missing in the wrapped backend
+        bool created;
+        // Names of the subkeys created in the overlay
+        std::vector<std::string> new_subkeys;
+        std::vector<ValueDelta> values;
+        uint64_t writes;
+    };
+
+    // Helpers below expect the mutex to be held by the caller
+    const KeyDelta *find_delta(const OpenKey &key) const;
+    KeyDelta &delta(SystemKey sk, const std::string &id,
+                    const std::string &path);
+    static const ValueDelta *find_value(const KeyDelta *d,
+                                        std::string_view name);
+
+    // Whether the wrapped key has a value, to be called without the mutex
+    bool inner_has_value(const OpenKey &key, const char *value_name);
+    int32_t write_values(const OpenKey &key,
+                         std::span<const ValueWrite> writes);
+
+    Backend &inner_;
+    std::unordered_map<SystemKey, std::unique_ptr<OpenKey>> roots_;
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, KeyDelta> deltas_;
+    // Ids of the changed keys, in the order they were first changed
+    std::vector<std::string> order_;
+};
+
+} // namespace reg
@@ -0,0 +1,145 @@
+#include "path_tree.h"
+#include "reg.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+namespace {
+
+using reg::PathNode;
+
+// Child of a node by name. The name views the string of the child node, so
+// it stays valid for as long as the node does.
+struct ChildKey {
+    const PathNode *parent;
+    std::string_view name;
+
+    bool operator==(const ChildKey &) const = default;
+};
+
+struct ChildKeyHash {
+    size_t operator()(const ChildKey &key) const {
+        const size_t h = std::hash<std::string_view> {}(key.name);
+        return h ^ (std::hash<const PathNode *> {}(key.parent) +
+                    0x9e3779b97f4a7c15 + (h << 6) + (h >> 2));
+    }
+};
+
+// A count drops to zero under the exclusive lock only, so a node found under
+// the shared lock is never one being freed
+struct PathTable {
+    std::shared_mutex mutex;
+    std::unordered_map<ChildKey, std::unique_ptr<PathNode>, ChildKeyHash>
+        children;
+};
+
+// Function-local, so keys created during static initialization can use it
+PathTable &table() {
+    static PathTable t;
+    return t;
+}
+
+const PathNode *intern_component(PathTable &t, const PathNode *parent,
+                                 std::string_view name) {
+    {
+        std::shared_lock lock(t.mutex);
+        const auto it = t.children.find(ChildKey {parent, name});
+        if (it != t.children.end()) {
+            it->second->refs++;
+            return it->second.get();
+        }
+    }
+    std::unique_lock lock(t.mutex);
+    // Someone may have added it in the meantime
+    const auto it = t.children.find(ChildKey {parent, name});
+    if (it != t.children.end()) {
+        it->second->refs++;
+        return it->second.get();
+    }
+    auto node = std::unique_ptr<PathNode>(new PathNode {
+        .parent = reg::retain_path(parent),
+        .name = std::string(name),
+        .length = parent != nullptr ? parent->length + 1 + name.size()
+                                    : name.size(),
+        .refs = 1,
+    });
+    const PathNode *n = node.get();
+    t.children.emplace(ChildKey {parent, n->name}, std::move(node));
+    return n;
+}
+
+} // namespace
+
+namespace reg {
+
+const PathNode *intern_path(const PathNode *parent,
+                            std::string_view subkey_path) {
+    PathTable &t = table();
+    const PathNode *node = retain_path(parent);
+    for (;;) {
+        const std::string_view name = next_path_component(subkey_path);
+        if (name.empty()) {
+            return node;
+        }
+        const PathNode *child = intern_component(t, node, name);
+        // The child holds its own reference to `node`
+        release_path(node);
+        node = child;
+    }
+}
+
+const PathNode *retain_path(const PathNode *node) {
+    if (node != nullptr) {
+        node->refs++;
+    }
+    return node;
+}
+
+void release_path(const PathNode *node) {
+    if (node == nullptr) {
+        return;
+    }
+    size_t refs = node->refs.load();
+    while (refs > 1) {
+        if (node->refs.compare_exchange_weak(refs, refs - 1)) {
+            return;
+        }
+    }
+    PathTable &t = table();
+    std::unique_lock lock(t.mutex);
+    while (node != nullptr && --node->refs == 0) {
+        const PathNode *parent = node->parent;
+        t.children.erase(t.children.find(ChildKey {parent, node->name}));
+        node = parent;
+    }
+}
+
+std::string join_path(const PathNode *node) {
+    if (node == nullptr) {
+        return {};
+    }
+    std::string path(node->length, '\\');
+    for (const PathNode *n = node; n != nullptr; n = n->parent) {
+        const size_t start = n->length - n->name.size();
+        path.replace(start, n->name.size(), n->name);
+    }
+    return path;
+}
+
+std::string join_path(const PathNode *node, std::string_view subkey_path) {
+    std::string path = join_path(node);
+    for (;;) {
+        const std::string_view name = next_path_component(subkey_path);
+        if (name.empty()) {
+            return path;
+        }
+        if (!path.empty()) {
+            path += '\\';
+        }
+        path += name;
+    }
+}
+
+} // namespace reg
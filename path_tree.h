@@ -0,0 +1,44 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <string_view>
+
+namespace reg {
+
+// Key path as a node of a process-wide tree of interned path components.
+// Keys with the same path share one node and a child key only points to the
+// node of its parent, so a common prefix is stored once no matter how many
+// keys below it are open. Nodes are reference counted: every key holds one
+// reference to its node and every node one to its parent, and a node is
+// freed with its last reference.
+struct PathNode {
+    const PathNode *parent;
+    std::string name;
+    // Length of the whole path joined with '\'
+    size_t length;
+    // Changed by the functions below only
+    mutable std::atomic<size_t> refs;
+};
+
+// Returns the node of a '\'-separated subkey path below `parent`, or of a
+// top-level path if `parent` is null, with a reference the caller releases.
+// Components are interned as given, with empty ones skipped, so an empty path
+// returns `parent` itself. Safe to call concurrently; finding an existing
+// node takes a shared lock only.
+const PathNode *intern_path(const PathNode *parent,
+                            std::string_view subkey_path);
+
+// Adds a reference to a node which the caller already holds one to
+const PathNode *retain_path(const PathNode *node);
+
+// Drops a reference, freeing the node and any parents left unused. Takes the
+// exclusive lock only when the last reference goes.
+void release_path(const PathNode *node);
+
+// Builds the full path of a node with a single allocation
+std::string join_path(const PathNode *node);
+// Same with a subkey path which has not been interned appended
+std::string join_path(const PathNode *node, std::string_view subkey_path);
+
+} // namespace reg
@@ -0,0 +1,111 @@
+#include "pool.h"
+#include <algorithm>
+
+namespace {
+
+// Pool and queue index of the worker running on the current thread
+thread_local const reg::ThreadPool *current_pool = nullptr;
+thread_local size_t current_queue = 0;
+
+} // namespace
+
+namespace reg {
+
+ThreadPool::ThreadPool(size_t threads)
+    : pending_ {0}, queued_ {0}, stop_ {false}, next_queue_ {0} {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; i++) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        threads_.emplace_back([this, i] { run(i); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    wait();
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    work_cv_.notify_all();
+    for (std::thread &t : threads_) {
+        t.join();
+    }
+}
+
+void ThreadPool::submit(Task task) {
+    const size_t idx = current_pool == this
+                           ? current_queue
+                           : next_queue_++ % queues_.size();
+    {
+        std::lock_guard lock(mutex_);
+        pending_++;
+        queued_++;
+    }
+    {
+        std::lock_guard lock(queues_[idx]->mutex);
+        queues_[idx]->tasks.push_back(std::move(task));
+    }
+    work_cv_.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock lock(mutex_);
+    idle_cv_.wait(lock, [this] { return pending_ == 0; });
+}
+
+size_t ThreadPool::size() const {
+    return threads_.size();
+}
+
+bool ThreadPool::pop(size_t idx, Task &task) {
+    Queue &q = *queues_[idx];
+    std::lock_guard lock(q.mutex);
+    if (q.tasks.empty()) {
+        return false;
+    }
+    task = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::steal(size_t idx, Task &task) {
+    for (size_t i = 1; i < queues_.size(); i++) {
+        Queue &q = *queues_[(idx + i) % queues_.size()];
+        std::lock_guard lock(q.mutex);
+        if (!q.tasks.empty()) {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(size_t idx) {
+    current_pool = this;
+    current_queue = idx;
+    for (;;) {
+        Task task;
+        if (pop(idx, task) || steal(idx, task)) {
+            {
+                std::lock_guard lock(mutex_);
+                queued_--;
+            }
+            task();
+            std::lock_guard lock(mutex_);
+            if (--pending_ == 0) {
+                idle_cv_.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock lock(mutex_);
+        work_cv_.wait(lock, [this] { return stop_ || queued_ > 0; });
+        if (stop_ && queued_ == 0) {
+            return;
+        }
+    }
+}
+
+} // namespace reg
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace reg {
+
+// Fixed-size thread pool with work stealing. Every worker has its own task
+// queue: it takes tasks from the back of it and, when it runs dry, steals
+// from the front of the others. Tasks submitted from a worker go to its own
+// queue, so recursive work stays local until someone is idle.
+class ThreadPool {
+  public:
+    using Task = std::function<void()>;
+
+    // Starts `threads` workers (at least one)
+    explicit ThreadPool(size_t threads);
+
+    // Waits for all tasks and stops the workers
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void submit(Task task);
+
+    // Blocks until every submitted task, including the ones submitted by
+    // other tasks, has finished
+    void wait();
+
+    size_t size() const;
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool pop(size_t idx, Task &task);
+    bool steal(size_t idx, Task &task);
+    void run(size_t idx);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable idle_cv_;
+    // Submitted tasks which have not finished yet
+    size_t pending_;
+    // Tasks in the queues, lets idle workers sleep instead of spinning
+    size_t queued_;
+    bool stop_;
+    std::atomic<size_t> next_queue_;
+};
+
+} // namespace reg
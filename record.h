@@ -0,0 +1,148 @@
+#pragma once
+
+#include "reg.h"
+#include <array>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace reg {
+
+// Member of a record and the registry value it is read from. Members can be
+// uint32_t (a U32 value or a 4 byte binary one) or std::string or
+// std::pmr::string (a String value).
+template <typename R, typename T> struct Field {
+    const char *value_name;
+    T R::*member;
+};
+
+// Describes the fields of a record type read with read_record(). Every such
+// type specializes it with a constexpr tuple of Field:
+//
+//     template <> struct RecordFields<Driver> {
+//         static constexpr std::tuple fields {
+//             Field {"DriverDesc", &Driver::desc},
+//             Field {"DriverVersion", &Driver::version},
+//         };
+//     };
+template <typename R> struct RecordFields;
+
+template <typename R>
+inline constexpr size_t RecordSize =
+    std::tuple_size_v<std::remove_const_t<decltype(RecordFields<R>::fields)>>;
+
+// Value names of a record in field order, built at compile time
+template <typename R>
+inline constexpr std::array<const char *, RecordSize<R>> record_value_names =
+    std::apply(
+        [](const auto &...fields) {
+            return std::array<const char *, sizeof...(fields)> {
+                fields.value_name...};
+        },
+        RecordFields<R>::fields);
+
+namespace detail {
+
+template <typename R>
+bool read_field(R &record, const Field<R, uint32_t> &field,
+                const ValueEntry &entry, const uint8_t *data) {
+    if (!value_type_matches(ValueType::U32, entry.type, entry.size) ||
+        entry.size != sizeof(uint32_t)) {
+        return false;
+    }
+    std::memcpy(&(record.*field.member), data + entry.offset,
+                sizeof(uint32_t));
+    return true;
+}
+
+// Any allocator, so std::string and std::pmr::string alike
+template <typename R, typename Allocator>
+bool read_field(
+    R &record,
+    const Field<R, std::basic_string<char, std::char_traits<char>, Allocator>>
+        &field,
+    const ValueEntry &entry, const uint8_t *data) {
+    if (entry.type != ValueType::String) {
+        return false;
+    }
+    // Stored strings are usually, but not always, null-terminated
+    const char *value = (const char *) data + entry.offset;
+    (record.*field.member).assign(value, strnlen(value, entry.size));
+    return true;
+}
+
+// Records with pmr members are allocator-aware (have an allocator_type) and
+// get theirs from `mr`
+template <typename R> R make_record(std::pmr::memory_resource *mr) {
+    if constexpr (std::uses_allocator_v<R, std::pmr::polymorphic_allocator<>>) {
+        return std::make_obj_using_allocator<R>(
+            std::pmr::polymorphic_allocator<>(mr));
+    } else {
+        return R {};
+    }
+}
+
+} // namespace detail
+
+// Reads every field of a record from the values of a key with one backend
+// operation. The values land in a stack buffer when they fit into
+// InlineBytes, only larger ones need a buffer from `mr`, which also holds
+// the strings of an allocator-aware record.
+template <typename R, size_t InlineBytes = RecordSize<R> * 128>
+ReadResult<R>
+read_record(const Key &key,
+            std::pmr::memory_resource *mr = std::pmr::get_default_resource()) {
+    constexpr size_t N = RecordSize<R>;
+    std::array<ValueEntry, N> entries;
+    for (size_t i = 0; i < N; i++) {
+        entries[i] = ValueEntry {
+            .name = record_value_names<R>[i],
+            .type = ValueType::None,
+            .offset = 0,
+            .size = 0,
+        };
+    }
+
+    std::array<uint8_t, InlineBytes> inline_data;
+    std::pmr::vector<uint8_t> heap_data(mr);
+    std::span<uint8_t> data = inline_data;
+    for (;;) {
+        const auto size_res = key.read_values(entries, data);
+        if (!size_res.has_value()) {
+            // Names the missing value, if that is what has failed
+            Error error = size_res.error();
+            error.op = Operation::ReadRecord;
+            return std::unexpected(std::move(error));
+        }
+        if (size_res.value() <= data.size()) {
+            break;
+        }
+        heap_data.resize(size_res.value());
+        data = heap_data;
+    }
+
+    R record = detail::make_record<R>(mr);
+    size_t idx = 0;
+    const bool ok = std::apply(
+        [&](const auto &...fields) {
+            return (detail::read_field(record, fields, entries[idx++],
+                                       data.data()) &&
+                    ...);
+        },
+        RecordFields<R>::fields);
+    if (!ok) {
+        return std::unexpected(Error {
+            .code = status::UnsupportedType,
+            .op = Operation::ReadRecord,
+            .name = record_value_names<R>[idx - 1],
+            .index = (uint32_t) (idx - 1),
+        });
+    }
+    return record;
+}
+
+} // namespace reg
@@ -1,10 +1,14 @@
 #include "reg.h"
+#include "stats.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <format>
-#include <windows.h>
+#include <utility>
 
 namespace {
 
-constexpr std::string system_key_to_path(reg::SystemKey sk) {
+constexpr std::string_view system_key_to_path(reg::SystemKey sk) {
     switch (sk) {
     case reg::SystemKey::LocalMachine:
         return "HKEY_LOCAL_MACHINE";
@@ -12,46 +16,165 @@ constexpr std::string system_key_to_path(reg::SystemKey sk) {
     return "HKEY_LOCAL_MACHINE"; // fallback for now
 }
 
-constexpr uint64_t system_key_to_key_handle(reg::SystemKey sk) {
-    HKEY k;
-    switch (sk) {
-    case reg::SystemKey::LocalMachine:
-        k = HKEY_LOCAL_MACHINE;
-        break;
-    default:
-        k = HKEY_LOCAL_MACHINE; // fallback for now
+reg::Error make_error(int32_t code, reg::Operation op,
+                      const std::string &name = {}, uint32_t index = 0) {
+    return reg::Error {
+        .code = code,
+        .op = op,
+        .name = name,
+        .index = index,
+    };
+}
+
+// Runs a backend call and, if statistics are compiled in, records how long
+// it has taken and how it has ended
+template <typename Call> int32_t timed(reg::Operation op, Call call) {
+#ifdef REG_STATS
+    const auto start = std::chrono::steady_clock::now();
+    const int32_t res = call();
+    reg::stats::record(op, res, std::chrono::steady_clock::now() - start);
+    return res;
+#else
+    (void) op;
+    return call();
+#endif
+}
+
+// Reads a subkey name into a buffer, growing it when the name does not fit.
+// On success `size` is the name length.
+int32_t enum_subkey(reg::Backend &backend, reg::Handle k, uint32_t idx,
+                    std::string &buf, uint32_t &size) {
+    for (;;) {
+        size = (uint32_t) buf.size();
+        const int32_t res = backend.enum_subkey(k, idx, buf.data(), size);
+        if (res != reg::status::MoreData) {
+            return res;
+        }
+        reg::KeyInfo info;
+        const int32_t info_res = backend.query_info(k, info);
+        if (info_res != reg::status::Success) {
+            return info_res;
+        }
+        // Doubling keeps this finite even if the key keeps changing
+        buf.resize(std::max<size_t>(info.max_subkey_name_len + 1,
+                                    buf.size() * 2));
+    }
+}
+
+// Reads a value into a reusable buffer, growing it when the value does not
+// fit. On success `size` is the size of the data.
+template <typename Buffer>
+int32_t read_value(reg::Backend &backend, reg::Handle k,
+                   const std::string &value_name, reg::ValueType type,
+                   Buffer &buf, uint32_t &size) {
+    // A buffer is never empty here, an empty one would be a size query
+    buf.resize(std::max<size_t>(buf.capacity(), 64));
+    for (;;) {
+        size = (uint32_t) buf.size();
+        const int32_t res = backend.get_value(k, value_name.c_str(), type,
+                                              buf.data(), size);
+        if (res != reg::status::MoreData) {
+            return res;
+        }
+        buf.resize(size);
+    }
+}
+
+// Reads several values in one call into the caller's entries and data, growing
+// the data when the values do not fit. On success `data` has the size of
+// the values.
+template <typename Entries, typename Data>
+int32_t read_values_into(reg::Backend &backend, reg::Handle k,
+                         std::span<const std::string> value_names,
+                         Entries &entries, Data &data) {
+    entries.reserve(value_names.size());
+    for (const std::string &value_name : value_names) {
+        entries.push_back(reg::ValueEntry {
+            .name = value_name.c_str(),
+            .type = reg::ValueType::None,
+            .offset = 0,
+            .size = 0,
+        });
+    }
+    // Most values are small, so the first guess usually avoids a retry
+    uint32_t size = (uint32_t) value_names.size() * 128;
+    int32_t res;
+    do {
+        data.resize(size);
+        res = backend.get_values(k, entries, data.data(), size);
+    } while (res == reg::status::MoreData);
+    data.resize(size);
+    return res;
+}
+
+// Builds the error of a failed multiple values read. The backend fails the
+// whole read when a value is missing, so that one is then found by single
+// lookups and named like a single read would name it.
+reg::Error read_values_error(reg::Backend &backend, reg::Handle k,
+                             int32_t res, reg::Operation op,
+                             std::span<const reg::ValueEntry> entries) {
+    if (res == reg::status::FileNotFound) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            uint32_t size = 0;
+            if (backend.get_value(k, entries[i].name, reg::ValueType::None,
+                                  nullptr, size) == res) {
+                return make_error(res, op, entries[i].name, (uint32_t) i);
+            }
+        }
     }
-    return (uint64_t) k;
+    return make_error(res, op);
 }
 
-std::string create_msg(std::string desc, std::string param) {
-    return std::format("{} '{}'", desc, param);
+// Decodes values read with read_values_into(), returns the index of the
+// first one of a wrong type or SIZE_MAX
+template <typename U32s>
+size_t decode_u32_values(std::span<const reg::ValueEntry> entries,
+                         const uint8_t *data, U32s &u32_values) {
+    u32_values.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        const reg::ValueEntry &entry = entries[i];
+        if (!reg::value_type_matches(reg::ValueType::U32, entry.type,
+                                     entry.size) ||
+            entry.size != sizeof(uint32_t)) {
+            return i;
+        }
+        std::memcpy(&u32_values[i], data + entry.offset, sizeof(uint32_t));
+    }
+    return SIZE_MAX;
 }
 
-std::string create_path(std::string parent_path,
-                        const std::string &subkey_name) {
-    if (!subkey_name.empty()) {
-        return std::format("{}\\{}", parent_path, subkey_name);
+template <typename Strings>
+size_t decode_string_values(std::span<const reg::ValueEntry> entries,
+                            const uint8_t *data, Strings &string_values) {
+    string_values.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) {
+        const reg::ValueEntry &entry = entries[i];
+        if (entry.type != reg::ValueType::String) {
+            return i;
+        }
+        // Stored strings are usually, but not always, null-terminated
+        const char *value = (const char *) data + entry.offset;
+        string_values[i].assign(value, strnlen(value, entry.size));
     }
-    return parent_path;
+    return SIZE_MAX;
 }
 
+// Results take the pieces of an error instead of a ready one, so nothing is
+// built on success
 template <typename T>
-reg::ReadResult<T> read_result(LSTATUS winapi_result, T expected_value,
-                               const std::string &error_message) {
-    if (winapi_result == ERROR_SUCCESS) {
+reg::ReadResult<T> read_result(int32_t result, T expected_value,
+                               reg::Operation op, const std::string &name = {},
+                               uint32_t index = 0) {
+    if (result == reg::status::Success) {
         return expected_value;
     } else {
-        return std::unexpected(reg::Error {
-            .code = winapi_result,
-            .msg = error_message,
-        });
+        return std::unexpected(make_error(result, op, name, index));
     }
 }
 
-reg::WriteResult write_result(LSTATUS winapi_result,
-                              const std::string &error_msg) {
-    if (winapi_result == ERROR_SUCCESS) {
+reg::WriteResult write_result(int32_t result, reg::Operation op,
+                              const std::string &name) {
+    if (result == reg::status::Success) {
         return {
             .fail = false,
             .error = {},
@@ -59,48 +182,227 @@ reg::WriteResult write_result(LSTATUS winapi_result,
     }
     return {
         .fail = true,
-        .error =
-            {
-                .code = winapi_result,
-                .msg = error_msg,
-            },
+        .error = make_error(result, op, name),
     };
 }
 
-const uint64_t InvalidHandle = 0;
-
 } // namespace
 
 namespace reg {
 
-Key::Key(SystemKey sk)
-    : k_ {system_key_to_key_handle(sk)}, system_ {true},
-      path_ {system_key_to_path(sk)} {}
+std::string Error::msg() const {
+    switch (op) {
+    case Operation::OpenKey:
+        return std::format("Failed to open key '{}'", name);
+    case Operation::CreateKey:
+        return std::format("Failed to create key '{}'", name);
+    case Operation::GetSubkeysCount:
+        return "Failed to get subkeys count";
+    case Operation::QueryKeyInfo:
+        return "Failed to query key info";
+    case Operation::EnumSubkeyNames:
+        return std::format("Failed to get subkey name with index '{}'", index);
+    case Operation::EnumValues:
+        return std::format("Failed to get value with index '{}'", index);
+    case Operation::ReadU32Value:
+        return std::format("Failed to get u32 value '{}'", name);
+    case Operation::ReadStringValue:
+        return std::format("Failed to get string value '{}'", name);
+    case Operation::QueryValueSize:
+        return std::format("Failed to get size of value '{}'", name);
+    case Operation::ReadU64Value:
+        return std::format("Failed to get u64 value '{}'", name);
+    case Operation::ReadBinaryValue:
+        return std::format("Failed to get binary value '{}'", name);
+    case Operation::ReadExpandStringValue:
+        return std::format("Failed to get expandable string value '{}'",
+                           name);
+    case Operation::ReadMultiStringValue:
+        return std::format("Failed to get multi-string value '{}'", name);
+    case Operation::ReadValues:
+        return name.empty()
+                   ? "Failed to read multiple values"
+                   : std::format("Failed to read multiple values: value '{}'",
+                                 name);
+    case Operation::ReadU32Values:
+        return std::format("Failed to get multiple u32 values: {}",
+                           name.empty()
+                               ? "Failed to read multiple values"
+                               : std::format("Failed to get u32 value '{}'",
+                                             name));
+    case Operation::ReadStringValues:
+        return std::format("Failed to get multiple string values: {}",
+                           name.empty()
+                               ? "Failed to read multiple values"
+                               : std::format("Failed to get string value '{}'",
+                                             name));
+    case Operation::WriteBinaryValue:
+        return std::format("Failed to write binary value '{}'", name);
+    case Operation::WriteU32Value:
+        return std::format("Failed to write u32 value '{}'", name);
+    case Operation::WriteU64Value:
+        return std::format("Failed to write u64 value '{}'", name);
+    case Operation::WriteStringValue:
+        return std::format("Failed to write string value '{}'", name);
+    case Operation::WriteExpandStringValue:
+        return std::format("Failed to write expandable string value '{}'",
+                           name);
+    case Operation::WriteMultiStringValue:
+        return std::format("Failed to write multi-string value '{}'", name);
+    case Operation::WriteValues:
+        return "Failed to write multiple values";
+    case Operation::DeleteValue:
+        return std::format("Failed to delete value '{}'", name);
+    case Operation::ApplyWritePlan:
+        return name.empty()
+                   ? "Failed to apply write plan"
+                   : std::format("Failed to apply write plan at value '{}'",
+                                 name);
+    case Operation::RollBackWritePlan:
+        return std::format("Failed to roll back write plan at value '{}'",
+                           name);
+    case Operation::CommitOverlay:
+        return std::format("Failed to commit overlay changes of key '{}'",
+                           name);
+    case Operation::WaitForChange:
+        return std::format("Failed to wait for a change of key '{}'", name);
+    case Operation::ReadRecord:
+        return name.empty()
+                   ? "Failed to read record values"
+                   : std::format("Failed to read record value '{}'", name);
+    case Operation::ImportRegFile:
+        return std::format("Failed to import .reg file at line {}{}", index,
+                           name.empty() ? "" : std::format(" ('{}')", name));
+    case Operation::ExportRegFile:
+        return name.empty()
+                   ? "Failed to export .reg file"
+                   : std::format("Failed to export key '{}'", name);
+    case Operation::_Count:
+        break;
+    }
+    return "Unknown error";
+}
+
+int32_t Backend::set_values(Handle k, std::span<const ValueWrite> writes) {
+    for (const ValueWrite &w : writes) {
+        const int32_t res = set_value(k, "", w.name, w.type, w.data, w.size);
+        if (res != status::Success) {
+            return res;
+        }
+    }
+    return status::Success;
+}
+
+bool value_type_matches(ValueType requested, ValueType stored,
+                        uint32_t size) {
+    if (requested == ValueType::None || requested == stored) {
+        return true;
+    }
+    if (stored != ValueType::Binary) {
+        return false;
+    }
+    return (requested == ValueType::U32 && size == sizeof(uint32_t)) ||
+           (requested == ValueType::U64 && size == sizeof(uint64_t));
+}
+
+bool equal_names(std::string_view a, std::string_view b) {
+    return std::ranges::equal(a, b, [](char x, char y) {
+        return std::tolower((unsigned char) x) ==
+               std::tolower((unsigned char) y);
+    });
+}
+
+std::string_view next_path_component(std::string_view &path) {
+    while (path.starts_with('\\')) {
+        path.remove_prefix(1);
+    }
+    const size_t sep = path.find('\\');
+    const std::string_view component = path.substr(0, sep);
+    path.remove_prefix(sep == std::string_view::npos ? path.size() : sep);
+    return component;
+}
+
+#ifdef _WIN32
+Key::Key(SystemKey sk) : Key(system_backend(), sk) {}
+#endif
 
-Key::Key(const Key &k, const std::string &subkey_name)
-    : k_ {InvalidHandle}, system_ {k.system_ && subkey_name.empty()},
-      path_ {create_path(k.path_, subkey_name)} {
+Key::Key(Backend &backend, SystemKey sk)
+    : backend_ {&backend}, k_ {backend.root(sk)}, system_ {true},
+      path_ {intern_path(nullptr, system_key_to_path(sk))} {}
+
+Key::Key(const Key &k, const std::string &subkey_name, Access access)
+    : Key(k, subkey_name, access, false, nullptr) {}
+
+ReadResult<Key> Key::open(const Key &k, const std::string &subkey_name,
+                          Access access) {
+    int32_t res;
+    Key key(k, subkey_name, access, false, &res);
+    if (res != status::Success) {
+        return std::unexpected(make_error(res, Operation::OpenKey, key.path()));
+    }
+    return key;
+}
+
+ReadResult<Key> Key::create(const Key &k, const std::string &subkey_name,
+                            Access access) {
+    int32_t res;
+    Key key(k, subkey_name, access, true, &res);
+    if (res != status::Success) {
+        return std::unexpected(
+            make_error(res, Operation::CreateKey, key.path()));
+    }
+    return key;
+}
+
+Key::Key(const Key &k, const std::string &subkey_name, Access access,
+         bool create, int32_t *res)
+    : backend_ {k.backend_}, k_ {InvalidHandle},
+      system_ {k.system_ && subkey_name.empty()}, path_ {nullptr} {
     if (!system_) {
-        RegOpenKeyExA((HKEY) k.k_, subkey_name.c_str(), 0, KEY_READ | KEY_WRITE,
-                      (HKEY *) &k_);
+        const Operation op = create ? Operation::CreateKey : Operation::OpenKey;
+        const int32_t open_res = timed(op, [&] {
+            return create ? backend_->create(k.k_, subkey_name.c_str(), access,
+                                             k_)
+                          : backend_->open(k.k_, subkey_name.c_str(), access,
+                                           k_);
+        });
+        if (open_res != status::Success) {
+            k_ = InvalidHandle;
+            path_ = retain_path(k.path_);
+            unopened_path_ = subkey_name;
+        } else {
+            path_ = intern_path(k.path_, subkey_name);
+        }
+        if (res != nullptr) {
+            *res = open_res;
+        }
     } else {
         k_ = k.k_;
+        path_ = retain_path(k.path_);
+        if (res != nullptr) {
+            *res = status::Success;
+        }
     }
 }
 
 Key::Key(Key &&other)
-    : k_ {other.k_}, system_ {other.system_}, path_ {std::move(other.path_)} {
+    : backend_ {other.backend_}, k_ {other.k_}, system_ {other.system_},
+      path_ {other.path_}, unopened_path_ {std::move(other.unopened_path_)} {
     other.k_ = InvalidHandle;
+    other.path_ = nullptr;
 }
 
 Key &Key::operator=(Key &&other) {
     if (this != &other) {
         if (!system_ && valid()) {
-            RegCloseKey((HKEY) k_);
+            backend_->close(k_);
         }
+        backend_ = other.backend_;
         k_ = other.k_;
         system_ = other.system_;
-        path_ = std::move(other.path_);
+        release_path(path_);
+        path_ = std::exchange(other.path_, nullptr);
+        unopened_path_ = std::move(other.unopened_path_);
         other.k_ = InvalidHandle;
     }
     return *this;
@@ -108,86 +410,323 @@ Key &Key::operator=(Key &&other) {
 
 Key::~Key() {
     if (!system_ && valid()) {
-        RegCloseKey((HKEY) k_);
+        backend_->close(k_);
         k_ = InvalidHandle;
     }
+    release_path(path_);
 }
 
 ReadResult<uint32_t> Key::get_subkeys_count() const {
-    uint32_t subkeys_count;
-    LSTATUS res = RegQueryInfoKeyA((HKEY) k_, 0, 0, 0, (DWORD *) &subkeys_count,
-                                   0, 0, 0, 0, 0, 0, 0);
-    return read_result<uint32_t>(res, subkeys_count,
-                                 "Failed to get subkeys count");
+    KeyInfo info {};
+    int32_t res = timed(Operation::GetSubkeysCount,
+                        [&] { return backend_->query_info(k_, info); });
+    return read_result<uint32_t>(res, info.subkeys_count,
+                                 Operation::GetSubkeysCount);
+}
+
+ReadResult<KeyInfo> Key::query_info() const {
+    KeyInfo info {};
+    int32_t res = timed(Operation::QueryKeyInfo,
+                        [&] { return backend_->query_info(k_, info); });
+    return read_result<KeyInfo>(res, info, Operation::QueryKeyInfo);
 }
 
 ReadResult<std::string> Key::enum_subkey_names(uint32_t index) const {
-    // TODO: Handle too small buffer
-    char subkey_name[64];
-    DWORD size = sizeof(subkey_name);
-    LSTATUS res =
-        RegEnumKeyExA((HKEY) k_, index, subkey_name, &size, 0, 0, 0, 0);
-    return read_result<std::string>(
-        res, subkey_name,
-        create_msg("Failed to get subkey name with index",
-                   std::to_string(index)));
-}
-
-ReadResult<uint32_t> Key::read_u32_value(std::string value_name) const {
+    std::string subkey_name(64, '\0');
+    uint32_t size;
+    int32_t res = timed(Operation::EnumSubkeyNames, [&] {
+        return enum_subkey(*backend_, k_, index, subkey_name, size);
+    });
+    if (res != status::Success) {
+        return std::unexpected(
+            make_error(res, Operation::EnumSubkeyNames, {}, index));
+    }
+    subkey_name.resize(size);
+    return subkey_name;
+}
+
+Subkeys Key::subkeys() const {
+    return Subkeys(*this);
+}
+
+ReadResult<ValueView> Key::enum_value(uint32_t idx, std::string &name_buf,
+                                      std::vector<uint8_t> &data_buf) const {
+    // Neither buffer may be empty, an empty one would be a size query
+    name_buf.resize(std::max<size_t>(name_buf.capacity(), 64));
+    data_buf.resize(std::max<size_t>(data_buf.capacity(), 64));
+    uint32_t name_size;
+    uint32_t size;
+    ValueType type = ValueType::None;
+    int32_t res = timed(Operation::EnumValues, [&] {
+        for (;;) {
+            name_size = (uint32_t) name_buf.size();
+            size = (uint32_t) data_buf.size();
+            const int32_t enum_res = backend_->enum_value(
+                k_, idx, name_buf.data(), name_size, type, data_buf.data(),
+                size);
+            if (enum_res != status::MoreData) {
+                return enum_res;
+            }
+            name_buf.resize(std::max<size_t>(name_size + 1, name_buf.size()));
+            data_buf.resize(std::max<size_t>(size, data_buf.size()));
+        }
+    });
+    return read_result<ValueView>(
+        res,
+        ValueView {
+            .name = std::string_view(name_buf.data(), name_size),
+            .type = type,
+            .data = std::span(data_buf.data(), size),
+        },
+        Operation::EnumValues, {}, idx);
+}
+
+ReadResult<uint32_t> Key::read_u32_value(const std::string &value_name) const {
     uint32_t value;
-    DWORD size = sizeof(value);
-    LSTATUS res = RegGetValueA((HKEY) k_, 0, value_name.c_str(), RRF_RT_DWORD,
-                               0, &value, &size);
-    return read_result<uint32_t>(
-        res, value, create_msg("Failed to get u32 value", value_name));
+    uint32_t size = sizeof(value);
+    int32_t res = timed(Operation::ReadU32Value, [&] {
+        return backend_->get_value(k_, value_name.c_str(), ValueType::U32,
+                                   &value, size);
+    });
+    return read_result<uint32_t>(res, value, Operation::ReadU32Value,
+                                 value_name);
 }
 
 ReadResult<std::vector<uint32_t>>
 Key::read_u32_values(std::span<const std::string> value_names) const {
-    std::vector<uint32_t> values(value_names.size());
-    for (size_t i = 0; i < values.size(); i++) {
-        auto value_res = read_u32_value(value_names[i]);
-        if (!value_res.has_value()) {
-            Error err = value_res.error();
-            return std::unexpected(Error {
-                .code = err.code,
-                .msg = std::string {"Failed to get multiple u32 values: "} +
-                       err.msg,
-            });
-        }
-        values[i] = value_res.value();
+    auto values_res = read_values(value_names);
+    if (!values_res.has_value()) {
+        Error error = std::move(values_res.error());
+        error.op = Operation::ReadU32Values;
+        return std::unexpected(std::move(error));
     }
-    return values;
+    const Values &values = values_res.value();
+    std::vector<uint32_t> u32_values;
+    const size_t bad =
+        decode_u32_values(values.entries, values.data.data(), u32_values);
+    if (bad != SIZE_MAX) {
+        return std::unexpected(make_error(status::UnsupportedType,
+                                          Operation::ReadU32Values,
+                                          value_names[bad], (uint32_t) bad));
+    }
+    return u32_values;
+}
+
+ReadResult<std::pmr::vector<uint32_t>>
+Key::read_u32_values(std::span<const std::string> value_names,
+                     std::pmr::memory_resource *mr) const {
+    std::pmr::vector<ValueEntry> entries(mr);
+    std::pmr::vector<uint8_t> data(mr);
+    const int32_t res = timed(Operation::ReadValues, [&] {
+        return read_values_into(*backend_, k_, value_names, entries, data);
+    });
+    if (res != status::Success) {
+        return std::unexpected(read_values_error(
+            *backend_, k_, res, Operation::ReadU32Values, entries));
+    }
+    std::pmr::vector<uint32_t> u32_values(mr);
+    const size_t bad = decode_u32_values(entries, data.data(), u32_values);
+    if (bad != SIZE_MAX) {
+        return std::unexpected(make_error(status::UnsupportedType,
+                                          Operation::ReadU32Values,
+                                          value_names[bad], (uint32_t) bad));
+    }
+    return u32_values;
+}
+
+ReadResult<std::string>
+Key::read_string_value(const std::string &value_name) const {
+    std::string buf;
+    const auto value_res = read_string_value(value_name, buf);
+    if (!value_res.has_value()) {
+        return std::unexpected(value_res.error());
+    }
+    buf.resize(value_res->size());
+    return buf;
+}
+
+ReadResult<std::pmr::string>
+Key::read_string_value(const std::string &value_name,
+                       std::pmr::memory_resource *mr) const {
+    std::pmr::string buf(mr);
+    uint32_t size = 0;
+    int32_t res = timed(Operation::ReadStringValue, [&] {
+        return read_value(*backend_, k_, value_name, ValueType::String, buf,
+                          size);
+    });
+    if (res != status::Success) {
+        return std::unexpected(
+            make_error(res, Operation::ReadStringValue, value_name));
+    }
+    buf.resize(strnlen(buf.data(), size));
+    return buf;
+}
+
+ReadResult<uint32_t> Key::query_value_size(const std::string &value_name,
+                                           ValueType type) const {
+    uint32_t size = 0;
+    int32_t res = timed(Operation::QueryValueSize, [&] {
+        return backend_->get_value(k_, value_name.c_str(), type, nullptr,
+                                   size);
+    });
+    return read_result<uint32_t>(res, size, Operation::QueryValueSize,
+                                 value_name);
+}
+
+ReadResult<uint64_t> Key::read_u64_value(const std::string &value_name) const {
+    uint64_t value;
+    uint32_t size = sizeof(value);
+    int32_t res = timed(Operation::ReadU64Value, [&] {
+        return backend_->get_value(k_, value_name.c_str(), ValueType::U64,
+                                   &value, size);
+    });
+    return read_result<uint64_t>(res, value, Operation::ReadU64Value,
+                                 value_name);
+}
+
+ReadResult<uint32_t> Key::read_binary_value(const std::string &value_name,
+                                            std::span<uint8_t> data) const {
+    uint32_t size = (uint32_t) data.size();
+    int32_t res = timed(Operation::ReadBinaryValue, [&] {
+        // With an empty span only the size is set
+        return backend_->get_value(k_, value_name.c_str(), ValueType::Binary,
+                                   data.data(), size);
+    });
+    // `size` is the required one then
+    if (res == status::MoreData) {
+        res = status::Success;
+    }
+    return read_result<uint32_t>(res, size, Operation::ReadBinaryValue,
+                                 value_name);
+}
+
+ReadResult<std::span<const uint8_t>>
+Key::read_binary_value(const std::string &value_name,
+                       std::vector<uint8_t> &buf) const {
+    uint32_t size = 0;
+    int32_t res = timed(Operation::ReadBinaryValue, [&] {
+        return read_value(*backend_, k_, value_name, ValueType::Binary, buf,
+                          size);
+    });
+    return read_result<std::span<const uint8_t>>(
+        res, std::span(buf.data(), size), Operation::ReadBinaryValue,
+        value_name);
 }
 
-ReadResult<std::string> Key::read_string_value(std::string value_name) const {
-    // TODO: Handle too small buffer
-    char value[64];
-    DWORD size = sizeof(value);
-    LSTATUS res = RegGetValueA((HKEY) k_, 0, value_name.c_str(), RRF_RT_REG_SZ,
-                               0, value, &size);
-    return read_result<std::string>(
-        res, value, create_msg("Failed to get string value", value_name));
+ReadResult<std::string_view>
+Key::read_string_value(const std::string &value_name, std::string &buf) const {
+    uint32_t size = 0;
+    int32_t res = timed(Operation::ReadStringValue, [&] {
+        return read_value(*backend_, k_, value_name, ValueType::String, buf,
+                          size);
+    });
+    // Stored strings are usually, but not always, null-terminated
+    return read_result<std::string_view>(
+        res, std::string_view(buf.data(), strnlen(buf.data(), size)),
+        Operation::ReadStringValue, value_name);
+}
+
+ReadResult<std::string_view>
+Key::read_expand_string_value(const std::string &value_name,
+                              std::string &buf) const {
+    uint32_t size = 0;
+    int32_t res = timed(Operation::ReadExpandStringValue, [&] {
+        return read_value(*backend_, k_, value_name, ValueType::ExpandString,
+                          buf, size);
+    });
+    return read_result<std::string_view>(
+        res, std::string_view(buf.data(), strnlen(buf.data(), size)),
+        Operation::ReadExpandStringValue, value_name);
+}
+
+ReadResult<MultiStrings>
+Key::read_multi_string_value(const std::string &value_name,
+                             std::string &buf) const {
+    uint32_t size = 0;
+    int32_t res = timed(Operation::ReadMultiStringValue, [&] {
+        return read_value(*backend_, k_, value_name, ValueType::MultiString,
+                          buf, size);
+    });
+    return read_result<MultiStrings>(
+        res, MultiStrings(std::string_view(buf.data(), size)),
+        Operation::ReadMultiStringValue, value_name);
 }
 
 ReadResult<std::vector<std::string>>
 Key::read_string_values(std::span<const std::string> value_names) const {
-    std::vector<std::string> values(value_names.size());
-    for (size_t i = 0; i < values.size(); i++) {
-        auto value_res = read_string_value(value_names[i]);
-        if (!value_res.has_value()) {
-            Error err = value_res.error();
-            return std::unexpected(Error {
-                .code = err.code,
-                .msg = std::string {"Failed to get multiple string values: "} +
-                       err.msg,
-            });
-        }
-        values[i] = value_res.value();
+    auto values_res = read_values(value_names);
+    if (!values_res.has_value()) {
+        Error error = std::move(values_res.error());
+        error.op = Operation::ReadStringValues;
+        return std::unexpected(std::move(error));
+    }
+    const Values &values = values_res.value();
+    std::vector<std::string> string_values;
+    const size_t bad = decode_string_values(values.entries, values.data.data(),
+                                            string_values);
+    if (bad != SIZE_MAX) {
+        return std::unexpected(make_error(status::UnsupportedType,
+                                          Operation::ReadStringValues,
+                                          value_names[bad], (uint32_t) bad));
+    }
+    return string_values;
+}
+
+ReadResult<std::pmr::vector<std::pmr::string>>
+Key::read_string_values(std::span<const std::string> value_names,
+                        std::pmr::memory_resource *mr) const {
+    std::pmr::vector<ValueEntry> entries(mr);
+    std::pmr::vector<uint8_t> data(mr);
+    const int32_t res = timed(Operation::ReadValues, [&] {
+        return read_values_into(*backend_, k_, value_names, entries, data);
+    });
+    if (res != status::Success) {
+        return std::unexpected(read_values_error(
+            *backend_, k_, res, Operation::ReadStringValues, entries));
+    }
+    // The strings take the resource from the vector
+    std::pmr::vector<std::pmr::string> string_values(mr);
+    const size_t bad =
+        decode_string_values(entries, data.data(), string_values);
+    if (bad != SIZE_MAX) {
+        return std::unexpected(make_error(status::UnsupportedType,
+                                          Operation::ReadStringValues,
+                                          value_names[bad], (uint32_t) bad));
+    }
+    return string_values;
+}
+
+ReadResult<Values>
+Key::read_values(std::span<const std::string> value_names) const {
+    Values values;
+    int32_t res = timed(Operation::ReadValues, [&] {
+        return read_values_into(*backend_, k_, value_names, values.entries,
+                                values.data);
+    });
+    if (res != status::Success) {
+        return std::unexpected(read_values_error(
+            *backend_, k_, res, Operation::ReadValues, values.entries));
     }
     return values;
 }
 
+ReadResult<uint32_t> Key::read_values(std::span<ValueEntry> entries,
+                                      std::span<uint8_t> data) const {
+    uint32_t size = (uint32_t) data.size();
+    int32_t res = timed(Operation::ReadValues, [&] {
+        return backend_->get_values(k_, entries, data.data(), size);
+    });
+    // `size` is the required one then
+    if (res == status::MoreData) {
+        res = status::Success;
+    }
+    if (res != status::Success) {
+        return std::unexpected(read_values_error(
+            *backend_, k_, res, Operation::ReadValues, entries));
+    }
+    return size;
+}
+
 WriteResult Key::write_binary_value(const std::string &value_name,
                                     std::span<const uint8_t> data) const {
     return write_subkey_binary_value("", value_name, data);
@@ -197,11 +736,12 @@ WriteResult
 Key::write_subkey_binary_value(const std::string &subkey_name,
                                const std::string &value_name,
                                std::span<const uint8_t> data) const {
-    LSTATUS res =
-        RegSetKeyValueA((HKEY) k_, subkey_name.c_str(), value_name.c_str(),
-                        REG_BINARY, data.data(), (DWORD) data.size_bytes());
-    return write_result(res,
-                        create_msg("Failed to write binary value", value_name));
+    int32_t res = timed(Operation::WriteBinaryValue, [&] {
+        return backend_->set_value(k_, subkey_name.c_str(),
+                                   value_name.c_str(), ValueType::Binary,
+                                   data.data(), (uint32_t) data.size_bytes());
+    });
+    return write_result(res, Operation::WriteBinaryValue, value_name);
 }
 
 WriteResult Key::write_u32_value(const std::string &value_name,
@@ -212,11 +752,75 @@ WriteResult Key::write_u32_value(const std::string &value_name,
 WriteResult Key::write_subkey_u32_value(const std::string &subkey_name,
                                         const std::string &value_name,
                                         uint32_t value) const {
-    LSTATUS res =
-        RegSetKeyValueA((HKEY) k_, subkey_name.c_str(), value_name.c_str(),
-                        REG_DWORD, &value, sizeof(value));
-    return write_result(res,
-                        create_msg("Failed to write binary value", value_name));
+    int32_t res = timed(Operation::WriteU32Value, [&] {
+        return backend_->set_value(k_, subkey_name.c_str(),
+                                   value_name.c_str(), ValueType::U32, &value,
+                                   sizeof(value));
+    });
+    return write_result(res, Operation::WriteU32Value, value_name);
+}
+
+WriteResult Key::write_u64_value(const std::string &value_name,
+                                 uint64_t value) const {
+    int32_t res = timed(Operation::WriteU64Value, [&] {
+        return backend_->set_value(k_, "", value_name.c_str(), ValueType::U64,
+                                   &value, sizeof(value));
+    });
+    return write_result(res, Operation::WriteU64Value, value_name);
+}
+
+WriteResult Key::write_string_value(const std::string &value_name,
+                                    std::string_view value) const {
+    // Stored with the terminating null, the way the registry stores them
+    const std::string data(value);
+    int32_t res = timed(Operation::WriteStringValue, [&] {
+        return backend_->set_value(k_, "", value_name.c_str(),
+                                   ValueType::String, data.c_str(),
+                                   (uint32_t) data.size() + 1);
+    });
+    return write_result(res, Operation::WriteStringValue, value_name);
+}
+
+WriteResult Key::write_expand_string_value(const std::string &value_name,
+                                           std::string_view value) const {
+    const std::string data(value);
+    int32_t res = timed(Operation::WriteExpandStringValue, [&] {
+        return backend_->set_value(k_, "", value_name.c_str(),
+                                   ValueType::ExpandString, data.c_str(),
+                                   (uint32_t) data.size() + 1);
+    });
+    return write_result(res, Operation::WriteExpandStringValue, value_name);
+}
+
+WriteResult
+Key::write_multi_string_value(const std::string &value_name,
+                              std::span<const std::string_view> values) const {
+    // Every string is null-terminated and an empty one ends the list
+    std::string data;
+    for (std::string_view value : values) {
+        data += value;
+        data += '\0';
+    }
+    data += '\0';
+    int32_t res = timed(Operation::WriteMultiStringValue, [&] {
+        return backend_->set_value(k_, "", value_name.c_str(),
+                                   ValueType::MultiString, data.data(),
+                                   (uint32_t) data.size());
+    });
+    return write_result(res, Operation::WriteMultiStringValue, value_name);
+}
+
+WriteResult Key::write_values(std::span<const ValueWrite> writes) const {
+    int32_t res = timed(Operation::WriteValues,
+                        [&] { return backend_->set_values(k_, writes); });
+    return write_result(res, Operation::WriteValues, {});
+}
+
+WriteResult Key::delete_value(const std::string &value_name) const {
+    int32_t res = timed(Operation::DeleteValue, [&] {
+        return backend_->delete_value(k_, value_name.c_str());
+    });
+    return write_result(res, Operation::DeleteValue, value_name);
 }
 
 bool Key::valid() const {
@@ -228,7 +832,157 @@ bool Key::system() const {
 }
 
 std::string Key::path() const {
+    return join_path(path_, unopened_path_);
+}
+
+const PathNode *Key::path_node() const {
     return path_;
 }
 
+Backend &Key::backend() const {
+    return *backend_;
+}
+
+MultiStrings::Iterator::Iterator(std::string_view rest) : rest_ {rest} {
+    if (!rest_.empty() && rest_.front() == '\0') {
+        rest_ = {};
+    }
+}
+
+std::string_view MultiStrings::Iterator::operator*() const {
+    return rest_.substr(0, rest_.find('\0'));
+}
+
+MultiStrings::Iterator &MultiStrings::Iterator::operator++() {
+    const size_t end = rest_.find('\0');
+    *this = Iterator(end == std::string_view::npos ? std::string_view {}
+                                                   : rest_.substr(end + 1));
+    return *this;
+}
+
+MultiStrings::Iterator MultiStrings::Iterator::operator++(int) {
+    Iterator it = *this;
+    ++*this;
+    return it;
+}
+
+bool MultiStrings::Iterator::operator==(std::default_sentinel_t) const {
+    return rest_.empty();
+}
+
+MultiStrings::MultiStrings(std::string_view data) : data_ {data} {}
+
+MultiStrings::Iterator MultiStrings::begin() const {
+    return Iterator(data_);
+}
+
+std::default_sentinel_t MultiStrings::end() const {
+    return std::default_sentinel;
+}
+
+Subkeys::Iterator::Iterator(Subkeys *subkeys) : subkeys_ {subkeys} {}
+
+std::string_view Subkeys::Iterator::operator*() const {
+    return subkeys_->name_;
+}
+
+Subkeys::Iterator &Subkeys::Iterator::operator++() {
+    subkeys_->idx_++;
+    subkeys_->fetch();
+    return *this;
+}
+
+void Subkeys::Iterator::operator++(int) {
+    ++*this;
+}
+
+bool Subkeys::Iterator::operator==(std::default_sentinel_t) const {
+    return subkeys_ == nullptr || subkeys_->done_;
+}
+
+Subkeys::Subkeys(const Key &key) : key_ {&key}, idx_ {0}, done_ {false} {}
+
+Subkeys::Iterator Subkeys::begin() {
+    idx_ = 0;
+    done_ = false;
+    error_.reset();
+    KeyInfo info;
+    const int32_t res = key_->backend_->query_info(key_->k_, info);
+    if (res != status::Success) {
+        error_ = make_error(res, Operation::EnumSubkeyNames);
+        done_ = true;
+        return Iterator(this);
+    }
+    if (buf_.size() <= info.max_subkey_name_len) {
+        buf_.resize(info.max_subkey_name_len + 1);
+    }
+    fetch();
+    return Iterator(this);
+}
+
+std::default_sentinel_t Subkeys::end() const {
+    return std::default_sentinel;
+}
+
+const std::optional<Error> &Subkeys::error() const {
+    return error_;
+}
+
+bool Subkeys::fetch() {
+    uint32_t size;
+    const int32_t res = timed(Operation::EnumSubkeyNames, [&] {
+        return enum_subkey(*key_->backend_, key_->k_, idx_, buf_, size);
+    });
+    if (res == status::Success) {
+        name_ = std::string_view(buf_.data(), size);
+        return true;
+    }
+    if (res != status::NoMoreItems) {
+        error_ = make_error(res, Operation::EnumSubkeyNames, {}, idx_);
+    }
+    name_ = {};
+    done_ = true;
+    return false;
+}
+
+Watch::Watch(const Key &key)
+    : backend_ {key.backend_}, w_ {InvalidHandle},
+      path_ {retain_path(key.path_)}, unopened_path_ {key.unopened_path_} {
+    if (key.valid() && backend_->watch(key.k_, w_) != status::Success) {
+        w_ = InvalidHandle;
+    }
+}
+
+Watch::~Watch() {
+    if (valid()) {
+        backend_->unwatch(w_);
+    }
+    release_path(path_);
+}
+
+ReadResult<bool> Watch::wait(std::chrono::milliseconds timeout) {
+    // Backends need not check for a watch which has never been made
+    if (!valid()) {
+        return std::unexpected(make_error(status::InvalidHandle,
+                                          Operation::WaitForChange,
+                                          join_path(path_, unopened_path_)));
+    }
+    const uint32_t timeout_ms = (uint32_t) std::clamp<int64_t>(
+        timeout.count(), 0, UINT32_MAX - 1);
+    const int32_t res = backend_->wait_change(w_, timeout_ms);
+    if (res == status::Timeout) {
+        return false;
+    }
+    if (res != status::Success) {
+        // The path is joined only for the error
+        return std::unexpected(make_error(res, Operation::WaitForChange,
+                                          join_path(path_, unopened_path_)));
+    }
+    return true;
+}
+
+bool Watch::valid() const {
+    return w_ != InvalidHandle;
+}
+
 } // namespace reg
@@ -1,15 +1,68 @@
 #pragma once
 
+#include "path_tree.h"
+#include <chrono>
+#include <cstdint>
 #include <expected>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
 #include <span>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace reg {
 
+// Operation of reg::Key which can fail
+enum class Operation : uint8_t {
+    OpenKey,
+    CreateKey,
+    GetSubkeysCount,
+    QueryKeyInfo,
+    EnumSubkeyNames,
+    EnumValues,
+    ReadU32Value,
+    ReadStringValue,
+    QueryValueSize,
+    ReadU64Value,
+    ReadBinaryValue,
+    ReadExpandStringValue,
+    ReadMultiStringValue,
+    ReadValues,
+    ReadU32Values,
+    ReadStringValues,
+    WriteBinaryValue,
+    WriteU32Value,
+    WriteU64Value,
+    WriteStringValue,
+    WriteExpandStringValue,
+    WriteMultiStringValue,
+    WriteValues,
+    DeleteValue,
+    ApplyWritePlan,
+    RollBackWritePlan,
+    CommitOverlay,
+    WaitForChange,
+    ReadRecord,
+    ImportRegFile,
+    ExportRegFile,
+    _Count,
+};
+
+// Error of a reg::Key operation. It keeps only the context of the failure,
+// the description is formatted on demand.
 struct Error {
     int32_t code;
-    std::string msg;
+    Operation op;
+    // Value the operation has failed on (the key path for watches), empty if
+    // there is none or if a multiple values read has failed as a whole for
+    // another reason than a missing value
+    std::string name;
+    // Subkey index for enumeration, value index for multiple values reads
+    uint32_t index;
+
+    std::string msg() const;
 };
 
 template <class T> using ReadResult = std::expected<T, Error>;
@@ -21,13 +74,249 @@ struct WriteResult {
 
 enum class SystemKey { LocalMachine };
 
+// Status codes returned by backends. They mirror Win32 error codes, so a
+// result looks the same no matter which backend the key lives in.
+namespace status {
+inline constexpr int32_t Success = 0;
+inline constexpr int32_t FileNotFound = 2;
+inline constexpr int32_t AccessDenied = 5;
+inline constexpr int32_t InvalidHandle = 6;
+inline constexpr int32_t InvalidData = 13;
+inline constexpr int32_t WriteFault = 29;
+inline constexpr int32_t NotSupported = 50;
+inline constexpr int32_t BadDb = 1009;
+inline constexpr int32_t InvalidParameter = 87;
+inline constexpr int32_t MoreData = 234;
+inline constexpr int32_t Timeout = 258;
+inline constexpr int32_t NoMoreItems = 259;
+inline constexpr int32_t UnsupportedType = 1630;
+} // namespace status
+
+// Registry value types, numerically equal to REG_* constants
+enum class ValueType : uint32_t {
+    None = 0,
+    String = 1,
+    ExpandString = 2,
+    Binary = 3,
+    U32 = 4,
+    MultiString = 7,
+    U64 = 11,
+};
+
+// Access rights a key is opened with, numerically equal to KEY_* masks
+enum class Access : uint32_t {
+    Read = 0x20019,
+    Write = 0x20006,
+    ReadWrite = 0x2001f,
+};
+
+// Opaque key handle of a backend, 0 is never a valid one
+using Handle = uint64_t;
+
+inline constexpr Handle InvalidHandle = 0;
+
+struct KeyInfo {
+    uint32_t subkeys_count;
+    uint32_t max_subkey_name_len;
+    uint32_t values_count;
+    uint64_t last_write_time;
+};
+
+// Entry of a bulk value read. The backend fills in the type of the value and
+// where its data is placed in the output buffer.
+struct ValueEntry {
+    const char *name;
+    ValueType type;
+    uint32_t offset;
+    uint32_t size;
+};
+
+// Values read with a single backend operation, stored back to back in one
+// buffer in the order they were requested
+struct Values {
+    std::vector<uint8_t> data;
+    std::vector<ValueEntry> entries;
+};
+
+// Value read by Key::enum_value(), viewing the buffers it has been read into
+struct ValueView {
+    std::string_view name;
+    ValueType type;
+    std::span<const uint8_t> data;
+};
+
+// Value written by Backend::set_values()
+struct ValueWrite {
+    const char *name;
+    ValueType type;
+    const void *data;
+    uint32_t size;
+};
+
+// Storage behind reg::Key. Every method returns one of the status codes and
+// follows the semantics of the corresponding Winapi function, so keys behave
+// the same on the live registry and on any other implementation.
+class Backend {
+  public:
+    virtual ~Backend() = default;
+
+    // Returns the handle of a system key. It is never closed.
+    virtual Handle root(SystemKey sk) = 0;
+
+    // Opens a subkey (possibly a '\'-separated path) of an opened key
+    // (RegOpenKeyEx)
+    virtual int32_t open(Handle parent, const char *subkey_name,
+                         Access access, Handle &k) = 0;
+
+    // Opens a subkey like open(), creating it and any missing parents first
+    // (RegCreateKeyEx)
+    virtual int32_t create(Handle parent, const char *subkey_name,
+                           Access access, Handle &k) = 0;
+
+    // Closes a key opened with open() (RegCloseKey)
+    virtual void close(Handle k) = 0;
+
+    // Queries key metadata (RegQueryInfoKey)
+    virtual int32_t query_info(Handle k, KeyInfo &info) = 0;
+
+    // Copies the name of the subkey with given index into a buffer of `size`
+    // chars. On success `size` is set to the name length without the
+    // terminating null (RegEnumKeyEx).
+    virtual int32_t enum_subkey(Handle k, uint32_t idx, char *name,
+                                uint32_t &size) = 0;
+
+    // Copies the name of the value with given index into a buffer of
+    // `name_size` chars and its data into a buffer of `size` bytes. On
+    // success the sizes are set to the name length without the terminating
+    // null and to the data size. If either buffer is too small, both sizes
+    // are set to ones large enough (RegEnumValue).
+    virtual int32_t enum_value(Handle k, uint32_t idx, char *name,
+                               uint32_t &name_size, ValueType &type,
+                               void *data, uint32_t &size) = 0;
+
+    // Reads a value of a given type into a buffer of `size` bytes. If `data`
+    // is null or too small, only `size` is set to the required size
+    // (RegGetValue).
+    virtual int32_t get_value(Handle k, const char *value_name,
+                              ValueType type, void *data, uint32_t &size) = 0;
+
+    // Reads several values of any type in one operation into a single buffer
+    // of `size` bytes. If `data` is null or too small, only `size` is set to
+    // the required size (RegQueryMultipleValues).
+    virtual int32_t get_values(Handle k, std::span<ValueEntry> entries,
+                               void *data, uint32_t &size) = 0;
+
+    // Writes a value to a key or to its subkey, creating the subkey if it is
+    // missing (RegSetKeyValue)
+    virtual int32_t set_value(Handle k, const char *subkey_name,
+                              const char *value_name, ValueType type,
+                              const void *data, uint32_t size) = 0;
+
+    // Writes several values of a key in one operation, in order, stopping at
+    // the first failure. By default it is a set_value() call per value.
+    virtual int32_t set_values(Handle k, std::span<const ValueWrite> writes);
+
+    // Deletes a value of a key (RegDeleteValue)
+    virtual int32_t delete_value(Handle k, const char *value_name) = 0;
+
+    // Starts watching a key and all of its subkeys for changes of values and
+    // subkeys (RegNotifyChangeKeyValue). Every change made after this call is
+    // reported by wait_change().
+    virtual int32_t watch(Handle k, Handle &w) = 0;
+
+    // Blocks until a change has been made since the watch was started or
+    // last waited on, or until `timeout_ms` passes (status::Timeout).
+    // UINT32_MAX waits forever. A watch is waited on by one thread at a time.
+    virtual int32_t wait_change(Handle w, uint32_t timeout_ms) = 0;
+
+    // Stops a watch started with watch()
+    virtual void unwatch(Handle w) = 0;
+};
+
+// Checks whether a stored value passes the type filter of a read. Like
+// RegGetValue, a U32 or U64 read also accepts a binary value of that size and
+// ValueType::None accepts anything.
+bool value_type_matches(ValueType requested, ValueType stored, uint32_t size);
+
+// Compares key or value names the way the registry does (case-insensitively)
+bool equal_names(std::string_view a, std::string_view b);
+
+// Splits the first component off a '\'-separated key path, returns an empty
+// view when there are no components left
+std::string_view next_path_component(std::string_view &path);
+
+#ifdef _WIN32
+// Backend of the live registry
+Backend &system_backend();
+#endif
+
+class Subkeys;
+
+// Strings of a MultiString value, viewed in the buffer they have been read
+// into. They end at the first empty string or at the end of the data.
+class MultiStrings {
+  public:
+    class Iterator {
+      public:
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+
+        Iterator() = default;
+
+        std::string_view operator*() const;
+        Iterator &operator++();
+        Iterator operator++(int);
+        bool operator==(const Iterator &) const = default;
+        bool operator==(std::default_sentinel_t) const;
+
+      private:
+        friend class MultiStrings;
+
+        explicit Iterator(std::string_view rest);
+
+        std::string_view rest_;
+    };
+
+    MultiStrings() = default;
+    explicit MultiStrings(std::string_view data);
+
+    Iterator begin() const;
+    std::default_sentinel_t end() const;
+
+  private:
+    std::string_view data_;
+};
+
+// Opened key, owning its handle. All const methods, writes included, may be
+// called on one key from any number of threads at once: the key itself is
+// never changed by them and the backends serialize what they have to (all
+// of them do, except HiveBackend mapped for writing). Moving, assigning or
+// destroying a key must not overlap with other calls on it; SharedKey lets
+// several owners share one opened key.
 class Key {
   public:
-    // Creates a system key. Should not be used in client code.
+#ifdef _WIN32
+    // Creates a system key of the live registry. Should not be used in client
+    // code.
     Key(SystemKey sk);
+#endif
+
+    // Creates a system key of a given backend
+    Key(Backend &backend, SystemKey sk);
 
     // Creates and opens a new subkey of another key
-    Key(const Key &k, const std::string &subkey_name);
+    Key(const Key &k, const std::string &subkey_name,
+        Access access = Access::ReadWrite);
+
+    // Opens a subkey of another key, with the status of a failed open
+    static ReadResult<Key> open(const Key &k, const std::string &subkey_name,
+                                Access access = Access::ReadWrite);
+
+    // Opens a subkey of another key, creating it and any missing parents in
+    // the backend first
+    static ReadResult<Key> create(const Key &k,
+                                  const std::string &subkey_name,
+                                  Access access = Access::ReadWrite);
 
     // Destroys and closes the key
     ~Key();
@@ -42,11 +331,67 @@ class Key {
     Key &operator=(const Key &) = delete;
 
     ReadResult<uint32_t> get_subkeys_count() const;
+    // Counts and the last write time (a FILETIME on Windows), which changes
+    // whenever a value of the key is written or a subkey is added or removed
+    ReadResult<KeyInfo> query_info() const;
     ReadResult<std::string> enum_subkey_names(uint32_t idx) const;
-    ReadResult<uint32_t> read_u32_value(std::string value_name) const;
+    // Lazily walks the names of all subkeys
+    Subkeys subkeys() const;
+    // Reads the value with given index into buffers reused between calls,
+    // status::NoMoreItems past the last one
+    ReadResult<ValueView> enum_value(uint32_t idx, std::string &name_buf,
+                                     std::vector<uint8_t> &data_buf) const;
+    ReadResult<uint32_t> read_u32_value(const std::string &value_name) const;
     ReadResult<std::vector<uint32_t>>
     read_u32_values(std::span<const std::string> value_names) const;
-    ReadResult<std::string> read_string_value(std::string value_name) const;
+    ReadResult<std::string>
+    read_string_value(const std::string &value_name) const;
+    // The reads below allocate their results and their scratch buffers from
+    // `mr`, e.g. an arena freed once a whole scan is done with them
+    ReadResult<std::pmr::string>
+    read_string_value(const std::string &value_name,
+                      std::pmr::memory_resource *mr) const;
+    ReadResult<std::pmr::vector<uint32_t>>
+    read_u32_values(std::span<const std::string> value_names,
+                    std::pmr::memory_resource *mr) const;
+    ReadResult<std::pmr::vector<std::pmr::string>>
+    read_string_values(std::span<const std::string> value_names,
+                       std::pmr::memory_resource *mr) const;
+
+    // Size in bytes of the data of a value of a given type (any type for
+    // ValueType::None), for sizing a buffer before a read
+    ReadResult<uint32_t>
+    query_value_size(const std::string &value_name,
+                     ValueType type = ValueType::None) const;
+    ReadResult<uint64_t> read_u64_value(const std::string &value_name) const;
+    // Reads binary data into a caller's buffer and returns its size. If that
+    // is more than `data` holds, nothing is read.
+    ReadResult<uint32_t> read_binary_value(const std::string &value_name,
+                                           std::span<uint8_t> data) const;
+    // The reads below decode into a buffer reused between calls, growing it
+    // only when a value does not fit. The results view the buffer.
+    ReadResult<std::span<const uint8_t>>
+    read_binary_value(const std::string &value_name,
+                      std::vector<uint8_t> &buf) const;
+    ReadResult<std::string_view>
+    read_string_value(const std::string &value_name, std::string &buf) const;
+    // Environment variables are left unexpanded
+    ReadResult<std::string_view>
+    read_expand_string_value(const std::string &value_name,
+                             std::string &buf) const;
+    ReadResult<MultiStrings>
+    read_multi_string_value(const std::string &value_name,
+                            std::string &buf) const;
+
+    // Reads all given values in one backend operation
+    ReadResult<Values>
+    read_values(std::span<const std::string> value_names) const;
+    // Reads the values named by `entries` in one backend operation into a
+    // caller's buffer and returns the size they take. If that is more than
+    // `data` holds, nothing is read and the call is to be repeated with a
+    // larger buffer.
+    ReadResult<uint32_t> read_values(std::span<ValueEntry> entries,
+                                     std::span<uint8_t> data) const;
     ReadResult<std::vector<std::string>>
     read_string_values(std::span<const std::string> value_names) const;
 
@@ -60,18 +405,121 @@ class Key {
     WriteResult write_subkey_u32_value(const std::string &subkey_name,
                                        const std::string &value_name,
                                        uint32_t value) const;
+    WriteResult write_u64_value(const std::string &value_name,
+                                uint64_t value) const;
+    WriteResult write_string_value(const std::string &value_name,
+                                   std::string_view value) const;
+    WriteResult write_expand_string_value(const std::string &value_name,
+                                          std::string_view value) const;
+    WriteResult
+    write_multi_string_value(const std::string &value_name,
+                             std::span<const std::string_view> values) const;
+    // Writes values of any type in one backend operation, in order
+    WriteResult write_values(std::span<const ValueWrite> writes) const;
+    WriteResult delete_value(const std::string &value_name) const;
 
     bool valid() const;
     bool system() const;
+    // Joins the full path, for messages
     std::string path() const;
+    // Interned path, shared by all keys opened with the same path
+    const PathNode *path_node() const;
+    Backend &backend() const;
 
   private:
-    uint64_t k_;
+    friend class Subkeys;
+    friend class WritePlan;
+    friend class Watch;
+
+    // Sets `res` to the status of the open or create call if it is not null
+    Key(const Key &k, const std::string &subkey_name, Access access,
+        bool create, int32_t *res);
+
+    Backend *backend_;
+    Handle k_;
     bool system_;
-    std::string path_;
+    // Interned once the key is open. A key which failed to open keeps the
+    // path of its parent and the subkey path as given, for messages.
+    const PathNode *path_;
+    std::string unopened_path_;
+};
+
+// Input range over the subkey names of a key. Names are read one by one into
+// a buffer owned by the range and sized from the longest name of the key, so
+// walking a key allocates once. A yielded view is valid until the iterator is
+// advanced. Iteration stops at the first failure, see error().
+class Subkeys {
+  public:
+    class Iterator {
+      public:
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+
+        Iterator() = default;
+
+        std::string_view operator*() const;
+        Iterator &operator++();
+        void operator++(int);
+        bool operator==(std::default_sentinel_t) const;
+
+      private:
+        friend class Subkeys;
+
+        explicit Iterator(Subkeys *subkeys);
+
+        Subkeys *subkeys_ = nullptr;
+    };
+
+    explicit Subkeys(const Key &key);
+
+    // Starts the walk over, it can be done only by one iterator at a time
+    Iterator begin();
+    std::default_sentinel_t end() const;
+
+    // Failure which has ended the walk early, if any
+    const std::optional<Error> &error() const;
+
+  private:
+    // Reads the name with the current index, returns false at the end
+    bool fetch();
+
+    const Key *key_;
+    std::string buf_;
+    std::string_view name_;
+    uint32_t idx_;
+    bool done_;
+    std::optional<Error> error_;
+};
+
+// Watch over changes of a key and all of its subkeys. Changes made after the
+// watch is created are reported by wait(), so a caller which creates it first
+// and then reads the key misses none.
+class Watch {
+  public:
+    explicit Watch(const Key &key);
+
+    // Stops watching
+    ~Watch();
+
+    Watch(const Watch &) = delete;
+    Watch &operator=(const Watch &) = delete;
+
+    // Returns true when something has changed since the watch was created or
+    // last waited on, false when the timeout has passed first
+    ReadResult<bool> wait(std::chrono::milliseconds timeout);
+
+    bool valid() const;
+
+  private:
+    Backend *backend_;
+    Handle w_;
+    const PathNode *path_;
+    std::string unopened_path_;
 };
 
+#ifdef _WIN32
 // System key wrapped in global object for use in client code
 static inline const Key LocalMachine(SystemKey::LocalMachine);
+#endif
 
 } // namespace reg
@@ -0,0 +1,758 @@
+#include "regfile.h"
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <utility>
+
+namespace {
+
+using reg::Error;
+using reg::Key;
+using reg::Operation;
+using reg::ValueType;
+namespace status = reg::status;
+
+constexpr std::string_view HeaderV5 = "Windows Registry Editor Version 5.00";
+constexpr std::string_view HeaderV4 = "REGEDIT4";
+constexpr std::string_view LineEnd = "\r\n";
+// Size of the buffers text is written and read through
+constexpr size_t BufferSize = 32 * 1024;
+// Hex data is wrapped past this column, like regedit does
+constexpr size_t HexWrapColumn = 76;
+// Limits of a batch of values written with one backend call on import
+constexpr size_t BatchValues = 256;
+constexpr size_t BatchBytes = 256 * 1024;
+
+constexpr uint32_t ReplacementChar = 0xfffd;
+
+// Decodes the next code point of UTF-8 text, malformed bytes decode to
+// ReplacementChar one at a time
+uint32_t next_code_point(std::span<const uint8_t> &text) {
+    const uint8_t lead = text[0];
+    const size_t len = lead < 0x80   ? 1
+                       : lead < 0xc2 ? 0
+                       : lead < 0xe0 ? 2
+                       : lead < 0xf0 ? 3
+                       : lead < 0xf5 ? 4
+                                     : 0;
+    if (len == 0 || len > text.size()) {
+        text = text.subspan(1);
+        return len == 1 ? lead : ReplacementChar;
+    }
+    uint32_t cp = len == 1 ? lead : lead & (0x7f >> len);
+    for (size_t i = 1; i < len; i++) {
+        if ((text[i] & 0xc0) != 0x80) {
+            text = text.subspan(1);
+            return ReplacementChar;
+        }
+        cp = (cp << 6) | (text[i] & 0x3f);
+    }
+    text = text.subspan(len);
+    return cp;
+}
+
+template <typename Out> void put_utf8(Out &out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back((char) cp);
+    } else if (cp < 0x800) {
+        out.push_back((char) (0xc0 | (cp >> 6)));
+        out.push_back((char) (0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        out.push_back((char) (0xe0 | (cp >> 12)));
+        out.push_back((char) (0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back((char) (0x80 | (cp & 0x3f)));
+    } else {
+        out.push_back((char) (0xf0 | (cp >> 18)));
+        out.push_back((char) (0x80 | ((cp >> 12) & 0x3f)));
+        out.push_back((char) (0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back((char) (0x80 | (cp & 0x3f)));
+    }
+}
+
+// Decodes UTF-16LE code units which may arrive in pieces. A high surrogate
+// is kept until the unit after it comes.
+class Utf16Decoder {
+  public:
+    template <typename Out> void put(uint16_t unit, Out &out) {
+        if (high_ != 0) {
+            if (unit >= 0xdc00 && unit < 0xe000) {
+                put_utf8(out, 0x10000 + ((high_ - 0xd800) << 10) +
+                                  (unit - 0xdc00));
+                high_ = 0;
+                return;
+            }
+            put_utf8(out, ReplacementChar);
+            high_ = 0;
+        }
+        if (unit >= 0xd800 && unit < 0xdc00) {
+            high_ = unit;
+        } else if (unit >= 0xdc00 && unit < 0xe000) {
+            put_utf8(out, ReplacementChar);
+        } else {
+            put_utf8(out, unit);
+        }
+    }
+
+    template <typename Out> void finish(Out &out) {
+        if (high_ != 0) {
+            put_utf8(out, ReplacementChar);
+            high_ = 0;
+        }
+    }
+
+  private:
+    uint32_t high_ = 0;
+};
+
+bool is_text(ValueType type) {
+    return type == ValueType::String || type == ValueType::ExpandString ||
+           type == ValueType::MultiString;
+}
+
+// Output through a fixed buffer, flushed to the stream whenever it fills up
+class TextWriter {
+  public:
+    explicit TextWriter(std::ostream &out) : out_ {out}, size_ {0} {}
+
+    void put(std::string_view s) {
+        while (!s.empty()) {
+            const size_t n = std::min(s.size(), buf_.size() - size_);
+            std::memcpy(buf_.data() + size_, s.data(), n);
+            size_ += n;
+            s.remove_prefix(n);
+            if (size_ == buf_.size()) {
+                flush();
+            }
+        }
+    }
+
+    void put(char c) {
+        put(std::string_view(&c, 1));
+    }
+
+    // Returns false if the stream has failed
+    bool flush() {
+        out_.write(buf_.data(), (std::streamsize) size_);
+        size_ = 0;
+        return out_.good();
+    }
+
+  private:
+    std::ostream &out_;
+    std::array<char, BufferSize> buf_;
+    size_t size_;
+};
+
+// Writes a quoted name or string, escaping quotes and backslashes
+void put_quoted(TextWriter &w, std::string_view s) {
+    w.put('"');
+    for (;;) {
+        const size_t special = s.find_first_of("\"\\");
+        w.put(s.substr(0, special));
+        if (special == std::string_view::npos) {
+            break;
+        }
+        w.put('\\');
+        w.put(s[special]);
+        s.remove_prefix(special + 1);
+    }
+    w.put('"');
+}
+
+// Comma-separated hex bytes, wrapped over lines ending with a backslash
+class HexWriter {
+  public:
+    HexWriter(TextWriter &w, size_t column)
+        : w_ {w}, column_ {column}, first_ {true} {}
+
+    void put(uint8_t b) {
+        static constexpr char Digits[] = "0123456789abcdef";
+        if (!first_) {
+            w_.put(',');
+            column_++;
+            if (column_ >= HexWrapColumn) {
+                w_.put("\\\r\n  ");
+                column_ = 2;
+            }
+        }
+        const char hex[2] = {Digits[b >> 4], Digits[b & 0xf]};
+        w_.put(std::string_view(hex, 2));
+        column_ += 2;
+        first_ = false;
+    }
+
+  private:
+    TextWriter &w_;
+    size_t column_;
+    bool first_;
+};
+
+// Whether a string value can be written as a quoted string: one line of text
+// with the terminating null as its only null
+bool quotable(std::span<const uint8_t> data) {
+    if (data.empty() || data.back() != 0) {
+        return false;
+    }
+    return std::ranges::none_of(data.first(data.size() - 1), [](uint8_t b) {
+        return b == 0 || b == '\r' || b == '\n';
+    });
+}
+
+void put_value(TextWriter &w, const reg::ValueView &v) {
+    size_t column = 0;
+    if (v.name.empty()) {
+        w.put('@');
+        column = 1;
+    } else {
+        put_quoted(w, v.name);
+        column = v.name.size() + 2;
+    }
+    w.put('=');
+    column++;
+
+    if (v.type == ValueType::String && quotable(v.data)) {
+        put_quoted(w, std::string_view((const char *) v.data.data(),
+                                       v.data.size() - 1));
+        w.put(LineEnd);
+        return;
+    }
+    if (v.type == ValueType::U32 && v.data.size() == sizeof(uint32_t)) {
+        uint32_t value;
+        std::memcpy(&value, v.data.data(), sizeof(value));
+        char digits[8];
+        const auto [end, err] =
+            std::to_chars(digits, digits + sizeof(digits), value, 16);
+        w.put("dword:");
+        w.put(std::string_view("00000000", 8 - (size_t) (end - digits)));
+        w.put(std::string_view(digits, end));
+        w.put(LineEnd);
+        return;
+    }
+
+    if (v.type == ValueType::Binary) {
+        w.put("hex:");
+        column += 4;
+    } else {
+        char digits[8];
+        const auto [end, err] = std::to_chars(
+            digits, digits + sizeof(digits), std::to_underlying(v.type), 16);
+        w.put("hex(");
+        w.put(std::string_view(digits, end));
+        w.put("):");
+        column += 6 + (size_t) (end - digits);
+    }
+    HexWriter hex(w, column);
+    if (is_text(v.type)) {
+        // Text in hex form is UTF-16LE, as in files of regedit
+        std::span<const uint8_t> text = v.data;
+        while (!text.empty()) {
+            uint32_t cp = next_code_point(text);
+            if (cp >= 0x10000) {
+                cp -= 0x10000;
+                const uint16_t high = (uint16_t) (0xd800 + (cp >> 10));
+                hex.put((uint8_t) high);
+                hex.put((uint8_t) (high >> 8));
+                cp = 0xdc00 + (cp & 0x3ff);
+            }
+            hex.put((uint8_t) cp);
+            hex.put((uint8_t) (cp >> 8));
+        }
+    } else {
+        for (uint8_t b : v.data) {
+            hex.put(b);
+        }
+    }
+    w.put(LineEnd);
+}
+
+Error export_error(int32_t code, const std::string &name) {
+    return Error {
+        .code = code,
+        .op = Operation::ExportRegFile,
+        .name = name,
+        .index = 0,
+    };
+}
+
+// State of an export, reused by every key
+struct Exporter {
+    TextWriter &w;
+    // Path of the current key, extended and cut back while walking
+    std::string path;
+    std::string name_buf;
+    std::vector<uint8_t> data_buf;
+    std::string subkey_name;
+    reg::ExportStats stats;
+};
+
+std::optional<Error> export_key(Exporter &ex, const Key &key) {
+    ex.w.put('[');
+    ex.w.put(ex.path);
+    ex.w.put(']');
+    ex.w.put(LineEnd);
+    for (uint32_t idx = 0;; idx++) {
+        const auto value_res = key.enum_value(idx, ex.name_buf, ex.data_buf);
+        if (!value_res.has_value()) {
+            if (value_res.error().code == status::NoMoreItems) {
+                break;
+            }
+            return export_error(value_res.error().code, ex.path);
+        }
+        put_value(ex.w, value_res.value());
+        ex.stats.values++;
+    }
+    ex.w.put(LineEnd);
+    ex.stats.keys++;
+
+    reg::Subkeys subkeys = key.subkeys();
+    for (std::string_view name : subkeys) {
+        ex.subkey_name = name;
+        const size_t path_size = ex.path.size();
+        ex.path += '\\';
+        ex.path += name;
+        const Key subkey(key, ex.subkey_name, reg::Access::Read);
+        if (!subkey.valid()) {
+            return export_error(status::FileNotFound, ex.path);
+        }
+        if (auto err = export_key(ex, subkey)) {
+            return err;
+        }
+        ex.path.resize(path_size);
+    }
+    if (subkeys.error().has_value()) {
+        return export_error(subkeys.error()->code, ex.path);
+    }
+    return std::nullopt;
+}
+
+// Reads lines from a stream in fixed chunks. UTF-16LE input (recognized by
+// its byte order mark) is decoded to UTF-8 on the fly.
+class LineReader {
+  public:
+    explicit LineReader(std::istream &in)
+        : in_ {in}, pos_ {0}, started_ {false}, utf16_ {false},
+          odd_byte_ {} {}
+
+    // Reads the next line without its end, returns false past the last one
+    bool next(std::string &line) {
+        for (;;) {
+            const size_t nl = text_.find('\n', pos_);
+            if (nl != std::string::npos) {
+                line.assign(text_, pos_, nl - pos_);
+                pos_ = nl + 1;
+                break;
+            }
+            text_.erase(0, pos_);
+            pos_ = 0;
+            if (!fill()) {
+                if (text_.empty()) {
+                    return false;
+                }
+                line.swap(text_);
+                text_.clear();
+                break;
+            }
+        }
+        if (line.ends_with('\r')) {
+            line.pop_back();
+        }
+        return true;
+    }
+
+    bool failed() const {
+        return in_.bad();
+    }
+
+  private:
+    bool fill() {
+        in_.read(raw_.data(), (std::streamsize) raw_.size());
+        std::string_view raw(raw_.data(), (size_t) in_.gcount());
+        if (raw.empty()) {
+            decoder_.finish(text_);
+            return false;
+        }
+        if (!started_) {
+            started_ = true;
+            if (raw.starts_with("\xef\xbb\xbf")) {
+                raw.remove_prefix(3);
+            } else if (raw.starts_with("\xff\xfe")) {
+                raw.remove_prefix(2);
+                utf16_ = true;
+            }
+        }
+        if (!utf16_) {
+            text_ += raw;
+            return true;
+        }
+        for (char c : raw) {
+            if (!odd_byte_.has_value()) {
+                odd_byte_ = (uint8_t) c;
+                continue;
+            }
+            decoder_.put((uint16_t) (*odd_byte_ | ((uint8_t) c << 8)), text_);
+            odd_byte_.reset();
+        }
+        return true;
+    }
+
+    std::istream &in_;
+    std::array<char, BufferSize> raw_;
+    // Decoded text, lines before `pos_` have been returned
+    std::string text_;
+    size_t pos_;
+    bool started_;
+    bool utf16_;
+    std::optional<uint8_t> odd_byte_;
+    Utf16Decoder decoder_;
+};
+
+std::string_view trim(std::string_view s) {
+    const size_t start = s.find_first_not_of(" \t");
+    if (start == std::string_view::npos) {
+        return {};
+    }
+    return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
+bool hex_digit(char c, uint8_t &value) {
+    if (c >= '0' && c <= '9') {
+        value = (uint8_t) (c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+        value = (uint8_t) (c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+        value = (uint8_t) (c - 'A' + 10);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parses a quoted name or string at the start of `s` and removes it from `s`
+bool parse_quoted(std::string_view &s, std::string &out) {
+    if (!s.starts_with('"')) {
+        return false;
+    }
+    out.clear();
+    for (size_t i = 1; i < s.size(); i++) {
+        if (s[i] == '"') {
+            s.remove_prefix(i + 1);
+            return true;
+        }
+        if (s[i] == '\\' && i + 1 < s.size()) {
+            i++;
+        }
+        out += s[i];
+    }
+    return false;
+}
+
+class Importer {
+  public:
+    explicit Importer(const Key &root)
+        : root_ {root}, root_path_ {root.path()}, unicode_ {false},
+          line_no_ {0}, continued_ {false} {}
+
+    reg::WriteResult run(std::istream &in) {
+        LineReader reader(in);
+        std::string line;
+        bool header = false;
+        int32_t res = status::Success;
+        while (res == status::Success && reader.next(line)) {
+            line_no_++;
+            const std::string_view text = trim(line);
+            if (!header) {
+                if (text.empty()) {
+                    continue;
+                }
+                unicode_ = text == HeaderV5;
+                header = unicode_ || text == HeaderV4;
+                res = header ? status::Success : status::InvalidData;
+            } else if (continued_) {
+                res = parse_hex(text);
+            } else if (text.empty() || text.starts_with(';')) {
+                continue;
+            } else if (text.starts_with('[')) {
+                res = open_key(text);
+            } else {
+                res = parse_value(text);
+            }
+        }
+        if (res == status::Success && reader.failed()) {
+            res = status::InvalidData;
+            error_name_.clear();
+        }
+        if (res == status::Success && !header) {
+            res = status::InvalidData;
+        }
+        if (res == status::Success && continued_) {
+            res = finish_value(true);
+        }
+        if (res == status::Success) {
+            res = flush();
+        }
+        if (res != status::Success) {
+            return {
+                .fail = true,
+                .error =
+                    Error {
+                        .code = res,
+                        .op = Operation::ImportRegFile,
+                        .name = error_name_,
+                        .index = (uint32_t) line_no_,
+                    },
+            };
+        }
+        return {
+            .fail = false,
+            .error = {},
+        };
+    }
+
+  private:
+    // Value of the current batch, its name and data are kept in the arenas
+    struct Pending {
+        size_t name_offset;
+        ValueType type;
+        size_t data_offset;
+    };
+
+    int32_t open_key(std::string_view text) {
+        const int32_t res = flush();
+        if (res != status::Success) {
+            return res;
+        }
+        key_.reset();
+        if (!text.ends_with(']')) {
+            return status::InvalidData;
+        }
+        std::string_view path = text.substr(1, text.size() - 2);
+        error_name_ = path;
+        if (path.starts_with('-')) {
+            return status::NotSupported;
+        }
+        if (path.size() < root_path_.size() ||
+            !reg::equal_names(path.substr(0, root_path_.size()),
+                              root_path_) ||
+            (path.size() > root_path_.size() &&
+             path[root_path_.size()] != '\\')) {
+            return status::FileNotFound;
+        }
+        path.remove_prefix(root_path_.size());
+        auto key_res = Key::create(root_, std::string(path));
+        if (!key_res.has_value()) {
+            return key_res.error().code;
+        }
+        key_.emplace(std::move(key_res.value()));
+        error_name_.clear();
+        return status::Success;
+    }
+
+    int32_t parse_value(std::string_view text) {
+        std::string &name = name_scratch_;
+        if (text.starts_with('@')) {
+            name.clear();
+            text.remove_prefix(1);
+        } else if (!parse_quoted(text, name)) {
+            return status::InvalidData;
+        }
+        error_name_ = name;
+        if (!key_.has_value()) {
+            return status::InvalidData;
+        }
+        text = trim(text);
+        if (!text.starts_with('=')) {
+            return status::InvalidData;
+        }
+        text = trim(text.substr(1));
+
+        if (text == "-") {
+            // Deletes go in order with the writes before them
+            int32_t res = flush();
+            if (res == status::Success) {
+                res = key_->delete_value(name).error.code;
+            }
+            return res == status::FileNotFound ? status::Success : res;
+        }
+
+        const size_t data_offset = data_.size();
+        pending_.push_back(Pending {
+            .name_offset = names_.size(),
+            .type = ValueType::String,
+            .data_offset = data_offset,
+        });
+        names_ += name;
+        names_ += '\0';
+        if (text.starts_with('"')) {
+            std::string &value = value_scratch_;
+            if (!parse_quoted(text, value) || !trim(text).empty()) {
+                return status::InvalidData;
+            }
+            data_.insert(data_.end(), value.begin(), value.end());
+            data_.push_back(0);
+            return finish_value(false);
+        }
+        if (text.starts_with("dword:")) {
+            text.remove_prefix(6);
+            uint32_t value;
+            const auto [end, err] = std::from_chars(
+                text.data(), text.data() + text.size(), value, 16);
+            if (err != std::errc {} || end != text.data() + text.size() ||
+                text.size() > 8) {
+                return status::InvalidData;
+            }
+            pending_.back().type = ValueType::U32;
+            const uint8_t *bytes = (const uint8_t *) &value;
+            data_.insert(data_.end(), bytes, bytes + sizeof(value));
+            return finish_value(false);
+        }
+        if (text.starts_with("hex:")) {
+            pending_.back().type = ValueType::Binary;
+            text.remove_prefix(4);
+        } else if (text.starts_with("hex(")) {
+            const size_t close = text.find("):");
+            if (close == std::string_view::npos) {
+                return status::InvalidData;
+            }
+            uint32_t type;
+            const auto [end, err] =
+                std::from_chars(text.data() + 4, text.data() + close, type, 16);
+            if (err != std::errc {} || end != text.data() + close) {
+                return status::InvalidData;
+            }
+            pending_.back().type = (ValueType) type;
+            text.remove_prefix(close + 2);
+        } else {
+            return status::InvalidData;
+        }
+        return parse_hex(text);
+    }
+
+    // Parses comma-separated bytes of the current value. A trailing
+    // backslash continues them on the next line.
+    int32_t parse_hex(std::string_view text) {
+        continued_ = text.ends_with('\\');
+        if (continued_) {
+            text.remove_suffix(1);
+        }
+        while (!(text = trim(text)).empty()) {
+            uint8_t high;
+            uint8_t low;
+            if (text.size() < 2 || !hex_digit(text[0], high) ||
+                !hex_digit(text[1], low)) {
+                return status::InvalidData;
+            }
+            data_.push_back((uint8_t) (high << 4 | low));
+            text = trim(text.substr(2));
+            if (text.starts_with(',')) {
+                text.remove_prefix(1);
+            } else if (!text.empty()) {
+                return status::InvalidData;
+            }
+        }
+        return continued_ ? status::Success : finish_value(true);
+    }
+
+    int32_t finish_value(bool hex) {
+        continued_ = false;
+        const Pending &p = pending_.back();
+        if (hex && unicode_ && is_text(p.type)) {
+            // Text in hex form is UTF-16LE in version 5 files
+            std::string &text = value_scratch_;
+            text.clear();
+            Utf16Decoder decoder;
+            for (size_t i = p.data_offset; i + 1 < data_.size(); i += 2) {
+                decoder.put((uint16_t) (data_[i] | data_[i + 1] << 8), text);
+            }
+            decoder.finish(text);
+            data_.resize(p.data_offset);
+            data_.insert(data_.end(), text.begin(), text.end());
+        }
+        if (pending_.size() >= BatchValues || data_.size() >= BatchBytes) {
+            return flush();
+        }
+        return status::Success;
+    }
+
+    // Writes the batch of the current key with one backend call
+    int32_t flush() {
+        if (pending_.empty()) {
+            return status::Success;
+        }
+        writes_.clear();
+        for (size_t i = 0; i < pending_.size(); i++) {
+            const Pending &p = pending_[i];
+            const size_t end =
+                i + 1 < pending_.size() ? pending_[i + 1].data_offset
+                                        : data_.size();
+            writes_.push_back(reg::ValueWrite {
+                .name = names_.c_str() + p.name_offset,
+                .type = p.type,
+                .data = data_.data() + p.data_offset,
+                .size = (uint32_t) (end - p.data_offset),
+            });
+        }
+        const reg::WriteResult write_res = key_->write_values(writes_);
+        pending_.clear();
+        names_.clear();
+        data_.clear();
+        if (write_res.fail) {
+            error_name_ = key_->path();
+            return write_res.error.code;
+        }
+        return status::Success;
+    }
+
+    const Key &root_;
+    std::string root_path_;
+    bool unicode_;
+    uint64_t line_no_;
+    std::optional<Key> key_;
+    // Whether the hex data of the last value goes on on the next line
+    bool continued_;
+    std::vector<Pending> pending_;
+    // Null-separated value names of the batch
+    std::string names_;
+    std::vector<uint8_t> data_;
+    std::vector<reg::ValueWrite> writes_;
+    std::string name_scratch_;
+    std::string value_scratch_;
+    // Name of the key or value the import has failed on
+    std::string error_name_;
+};
+
+} // namespace
+
+namespace reg {
+
+ReadResult<ExportStats> export_reg(const Key &key, std::ostream &out) {
+    TextWriter w(out);
+    Exporter ex {
+        .w = w,
+        .path = key.path(),
+        .name_buf = {},
+        .data_buf = {},
+        .subkey_name = {},
+        .stats = {},
+    };
+    w.put(HeaderV5);
+    w.put(LineEnd);
+    w.put(LineEnd);
+    if (auto err = export_key(ex, key)) {
+        return std::unexpected(std::move(*err));
+    }
+    if (!w.flush()) {
+        return std::unexpected(export_error(status::WriteFault, {}));
+    }
+    return ex.stats;
+}
+
+WriteResult import_reg(const Key &root, std::istream &in) {
+    Importer importer(root);
+    return importer.run(in);
+}
+
+} // namespace reg
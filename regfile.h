@@ -0,0 +1,30 @@
+#pragma once
+
+#include "reg.h"
+#include <iosfwd>
+
+// Streaming reader and writer of the .reg text format of regedit. Both work
+// in memory which does not grow with the size of the file or of the tree:
+// export walks keys one at a time and writes through a fixed buffer, import
+// reads the file in fixed chunks and writes values in bounded batches.
+namespace reg {
+
+struct ExportStats {
+    uint64_t keys;
+    uint64_t values;
+};
+
+// Writes a key with all of its subkeys and values as a .reg file
+// ("Windows Registry Editor Version 5.00", UTF-8 text with CRLF line ends).
+// Strings are expected in UTF-8, like HiveBackend returns them.
+ReadResult<ExportStats> export_reg(const Key &key, std::ostream &out);
+
+// Applies a .reg file to the keys below `root`, whose path has to start every
+// key path of the file. Files of both versions are read, in UTF-8 or in
+// UTF-16LE with a byte order mark. Missing keys are created, the values of a
+// key are sent to the backend in batches, and "name"=- lines delete values.
+// Deleting whole keys ([-path]) is not supported. Writes made before a
+// failure stay in place; the error index is the line number.
+WriteResult import_reg(const Key &root, std::istream &in);
+
+} // namespace reg
@@ -0,0 +1,96 @@
+#include "search.h"
+#include "pool.h"
+#include "shared_key.h"
+#include <atomic>
+#include <mutex>
+#include <optional>
+
+namespace {
+
+using reg::Key;
+
+class Searcher {
+  public:
+    Searcher(const reg::SearchFilter &filter, size_t jobs,
+             const std::function<void(const Key &)> &on_match)
+        : filter_ {filter}, on_match_ {on_match}, pool_ {jobs},
+          keys_opened_ {0}, keys_pruned_ {0}, matches_ {0}, errors_ {0} {}
+
+    // Opens and checks the subkeys of a key, then queues the walks of the
+    // ones which are not deep enough yet. Returns the error which has ended
+    // the enumeration early, if any.
+    std::optional<reg::Error> walk(const Key &key, uint32_t depth) {
+        const uint32_t child_depth = depth + 1;
+        reg::Subkeys subkeys(key);
+        for (const std::string_view name : subkeys) {
+            if (filter_.key_name && !filter_.key_name(name, child_depth)) {
+                keys_pruned_++;
+                continue;
+            }
+            Key child(key, std::string(name), reg::Access::Read);
+            if (!child.valid()) {
+                errors_++;
+                continue;
+            }
+            keys_opened_++;
+            if (!filter_.key || filter_.key(child)) {
+                matches_++;
+                std::lock_guard lock(match_mutex_);
+                on_match_(child);
+            }
+            if (child_depth < filter_.max_depth) {
+                // The task has to be copyable, so the key is shared with it
+                reg::SharedKey shared(std::move(child));
+                pool_.submit([this, shared, child_depth] {
+                    if (walk(*shared, child_depth).has_value()) {
+                        errors_++;
+                    }
+                });
+            }
+        }
+        return subkeys.error();
+    }
+
+    reg::SearchStats finish() {
+        pool_.wait();
+        return reg::SearchStats {
+            .keys_opened = keys_opened_.load(),
+            .keys_pruned = keys_pruned_.load(),
+            .matches = matches_.load(),
+            .errors = errors_.load(),
+        };
+    }
+
+  private:
+    const reg::SearchFilter &filter_;
+    const std::function<void(const Key &)> &on_match_;
+    std::mutex match_mutex_;
+    reg::ThreadPool pool_;
+    std::atomic<uint64_t> keys_opened_;
+    std::atomic<uint64_t> keys_pruned_;
+    std::atomic<uint64_t> matches_;
+    std::atomic<uint64_t> errors_;
+};
+
+} // namespace
+
+namespace reg {
+
+ReadResult<SearchStats>
+search(const Key &root, const SearchFilter &filter, size_t jobs,
+       const std::function<void(const Key &key)> &on_match) {
+    Searcher searcher(filter, jobs, on_match);
+    if (filter.max_depth == 0) {
+        return searcher.finish();
+    }
+    // The subkeys of the root are enumerated here and their walks spread
+    // over the workers; they steal from each other from then on
+    const std::optional<Error> err = searcher.walk(root, 0);
+    const SearchStats stats = searcher.finish();
+    if (err.has_value()) {
+        return std::unexpected(*err);
+    }
+    return stats;
+}
+
+} // namespace reg
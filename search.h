@@ -0,0 +1,44 @@
+#pragma once
+
+#include "reg.h"
+#include <functional>
+#include <string_view>
+
+// Parallel walk over a key tree which checks filters on the way down, so
+// branches they reject are never opened.
+namespace reg {
+
+// Filters of a search. Both predicates are optional (empty accepts
+// everything) and are called concurrently from the walking threads.
+struct SearchFilter {
+    // Whether to open a subkey, from its name and depth (1 for the subkeys
+    // of the root). A rejected subkey is skipped together with everything
+    // below it, without a single backend call.
+    std::function<bool(std::string_view name, uint32_t depth)> key_name;
+    // Whether an opened key is a match, usually by reading some of its
+    // values. Keys it rejects are still descended into.
+    std::function<bool(const Key &key)> key;
+    // Depth of the deepest keys opened
+    uint32_t max_depth;
+};
+
+struct SearchStats {
+    uint64_t keys_opened;
+    // Subkeys rejected by the name filter
+    uint64_t keys_pruned;
+    uint64_t matches;
+    // Subkeys which could not be opened or enumerated, they are skipped
+    uint64_t errors;
+};
+
+// Walks the subkeys of `root` (not the root itself) on `jobs` threads and
+// calls `on_match` with every key accepted by the filter as soon as it is
+// found. Each key is walked by one task which queues the walks of its
+// subkeys, and idle threads steal them. Calls of `on_match` never overlap,
+// but come in no particular order; the key is closed after the call.
+// Fails only if the subkeys of the root cannot be enumerated.
+ReadResult<SearchStats>
+search(const Key &root, const SearchFilter &filter, size_t jobs,
+       const std::function<void(const Key &key)> &on_match);
+
+} // namespace reg
@@ -0,0 +1,68 @@
+#include "shared_key.h"
+#include <utility>
+
+namespace reg {
+
+SharedKey::SharedKey(Key &&key)
+    : block_ {new Block {.refs = 1, .key = std::move(key)}} {}
+
+SharedKey::~SharedKey() {
+    release();
+}
+
+SharedKey::SharedKey(const SharedKey &other) : block_ {other.block_} {
+    if (block_ != nullptr) {
+        // A new reference is made from an existing one, so nothing has to
+        // be ordered with it
+        block_->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+SharedKey::SharedKey(SharedKey &&other)
+    : block_ {std::exchange(other.block_, nullptr)} {}
+
+SharedKey &SharedKey::operator=(const SharedKey &other) {
+    if (block_ != other.block_) {
+        SharedKey copy(other);
+        release();
+        block_ = std::exchange(copy.block_, nullptr);
+    }
+    return *this;
+}
+
+SharedKey &SharedKey::operator=(SharedKey &&other) {
+    if (this != &other) {
+        release();
+        block_ = std::exchange(other.block_, nullptr);
+    }
+    return *this;
+}
+
+const Key &SharedKey::operator*() const {
+    return block_->key;
+}
+
+const Key *SharedKey::operator->() const {
+    return &block_->key;
+}
+
+SharedKey::operator bool() const {
+    return block_ != nullptr;
+}
+
+uint32_t SharedKey::use_count() const {
+    return block_ != nullptr ? block_->refs.load(std::memory_order_relaxed)
+                             : 0;
+}
+
+void SharedKey::release() {
+    // Release, so that every use of the key by this owner happens before
+    // the deletion; acquire for the owner which deletes it
+    if (block_ != nullptr &&
+        block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete block_;
+    }
+    block_ = nullptr;
+}
+
+} // namespace reg
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "reg.h"
+#include <atomic>
+
+namespace reg {
+
+// Copyable handle of an opened key, for keys used by several threads or
+// tasks at once (e.g. a parent key whose subkeys are read on a pool). The
+// key is closed when the last handle goes away. Copies only touch an atomic
+// reference count, they neither reopen the key nor take a lock; the handle
+// is one pointer and the count lives next to the key in one allocation.
+//
+// Copying, assigning and destroying different handles of the same key may
+// happen concurrently. The key itself is only reachable as const, so any
+// number of threads can read from it at once (see the guarantees of Key).
+class SharedKey {
+  public:
+    SharedKey() = default;
+    // Takes over an opened key
+    explicit SharedKey(Key &&key);
+
+    ~SharedKey();
+
+    SharedKey(const SharedKey &other);
+    SharedKey(SharedKey &&other);
+    SharedKey &operator=(const SharedKey &other);
+    SharedKey &operator=(SharedKey &&other);
+
+    const Key &operator*() const;
+    const Key *operator->() const;
+    explicit operator bool() const;
+
+    // Number of handles sharing the key, for diagnostics only: it may have
+    // changed by the time it is returned
+    uint32_t use_count() const;
+
+  private:
+    struct Block {
+        std::atomic<uint32_t> refs;
+        const Key key;
+    };
+
+    void release();
+
+    Block *block_ = nullptr;
+};
+
+} // namespace reg
@@ -0,0 +1,419 @@
+#include "snapshot.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <ranges>
+
+namespace {
+
+uint32_t handle_to_node(reg::Handle k) {
+    return (uint32_t) (k - 1);
+}
+
+reg::Handle node_to_handle(uint32_t node) {
+    return (reg::Handle) node + 1;
+}
+
+// Orders names the way equal_names() compares them
+bool less_names(std::string_view a, std::string_view b) {
+    return std::ranges::lexicographical_compare(a, b, [](char x, char y) {
+        return std::tolower((unsigned char) x) <
+               std::tolower((unsigned char) y);
+    });
+}
+
+} // namespace
+
+namespace reg {
+
+ReadResult<Snapshot> Snapshot::load(const Key &key) {
+    Snapshot snapshot;
+    snapshot.nodes_.push_back(Node {
+        .name_offset = 0,
+        .name_size = 0,
+        .first_subkey = 0,
+        .subkeys_count = 0,
+        .first_value = 0,
+        .values_count = 0,
+        .max_subkey_name_len = 0,
+        .last_write_time = 0,
+    });
+    snapshot.sorted_subkeys_.push_back(NoIndex);
+
+    // The path from the system key down to `key`, one node per component
+    std::vector<std::string_view> path;
+    for (const PathNode *p = key.path_node(); p->parent != nullptr;
+         p = p->parent) {
+        path.push_back(p->name);
+    }
+    uint32_t node = 0;
+    for (std::string_view component : path | std::views::reverse) {
+        const uint32_t child = (uint32_t) snapshot.nodes_.size();
+        snapshot.nodes_[node].first_subkey = child;
+        snapshot.nodes_[node].subkeys_count = 1;
+        snapshot.nodes_[node].max_subkey_name_len = (uint32_t) component.size();
+        snapshot.nodes_.push_back(Node {
+            .name_offset = snapshot.add_name(component),
+            .name_size = (uint32_t) component.size(),
+            .first_subkey = 0,
+            .subkeys_count = 0,
+            .first_value = 0,
+            .values_count = 0,
+            .max_subkey_name_len = 0,
+            .last_write_time = 0,
+        });
+        snapshot.sorted_subkeys_.push_back(child);
+        node = child;
+    }
+
+    std::string name_buf;
+    std::vector<uint8_t> data_buf;
+    const auto copy_res = snapshot.copy_key(key, node, name_buf, data_buf);
+    if (!copy_res.has_value()) {
+        return std::unexpected(copy_res.error());
+    }
+    snapshot.nodes_.shrink_to_fit();
+    snapshot.values_.shrink_to_fit();
+    snapshot.sorted_subkeys_.shrink_to_fit();
+    snapshot.sorted_values_.shrink_to_fit();
+    snapshot.names_.shrink_to_fit();
+    snapshot.data_.shrink_to_fit();
+    return snapshot;
+}
+
+size_t Snapshot::keys_count() const {
+    return nodes_.size();
+}
+
+size_t Snapshot::values_count() const {
+    return values_.size();
+}
+
+size_t Snapshot::memory_size() const {
+    return nodes_.size() * (sizeof(Node) + sizeof(uint32_t)) +
+           values_.size() * (sizeof(Value) + sizeof(uint32_t)) +
+           names_.size() + data_.size();
+}
+
+Handle Snapshot::root(SystemKey sk) {
+    (void) sk; // only one system key for now
+    return node_to_handle(0);
+}
+
+int32_t Snapshot::open(Handle parent, const char *subkey_name, Access access,
+                       Handle &k) {
+    (void) access; // read-only whatever the access, writes fail
+    if (!valid_node(parent)) {
+        return status::InvalidHandle;
+    }
+    uint32_t node = handle_to_node(parent);
+    std::string_view path = subkey_name;
+    for (;;) {
+        const std::string_view name = next_path_component(path);
+        if (name.empty()) {
+            break;
+        }
+        node = find_subkey(node, name);
+        if (node == NoIndex) {
+            return status::FileNotFound;
+        }
+    }
+    k = node_to_handle(node);
+    return status::Success;
+}
+
+int32_t Snapshot::create(Handle parent, const char *subkey_name,
+                         Access access, Handle &k) {
+    const int32_t res = open(parent, subkey_name, access, k);
+    return res == status::FileNotFound ? status::AccessDenied : res;
+}
+
+void Snapshot::close(Handle k) {
+    (void) k;
+}
+
+int32_t Snapshot::query_info(Handle k, KeyInfo &info) {
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const Node &n = nodes_[handle_to_node(k)];
+    info = {
+        .subkeys_count = n.subkeys_count,
+        .max_subkey_name_len = n.max_subkey_name_len,
+        .values_count = n.values_count,
+        .last_write_time = n.last_write_time,
+    };
+    return status::Success;
+}
+
+int32_t Snapshot::enum_subkey(Handle k, uint32_t idx, char *name,
+                              uint32_t &size) {
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const Node &n = nodes_[handle_to_node(k)];
+    if (idx >= n.subkeys_count) {
+        return status::NoMoreItems;
+    }
+    const Node &subkey = nodes_[n.first_subkey + idx];
+    if (size <= subkey.name_size) {
+        return status::MoreData;
+    }
+    std::memcpy(name, names_.data() + subkey.name_offset, subkey.name_size);
+    name[subkey.name_size] = '\0';
+    size = subkey.name_size;
+    return status::Success;
+}
+
+int32_t Snapshot::enum_value(Handle k, uint32_t idx, char *name,
+                             uint32_t &name_size, ValueType &type, void *data,
+                             uint32_t &size) {
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const Node &n = nodes_[handle_to_node(k)];
+    if (idx >= n.values_count) {
+        return status::NoMoreItems;
+    }
+    const Value &v = values_[n.first_value + idx];
+    const uint32_t name_capacity = name_size;
+    const uint32_t capacity = size;
+    name_size = v.name_size;
+    size = v.data_size;
+    if (name_capacity <= v.name_size || capacity < v.data_size) {
+        return status::MoreData;
+    }
+    type = v.type;
+    std::memcpy(name, names_.data() + v.name_offset, v.name_size);
+    name[v.name_size] = '\0';
+    if (v.data_size > 0) {
+        std::memcpy(data, data_.data() + v.data_offset, v.data_size);
+    }
+    return status::Success;
+}
+
+int32_t Snapshot::get_value(Handle k, const char *value_name, ValueType type,
+                            void *data, uint32_t &size) {
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const Value *v = find_value(handle_to_node(k), value_name);
+    if (v == nullptr) {
+        return status::FileNotFound;
+    }
+    if (!value_type_matches(type, v->type, v->data_size)) {
+        return status::UnsupportedType;
+    }
+    const uint32_t capacity = size;
+    size = v->data_size;
+    if (data == nullptr) {
+        return status::Success;
+    }
+    if (capacity < v->data_size) {
+        return status::MoreData;
+    }
+    std::memcpy(data, data_.data() + v->data_offset, v->data_size);
+    return status::Success;
+}
+
+int32_t Snapshot::get_values(Handle k, std::span<ValueEntry> entries,
+                             void *data, uint32_t &size) {
+    if (!valid_node(k)) {
+        return status::InvalidHandle;
+    }
+    const uint32_t node = handle_to_node(k);
+    uint32_t total = 0;
+    for (ValueEntry &entry : entries) {
+        const Value *v = find_value(node, entry.name);
+        if (v == nullptr) {
+            return status::FileNotFound;
+        }
+        entry.type = v->type;
+        entry.offset = total;
+        entry.size = v->data_size;
+        total += v->data_size;
+        if (data != nullptr && total <= size) {
+            std::memcpy((uint8_t *) data + entry.offset,
+                        data_.data() + v->data_offset, v->data_size);
+        }
+    }
+    const uint32_t capacity = size;
+    size = total;
+    if (data == nullptr) {
+        return status::Success;
+    }
+    return total > capacity ? status::MoreData : status::Success;
+}
+
+int32_t Snapshot::set_value(Handle k, const char *subkey_name,
+                            const char *value_name, ValueType type,
+                            const void *data, uint32_t size) {
+    (void) subkey_name;
+    (void) value_name;
+    (void) type;
+    (void) data;
+    (void) size;
+    return valid_node(k) ? status::AccessDenied : status::InvalidHandle;
+}
+
+int32_t Snapshot::set_values(Handle k, std::span<const ValueWrite> writes) {
+    (void) writes;
+    return valid_node(k) ? status::AccessDenied : status::InvalidHandle;
+}
+
+int32_t Snapshot::delete_value(Handle k, const char *value_name) {
+    (void) value_name;
+    return valid_node(k) ? status::AccessDenied : status::InvalidHandle;
+}
+
+int32_t Snapshot::watch(Handle k, Handle &w) {
+    (void) k;
+    (void) w;
+    return status::NotSupported;
+}
+
+int32_t Snapshot::wait_change(Handle w, uint32_t timeout_ms) {
+    (void) w;
+    (void) timeout_ms;
+    return status::NotSupported;
+}
+
+void Snapshot::unwatch(Handle w) {
+    (void) w;
+}
+
+ReadResult<void> Snapshot::copy_key(const Key &key, uint32_t node,
+                                    std::string &name_buf,
+                                    std::vector<uint8_t> &data_buf) {
+    const auto info = key.query_info();
+    if (!info.has_value()) {
+        return std::unexpected(info.error());
+    }
+    nodes_[node].last_write_time = info->last_write_time;
+
+    // Values are packed in the order the source enumerates them
+    const uint32_t first_value = (uint32_t) values_.size();
+    for (uint32_t idx = 0;; idx++) {
+        const auto v = key.enum_value(idx, name_buf, data_buf);
+        if (!v.has_value()) {
+            if (v.error().code == status::NoMoreItems) {
+                break;
+            }
+            return std::unexpected(v.error());
+        }
+        values_.push_back(Value {
+            .name_offset = add_name(v->name),
+            .name_size = (uint32_t) v->name.size(),
+            .type = v->type,
+            .data_offset = (uint32_t) data_.size(),
+            .data_size = (uint32_t) v->data.size(),
+        });
+        data_.insert(data_.end(), v->data.begin(), v->data.end());
+        sorted_values_.push_back(first_value + idx);
+    }
+    nodes_[node].first_value = first_value;
+    nodes_[node].values_count = (uint32_t) values_.size() - first_value;
+    std::ranges::sort(std::span(sorted_values_).subspan(first_value),
+                      less_names, [&](uint32_t i) {
+                          return name(values_[i].name_offset,
+                                      values_[i].name_size);
+                      });
+
+    // All subkeys are opened before any is copied, so that their nodes are
+    // next to each other and the ones which fail to open leave no gap
+    std::vector<Key> subkeys;
+    Subkeys names = key.subkeys();
+    for (std::string_view subkey_name : names) {
+        Key subkey(key, std::string(subkey_name), Access::Read);
+        if (subkey.valid()) {
+            subkeys.push_back(std::move(subkey));
+        }
+    }
+    if (names.error().has_value()) {
+        return std::unexpected(*names.error());
+    }
+    const uint32_t first_subkey = (uint32_t) nodes_.size();
+    uint32_t max_len = 0;
+    for (const Key &subkey : subkeys) {
+        const std::string &subkey_name = subkey.path_node()->name;
+        max_len = std::max(max_len, (uint32_t) subkey_name.size());
+        sorted_subkeys_.push_back((uint32_t) nodes_.size());
+        nodes_.push_back(Node {
+            .name_offset = add_name(subkey_name),
+            .name_size = (uint32_t) subkey_name.size(),
+            .first_subkey = 0,
+            .subkeys_count = 0,
+            .first_value = 0,
+            .values_count = 0,
+            .max_subkey_name_len = 0,
+            .last_write_time = 0,
+        });
+    }
+    nodes_[node].first_subkey = first_subkey;
+    nodes_[node].subkeys_count = (uint32_t) subkeys.size();
+    nodes_[node].max_subkey_name_len = max_len;
+    std::ranges::sort(std::span(sorted_subkeys_).subspan(first_subkey),
+                      less_names, [&](uint32_t i) {
+                          return name(nodes_[i].name_offset,
+                                      nodes_[i].name_size);
+                      });
+
+    for (uint32_t i = 0; i < subkeys.size(); i++) {
+        const auto res =
+            copy_key(subkeys[i], first_subkey + i, name_buf, data_buf);
+        if (!res.has_value()) {
+            return res;
+        }
+    }
+    return {};
+}
+
+uint32_t Snapshot::add_name(std::string_view name) {
+    const uint32_t offset = (uint32_t) names_.size();
+    names_ += name;
+    return offset;
+}
+
+bool Snapshot::valid_node(Handle k) const {
+    return k != InvalidHandle && handle_to_node(k) < nodes_.size();
+}
+
+std::string_view Snapshot::name(uint32_t offset, uint32_t size) const {
+    return std::string_view(names_).substr(offset, size);
+}
+
+uint32_t Snapshot::find_subkey(uint32_t node, std::string_view name) const {
+    const Node &n = nodes_[node];
+    const auto sorted =
+        std::span(sorted_subkeys_).subspan(n.first_subkey, n.subkeys_count);
+    const auto it =
+        std::ranges::lower_bound(sorted, name, less_names, [&](uint32_t i) {
+            return this->name(nodes_[i].name_offset, nodes_[i].name_size);
+        });
+    if (it == sorted.end()) {
+        return NoIndex;
+    }
+    const Node &subkey = nodes_[*it];
+    return equal_names(this->name(subkey.name_offset, subkey.name_size), name)
+               ? *it
+               : NoIndex;
+}
+
+const Snapshot::Value *Snapshot::find_value(uint32_t node,
+                                            std::string_view name) const {
+    const Node &n = nodes_[node];
+    const auto sorted =
+        std::span(sorted_values_).subspan(n.first_value, n.values_count);
+    const auto it =
+        std::ranges::lower_bound(sorted, name, less_names, [&](uint32_t i) {
+            return this->name(values_[i].name_offset, values_[i].name_size);
+        });
+    if (it == sorted.end()) {
+        return nullptr;
+    }
+    const Value &v = values_[*it];
+    return equal_names(this->name(v.name_offset, v.name_size), name) ? &v
+                                                                      : nullptr;
+}
+
+} // namespace reg
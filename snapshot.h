@@ -0,0 +1,108 @@
+#pragma once
+
+#include "reg.h"
+#include <string_view>
+
+namespace reg {
+
+// Immutable in-memory copy of a key with all of its subkeys and values, for
+// querying a subtree many times without going back to the source. The copy
+// is made in one depth-first pass and then packed: keys and values live in
+// flat arrays with the subkeys and the values of a key next to each other,
+// names in one string and value data in one buffer. Subkeys and values are
+// also indexed by name, so opening a path and reading a value are binary
+// searches.
+//
+// Nothing changes after loading, so all methods are safe to call
+// concurrently without locks. Handles are key indices, closing them is a
+// no-op. Writes fail with status::AccessDenied and watches are not
+// supported; the copy does not follow the source.
+class Snapshot : public Backend {
+  public:
+    // Copies `key` and everything below it. The keys above it are copied as
+    // path only, with no values and the one subkey each, so the copy is
+    // opened from its system key with the same paths as the source. Subkeys
+    // which cannot be opened (removed meanwhile or denied) are left out.
+    static ReadResult<Snapshot> load(const Key &key);
+
+    // Number of copied keys, the ones on the path included
+    size_t keys_count() const;
+    size_t values_count() const;
+    // Bytes taken by the packed tree
+    size_t memory_size() const;
+
+    Handle root(SystemKey sk) override;
+    int32_t open(Handle parent, const char *subkey_name, Access access,
+                 Handle &k) override;
+    int32_t create(Handle parent, const char *subkey_name, Access access,
+                   Handle &k) override;
+    void close(Handle k) override;
+    int32_t query_info(Handle k, KeyInfo &info) override;
+    int32_t enum_subkey(Handle k, uint32_t idx, char *name,
+                        uint32_t &size) override;
+    int32_t enum_value(Handle k, uint32_t idx, char *name,
+                       uint32_t &name_size, ValueType &type, void *data,
+                       uint32_t &size) override;
+    int32_t get_value(Handle k, const char *value_name, ValueType type,
+                      void *data, uint32_t &size) override;
+    int32_t get_values(Handle k, std::span<ValueEntry> entries, void *data,
+                       uint32_t &size) override;
+    int32_t set_value(Handle k, const char *subkey_name,
+                      const char *value_name, ValueType type, const void *data,
+                      uint32_t size) override;
+    int32_t set_values(Handle k,
+                       std::span<const ValueWrite> writes) override;
+    int32_t delete_value(Handle k, const char *value_name) override;
+    int32_t watch(Handle k, Handle &w) override;
+    int32_t wait_change(Handle w, uint32_t timeout_ms) override;
+    void unwatch(Handle w) override;
+
+  private:
+    // Subkeys of a key are the nodes [first_subkey, first_subkey +
+    // subkeys_count), in the order the source enumerates them; likewise
+    // for values
+    struct Node {
+        uint32_t name_offset;
+        uint32_t name_size;
+        uint32_t first_subkey;
+        uint32_t subkeys_count;
+        uint32_t first_value;
+        uint32_t values_count;
+        uint32_t max_subkey_name_len;
+        uint64_t last_write_time;
+    };
+
+    struct Value {
+        uint32_t name_offset;
+        uint32_t name_size;
+        ValueType type;
+        uint32_t data_offset;
+        uint32_t data_size;
+    };
+
+    static constexpr uint32_t NoIndex = UINT32_MAX;
+
+    Snapshot() = default;
+
+    // Copies the subkeys and values of `key` into `node`
+    ReadResult<void> copy_key(const Key &key, uint32_t node,
+                              std::string &name_buf,
+                              std::vector<uint8_t> &data_buf);
+    uint32_t add_name(std::string_view name);
+
+    bool valid_node(Handle k) const;
+    std::string_view name(uint32_t offset, uint32_t size) const;
+    uint32_t find_subkey(uint32_t node, std::string_view name) const;
+    const Value *find_value(uint32_t node, std::string_view name) const;
+
+    std::vector<Node> nodes_;
+    std::vector<Value> values_;
+    // Parallel to nodes_ and values_: the entries of every key's range are
+    // the indices of its subkeys and values sorted by case-folded name
+    std::vector<uint32_t> sorted_subkeys_;
+    std::vector<uint32_t> sorted_values_;
+    std::string names_;
+    std::vector<uint8_t> data_;
+};
+
+} // namespace reg
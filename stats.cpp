@@ -0,0 +1,260 @@
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+using reg::stats::Histogram;
+
+constexpr size_t ErrorSlots = 8;
+
+// Counters of one operation on one thread. Only the owning thread writes
+// them; snapshots read them from other threads, hence the atomics.
+struct Counters {
+    std::atomic<uint64_t> calls;
+    // Code 0 marks a free slot, the last slot takes every code which does
+    // not fit
+    std::array<std::atomic<int32_t>, ErrorSlots> error_codes;
+    std::array<std::atomic<uint64_t>, ErrorSlots> error_counts;
+    std::array<std::atomic<uint64_t>, Histogram::Buckets> buckets;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+};
+
+struct ThreadStats {
+    std::array<Counters, reg::stats::OperationCount> ops;
+};
+
+// Single writer, so a plain load and store do instead of a locked add
+[[maybe_unused]] void bump(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+}
+
+void merge(const ThreadStats &ts, reg::stats::Snapshot &snapshot) {
+    for (size_t op = 0; op < ts.ops.size(); op++) {
+        const Counters &c = ts.ops[op];
+        reg::stats::OperationStats &s = snapshot.ops[op];
+        s.calls += c.calls.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < ErrorSlots; i++) {
+            const int32_t code =
+                c.error_codes[i].load(std::memory_order_relaxed);
+            if (code != 0) {
+                const int32_t key =
+                    i + 1 < ErrorSlots ? code : reg::stats::OtherErrors;
+                s.errors[key] +=
+                    c.error_counts[i].load(std::memory_order_relaxed);
+            }
+        }
+        for (size_t b = 0; b < Histogram::Buckets; b++) {
+            s.latency.counts[b] +=
+                c.buckets[b].load(std::memory_order_relaxed);
+        }
+        s.latency.total_ns += c.total_ns.load(std::memory_order_relaxed);
+        s.latency.max_ns = std::max(
+            s.latency.max_ns, c.max_ns.load(std::memory_order_relaxed));
+    }
+}
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<const ThreadStats *> threads;
+    // Numbers of the threads which have finished
+    reg::stats::Snapshot retired {};
+};
+
+Registry &registry() {
+    static Registry r;
+    return r;
+}
+
+// Counters of the current thread, merged into the registry when it ends
+struct Registration {
+    std::unique_ptr<ThreadStats> stats;
+
+    Registration() : stats {std::make_unique<ThreadStats>()} {
+        Registry &r = registry();
+        std::lock_guard lock(r.mutex);
+        r.threads.push_back(stats.get());
+    }
+
+    ~Registration() {
+        Registry &r = registry();
+        std::lock_guard lock(r.mutex);
+        merge(*stats, r.retired);
+        std::erase(r.threads, stats.get());
+    }
+};
+
+[[maybe_unused]] ThreadStats &local_stats() {
+    thread_local Registration registration;
+    return *registration.stats;
+}
+
+} // namespace
+
+namespace reg::stats {
+
+size_t Histogram::bucket(uint64_t ns) {
+    if (ns < SubBuckets) {
+        return (size_t) ns;
+    }
+    const size_t shift = (size_t) std::bit_width(ns) - 1 - SubBucketBits;
+    const size_t sub = (size_t) (ns >> shift) - SubBuckets;
+    return (shift + 1) * SubBuckets + sub;
+}
+
+uint64_t Histogram::bucket_max(size_t bucket) {
+    if (bucket < SubBuckets) {
+        return bucket;
+    }
+    const size_t shift = bucket / SubBuckets - 1;
+    const uint64_t sub = bucket % SubBuckets + SubBuckets;
+    return ((sub + 1) << shift) - 1;
+}
+
+void Histogram::add(uint64_t ns) {
+    counts[bucket(ns)]++;
+    total_ns += ns;
+    max_ns = std::max(max_ns, ns);
+}
+
+uint64_t Histogram::count() const {
+    uint64_t n = 0;
+    for (uint64_t c : counts) {
+        n += c;
+    }
+    return n;
+}
+
+uint64_t Histogram::percentile(double p) const {
+    const uint64_t n = count();
+    if (n == 0) {
+        return 0;
+    }
+    const uint64_t rank = std::max<uint64_t>((uint64_t) (p * (double) n), 1);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < Buckets; b++) {
+        seen += counts[b];
+        if (seen >= rank) {
+            return std::min(bucket_max(b), max_ns);
+        }
+    }
+    return max_ns;
+}
+
+std::string_view operation_name(Operation op) {
+    switch (op) {
+    case Operation::OpenKey:
+        return "open";
+    case Operation::CreateKey:
+        return "create";
+    case Operation::GetSubkeysCount:
+        return "get_subkeys_count";
+    case Operation::QueryKeyInfo:
+        return "query_info";
+    case Operation::EnumSubkeyNames:
+        return "enum_subkey_names";
+    case Operation::EnumValues:
+        return "enum_value";
+    case Operation::ReadU32Value:
+        return "read_u32_value";
+    case Operation::ReadStringValue:
+        return "read_string_value";
+    case Operation::QueryValueSize:
+        return "query_value_size";
+    case Operation::ReadU64Value:
+        return "read_u64_value";
+    case Operation::ReadBinaryValue:
+        return "read_binary_value";
+    case Operation::ReadExpandStringValue:
+        return "read_expand_string_value";
+    case Operation::ReadMultiStringValue:
+        return "read_multi_string_value";
+    case Operation::ReadValues:
+        return "read_values";
+    case Operation::ReadU32Values:
+        return "read_u32_values";
+    case Operation::ReadStringValues:
+        return "read_string_values";
+    case Operation::WriteBinaryValue:
+        return "write_binary_value";
+    case Operation::WriteU32Value:
+        return "write_u32_value";
+    case Operation::WriteU64Value:
+        return "write_u64_value";
+    case Operation::WriteStringValue:
+        return "write_string_value";
+    case Operation::WriteExpandStringValue:
+        return "write_expand_string_value";
+    case Operation::WriteMultiStringValue:
+        return "write_multi_string_value";
+    case Operation::WriteValues:
+        return "write_values";
+    case Operation::DeleteValue:
+        return "delete_value";
+    case Operation::ApplyWritePlan:
+        return "apply_write_plan";
+    case Operation::RollBackWritePlan:
+        return "roll_back_write_plan";
+    case Operation::CommitOverlay:
+        return "commit_overlay";
+    case Operation::WaitForChange:
+        return "wait_for_change";
+    case Operation::ReadRecord:
+        return "read_record";
+    case Operation::ImportRegFile:
+        return "import_reg_file";
+    case Operation::ExportRegFile:
+        return "export_reg_file";
+    case Operation::_Count:
+        break;
+    }
+    return "unknown";
+}
+
+void record(Operation op, int32_t res, std::chrono::nanoseconds latency) {
+#ifdef REG_STATS
+    Counters &c = local_stats().ops[std::to_underlying(op)];
+    const uint64_t ns = (uint64_t) std::max<int64_t>(latency.count(), 0);
+    bump(c.calls);
+    bump(c.buckets[Histogram::bucket(ns)]);
+    bump(c.total_ns, ns);
+    if (ns > c.max_ns.load(std::memory_order_relaxed)) {
+        c.max_ns.store(ns, std::memory_order_relaxed);
+    }
+    if (res == status::Success) {
+        return;
+    }
+    for (size_t i = 0; i < ErrorSlots; i++) {
+        const int32_t code = c.error_codes[i].load(std::memory_order_relaxed);
+        if (code == 0) {
+            c.error_codes[i].store(res, std::memory_order_relaxed);
+        }
+        if (code == 0 || code == res || i + 1 == ErrorSlots) {
+            bump(c.error_counts[i]);
+            return;
+        }
+    }
+#else
+    (void) op;
+    (void) res;
+    (void) latency;
+#endif
+}
+
+Snapshot snapshot() {
+    Registry &r = registry();
+    std::lock_guard lock(r.mutex);
+    Snapshot s = r.retired;
+    for (const ThreadStats *ts : r.threads) {
+        merge(*ts, s);
+    }
+    return s;
+}
+
+} // namespace reg::stats
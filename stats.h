@@ -0,0 +1,68 @@
+#pragma once
+
+#include "reg.h"
+#include <array>
+#include <chrono>
+#include <map>
+#include <string_view>
+#include <utility>
+
+// Call counts, error counts and latency histograms of reg::Key operations.
+// Recording is compiled in only when REG_STATS is defined; otherwise
+// snapshot() returns zeros. Every thread records into its own counters, a
+// snapshot merges them, so recording takes no locks.
+namespace reg::stats {
+
+#ifdef REG_STATS
+inline constexpr bool Enabled = true;
+#else
+inline constexpr bool Enabled = false;
+#endif
+
+// Error code under which failures are counted once a thread has seen too
+// many distinct codes for one operation
+inline constexpr int32_t OtherErrors = -1;
+
+// Latency histogram in nanoseconds. Buckets double in width with every power
+// of two and each is split into SubBuckets linear ones, so a recorded value
+// is known within 1/SubBuckets of itself.
+struct Histogram {
+    static constexpr size_t SubBucketBits = 3;
+    static constexpr size_t SubBuckets = 1 << SubBucketBits;
+    static constexpr size_t Buckets = 64 * SubBuckets;
+
+    std::array<uint64_t, Buckets> counts;
+    uint64_t total_ns;
+    uint64_t max_ns;
+
+    static size_t bucket(uint64_t ns);
+    // Largest value which falls into a bucket
+    static uint64_t bucket_max(size_t bucket);
+
+    void add(uint64_t ns);
+    uint64_t count() const;
+    // Upper bound of the latency below which `p` (0 to 1) of calls fall
+    uint64_t percentile(double p) const;
+};
+
+struct OperationStats {
+    uint64_t calls;
+    // Failed calls by status code
+    std::map<int32_t, uint64_t> errors;
+    Histogram latency;
+};
+
+inline constexpr size_t OperationCount = std::to_underlying(Operation::_Count);
+
+// Numbers of all threads, including finished ones, indexed by reg::Operation
+struct Snapshot {
+    std::array<OperationStats, OperationCount> ops;
+};
+
+// Name of the reg::Key call behind an operation, for reports
+std::string_view operation_name(Operation op);
+
+void record(Operation op, int32_t res, std::chrono::nanoseconds latency);
+Snapshot snapshot();
+
+} // namespace reg::stats
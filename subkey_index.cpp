@@ -0,0 +1,116 @@
+#include "subkey_index.h"
+#include <algorithm>
+#include <cctype>
+
+namespace {
+
+std::string fold(std::string_view name) {
+    std::string folded(name);
+    for (char &c : folded) {
+        c = (char) std::tolower((unsigned char) c);
+    }
+    return folded;
+}
+
+} // namespace
+
+namespace reg {
+
+ReadResult<SubkeyIndex> SubkeyIndex::build(const Key &key) {
+    // The write time is taken first, so a subkey added during the walk makes
+    // the next refresh() rebuild rather than go unnoticed
+    const auto info = key.query_info();
+    if (!info.has_value()) {
+        return std::unexpected(info.error());
+    }
+    SubkeyIndex index;
+    index.last_write_time_ = info->last_write_time;
+    index.entries_.reserve(info->subkeys_count);
+    Subkeys subkeys = key.subkeys();
+    for (std::string_view name : subkeys) {
+        index.entries_.push_back(Entry {
+            .offset = (uint32_t) index.names_.size(),
+            .size = (uint32_t) name.size(),
+        });
+        index.names_ += name;
+    }
+    if (subkeys.error().has_value()) {
+        return std::unexpected(*subkeys.error());
+    }
+    index.folded_ = fold(index.names_);
+    std::ranges::sort(index.entries_, {},
+                      [&](const Entry &e) { return index.folded(e); });
+    return index;
+}
+
+ReadResult<bool> SubkeyIndex::refresh(const Key &key) {
+    const auto info = key.query_info();
+    if (!info.has_value()) {
+        return std::unexpected(info.error());
+    }
+    if (info->last_write_time == last_write_time_) {
+        return false;
+    }
+    auto index = build(key);
+    if (!index.has_value()) {
+        return std::unexpected(index.error());
+    }
+    *this = std::move(index.value());
+    return true;
+}
+
+size_t SubkeyIndex::size() const {
+    return entries_.size();
+}
+
+uint64_t SubkeyIndex::last_write_time() const {
+    return last_write_time_;
+}
+
+std::optional<std::string_view>
+SubkeyIndex::find(std::string_view name) const {
+    const std::string folded_name = fold(name);
+    const auto it = lower_bound(folded_name);
+    if (it == entries_.end() || folded(*it) != folded_name) {
+        return std::nullopt;
+    }
+    return this->name(*it);
+}
+
+std::optional<std::string_view>
+SubkeyIndex::find_exact(std::string_view name) const {
+    // Names differing only in case cannot be siblings
+    const auto found = find(name);
+    if (!found.has_value() || *found != name) {
+        return std::nullopt;
+    }
+    return found;
+}
+
+std::vector<std::string_view>
+SubkeyIndex::find_prefix(std::string_view prefix) const {
+    const std::string folded_prefix = fold(prefix);
+    std::vector<std::string_view> names;
+    for (auto it = lower_bound(folded_prefix);
+         it != entries_.end() && folded(*it).starts_with(folded_prefix);
+         ++it) {
+        names.push_back(name(*it));
+    }
+    return names;
+}
+
+std::string_view SubkeyIndex::name(const Entry &e) const {
+    return std::string_view(names_).substr(e.offset, e.size);
+}
+
+std::string_view SubkeyIndex::folded(const Entry &e) const {
+    return std::string_view(folded_).substr(e.offset, e.size);
+}
+
+std::vector<SubkeyIndex::Entry>::const_iterator
+SubkeyIndex::lower_bound(std::string_view folded_name) const {
+    return std::ranges::lower_bound(
+        entries_, folded_name, {}, [&](const Entry &e) { return folded(e); });
+}
+
+} // namespace reg
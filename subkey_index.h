@@ -0,0 +1,62 @@
+#pragma once
+
+#include "reg.h"
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace reg {
+
+// Sorted index of the subkey names of one key, for finding children of keys
+// with many subkeys (Enum\USB, Control\Class) without enumerating them one
+// backend call each. Building it enumerates the key once; lookups are binary
+// searches over the case-folded names. The index remembers the last write
+// time of the key, which changes whenever a subkey is added or removed, and
+// refresh() rebuilds it only when that has moved on.
+//
+// Const methods may be called concurrently, refresh() may not be called
+// concurrently with anything else.
+class SubkeyIndex {
+  public:
+    static ReadResult<SubkeyIndex> build(const Key &key);
+
+    // Rebuilds the index if the key has been written since it was built, for
+    // one key info query otherwise. Returns whether it has been rebuilt.
+    ReadResult<bool> refresh(const Key &key);
+
+    size_t size() const;
+    uint64_t last_write_time() const;
+
+    // Name as stored, compared case-insensitively like the registry does
+    std::optional<std::string_view> find(std::string_view name) const;
+    // Only a name with the same case
+    std::optional<std::string_view> find_exact(std::string_view name) const;
+    // Names starting with `prefix` compared case-insensitively, in
+    // case-folded order
+    std::vector<std::string_view> find_prefix(std::string_view prefix) const;
+
+  private:
+    struct Entry {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    SubkeyIndex() = default;
+
+    // Both strings hold every name at the same offset, `folded_` in lower
+    // case
+    std::string_view name(const Entry &e) const;
+    std::string_view folded(const Entry &e) const;
+    // First entry whose folded name is not less than `folded_name`
+    std::vector<Entry>::const_iterator
+    lower_bound(std::string_view folded_name) const;
+
+    std::string names_;
+    std::string folded_;
+    // Sorted by folded name
+    std::vector<Entry> entries_;
+    uint64_t last_write_time_ = 0;
+};
+
+} // namespace reg
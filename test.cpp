@@ -1,6 +1,33 @@
 #define BOOST_TEST_MODULE key_test_module
+#include "arena.h"
+#include "async.h"
+#include "cache_backend.h"
+#include "hive_backend.h"
+#include "mem_backend.h"
+#include "overlay_backend.h"
+#include "pool.h"
+#include "record.h"
 #include "reg.h"
+#include "regfile.h"
+#include "search.h"
+#include "shared_key.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "subkey_index.h"
+#include "write_plan.h"
+#include <array>
+#include <atomic>
 #include <boost/test/unit_test.hpp>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <random>
+#include <ranges>
+#include <sstream>
+#include <thread>
+
+#ifdef _WIN32
 // clang-format off
 #include <windows.h>
 #include <detours.h> // include after windows.h
@@ -195,7 +222,7 @@ BOOST_AUTO_TEST_CASE(subkeys_count_failure) {
     BOOST_TEST_REQUIRE(!subkeys_count_res.has_value());
     const reg::Error &err = subkeys_count_res.error();
     BOOST_TEST(err.code == ERROR_NOT_SUPPORTED);
-    BOOST_TEST(err.msg == "Failed to get subkeys count");
+    BOOST_TEST(err.msg() == "Failed to get subkeys count");
 }
 
 BOOST_AUTO_TEST_CASE(enum_subkey_names_success) {
@@ -211,6 +238,7 @@ BOOST_AUTO_TEST_CASE(enum_subkey_names_success) {
         static const char *subkey_names[] = {"subkey0", "subkey1"};
         strncpy_s(lpName, *lpcchName, subkey_names[dwIndex],
                   strlen(subkey_names[dwIndex]));
+        *lpcchName = (DWORD) strlen(subkey_names[dwIndex]);
         return ERROR_SUCCESS;
     };
 
@@ -244,5 +272,1399 @@ BOOST_AUTO_TEST_CASE(enum_subkey_names_index_out_of_range) {
     BOOST_REQUIRE(!enum_subkey_res.has_value());
     const reg::Error &err = enum_subkey_res.error();
     BOOST_TEST(err.code == ERROR_NO_MORE_ITEMS);
-    BOOST_TEST(err.msg == "Failed to get subkey name with index '4'");
+    BOOST_TEST(err.msg() == "Failed to get subkey name with index '4'");
+}
+
+#endif // _WIN32
+
+BOOST_AUTO_TEST_CASE(mem_system_key) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    BOOST_TEST(root.valid());
+    BOOST_TEST(root.system());
+    BOOST_TEST(root.path() == "HKEY_LOCAL_MACHINE");
+    BOOST_TEST(root.get_subkeys_count().value_or(99) == 0U);
+}
+
+BOOST_AUTO_TEST_CASE(mem_open_nested_path) {
+    reg::MemBackend backend;
+    backend.create_key("SYSTEM\\Control\\Class");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+
+    const reg::Key key(root, "system\\CONTROL\\Class");
+    BOOST_TEST(key.valid());
+    BOOST_TEST(!key.system());
+    BOOST_TEST(key.path() == "HKEY_LOCAL_MACHINE\\system\\CONTROL\\Class");
+
+    const reg::Key missing(root, "SYSTEM\\Enum");
+    BOOST_TEST(!missing.valid());
+    BOOST_TEST(missing.path() == "HKEY_LOCAL_MACHINE\\SYSTEM\\Enum");
+}
+
+BOOST_AUTO_TEST_CASE(mem_keys_share_interned_paths) {
+    reg::MemBackend backend;
+    backend.create_key("SYSTEM\\Control\\Class");
+    backend.create_key("SYSTEM\\Select");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+
+    const reg::Key nested(root, "SYSTEM\\Control\\Class");
+    const reg::Key control(root, "SYSTEM\\Control");
+    const reg::Key child(control, "Class");
+    BOOST_TEST(nested.path_node() == child.path_node());
+    BOOST_TEST(child.path_node()->parent == control.path_node());
+    BOOST_TEST(child.path() == "HKEY_LOCAL_MACHINE\\SYSTEM\\Control\\Class");
+
+    const reg::Key same(control, "");
+    BOOST_TEST(same.path_node() == control.path_node());
+    const reg::Key other(root, "\\SYSTEM\\\\Select");
+    BOOST_TEST(other.path() == "HKEY_LOCAL_MACHINE\\SYSTEM\\Select");
+    BOOST_TEST(other.path_node()->parent == control.path_node()->parent);
+}
+
+BOOST_AUTO_TEST_CASE(mem_paths_freed_with_last_key) {
+    reg::MemBackend backend;
+    backend.create_key("SYSTEM\\Control");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const size_t refs = root.path_node()->refs;
+    {
+        const reg::Key control(root, "SYSTEM\\Control");
+        reg::Key moved = reg::Key(control, "");
+        // Failed opens intern nothing
+        const reg::Key missing(control, "Class\\0000");
+        BOOST_TEST(missing.path_node() == control.path_node());
+        BOOST_TEST(root.path_node()->refs == refs + 1);
+    }
+    BOOST_TEST(root.path_node()->refs == refs);
+}
+
+BOOST_AUTO_TEST_CASE(mem_enum_subkeys) {
+    reg::MemBackend backend;
+    backend.create_key("media\\0000");
+    backend.create_key("media\\0001");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key key(root, "media");
+
+    BOOST_TEST(key.get_subkeys_count().value_or(99) == 2U);
+    BOOST_TEST(key.enum_subkey_names(0).value_or("error0") == "0000");
+    BOOST_TEST(key.enum_subkey_names(1).value_or("error1") == "0001");
+
+    const auto enum_subkey_res = key.enum_subkey_names(2);
+    BOOST_REQUIRE(!enum_subkey_res.has_value());
+    BOOST_TEST(enum_subkey_res.error().code == reg::status::NoMoreItems);
+}
+
+BOOST_AUTO_TEST_CASE(mem_query_info_tracks_writes) {
+    reg::MemBackend backend;
+    backend.create_key("media\\0000\\PowerSettings");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key msk(root, "media\\0000");
+    const reg::Key psk(msk, "PowerSettings");
+
+    const uint64_t main_time = msk.query_info().value().last_write_time;
+    const uint64_t ps_time = psk.query_info().value().last_write_time;
+    psk.write_u32_value("IdlePowerState", 3);
+    // Only the key whose value is written changes
+    BOOST_TEST(msk.query_info().value().last_write_time == main_time);
+    BOOST_TEST(psk.query_info().value().last_write_time > ps_time);
+    BOOST_TEST(psk.query_info().value().values_count == 1U);
+
+    const reg::Key missing(root, "missing");
+    BOOST_TEST(missing.query_info().error().msg() ==
+               "Failed to query key info");
+}
+
+BOOST_AUTO_TEST_CASE(mem_subkeys_range) {
+    const std::string long_name(100, 'x');
+    reg::MemBackend backend;
+    backend.create_key("media\\0000");
+    backend.create_key("media\\" + long_name);
+    backend.create_key("media\\0002");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key key(root, "media");
+
+    BOOST_TEST(key.enum_subkey_names(1).value_or("error1") == long_name);
+
+    std::vector<std::string> names;
+    reg::Subkeys subkeys = key.subkeys();
+    for (std::string_view name : subkeys) {
+        names.emplace_back(name);
+    }
+    BOOST_TEST(!subkeys.error().has_value());
+    const std::vector<std::string> expected {"0000", long_name, "0002"};
+    BOOST_TEST(names == expected, boost::test_tools::per_element());
+
+    size_t visited = 0;
+    for (std::string_view name : key.subkeys()) {
+        visited++;
+        if (name == long_name) {
+            break;
+        }
+    }
+    BOOST_TEST(visited == 2U);
+
+    static_assert(std::ranges::input_range<reg::Subkeys>);
+    const reg::Key leaf(key, "0000");
+    BOOST_TEST((leaf.subkeys().begin() == std::default_sentinel));
+}
+
+BOOST_AUTO_TEST_CASE(mem_write_and_read_values) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+
+    BOOST_TEST(!root.write_subkey_u32_value("dev\\PowerSettings",
+                                            "PerformanceIdleTime", 0x10)
+                    .fail);
+    const reg::Key psk(root, "dev\\PowerSettings");
+    BOOST_REQUIRE(psk.valid());
+    BOOST_TEST(psk.read_u32_value("performanceidletime").value_or(0) == 0x10U);
+
+    BOOST_TEST(!psk.write_u32_value("PerformanceIdleTime", 0xffffffff).fail);
+    BOOST_TEST(psk.read_u32_value("PerformanceIdleTime").value_or(0) ==
+               0xffffffffU);
+
+    const auto string_res = psk.read_string_value("PerformanceIdleTime");
+    BOOST_REQUIRE(!string_res.has_value());
+    BOOST_TEST(string_res.error().code == reg::status::UnsupportedType);
+
+    const auto missing_res = psk.read_u32_value("ConservationIdleTime");
+    BOOST_REQUIRE(!missing_res.has_value());
+    BOOST_TEST(missing_res.error().code == reg::status::FileNotFound);
+    BOOST_TEST(missing_res.error().msg() ==
+               "Failed to get u32 value 'ConservationIdleTime'");
+}
+
+BOOST_AUTO_TEST_CASE(cache_reuses_open_keys) {
+    reg::MemBackend backend;
+    backend.create_key("media\\0000\\PowerSettings");
+    backend.create_key("media\\0001\\PowerSettings");
+    reg::CachingBackend cache(backend, 1);
+    const reg::Key root(cache, reg::SystemKey::LocalMachine);
+
+    {
+        const reg::Key psk(root, "media\\0000\\PowerSettings");
+        BOOST_TEST(psk.valid());
+        BOOST_TEST(!psk.write_u32_value("IdlePowerState", 3).fail);
+    }
+    {
+        const reg::Key psk(root, "MEDIA\\0000\\powersettings");
+        BOOST_TEST(psk.read_u32_value("IdlePowerState").value_or(0) == 3U);
+        const reg::Key same(root, "media\\0000\\PowerSettings");
+        BOOST_TEST(same.valid());
+        const reg::Key read_only(root, "media\\0000\\PowerSettings",
+                                 reg::Access::Read);
+        BOOST_TEST(read_only.valid());
+    }
+    reg::CachingBackend::Stats stats = cache.stats();
+    BOOST_TEST(stats.hits == 2U);
+    BOOST_TEST(stats.misses == 2U);
+    BOOST_TEST(stats.evictions == 1U);
+    BOOST_TEST(stats.open_handles == 1U);
+
+    const reg::Key missing(root, "media\\0002");
+    BOOST_TEST(!missing.valid());
+    const reg::Key other(root, "media\\0001\\PowerSettings");
+    BOOST_TEST(other.valid());
+    stats = cache.stats();
+    BOOST_TEST(stats.misses == 4U);
+    BOOST_TEST(stats.evictions == 2U);
+    BOOST_TEST(stats.open_handles == 1U);
+    // The system key and the one open path, the evicted ones are dropped
+    BOOST_TEST(stats.paths == 2U);
+}
+
+BOOST_AUTO_TEST_CASE(overlay_previews_and_commits) {
+    reg::MemBackend backend;
+    backend.create_key("media\\0000\\PowerSettings");
+    {
+        const reg::Key root(backend, reg::SystemKey::LocalMachine);
+        const reg::Key psk(root, "media\\0000\\PowerSettings");
+        psk.write_u32_value("IdlePowerState", 1);
+        psk.write_u32_value("ConservationIdleTime", 30);
+    }
+    reg::OverlayBackend overlay(backend);
+    const reg::Key root(overlay, reg::SystemKey::LocalMachine);
+    const reg::Key psk(root, "MEDIA\\0000\\powersettings");
+    BOOST_TEST(psk.read_u32_value("IdlePowerState").value_or(0) == 1U);
+
+    BOOST_TEST(!psk.write_u32_value("IdlePowerState", 3).fail);
+    BOOST_TEST(!psk.write_u32_value("PerformanceIdleTime", 60).fail);
+    BOOST_TEST(!psk.delete_value("ConservationIdleTime").fail);
+    const reg::Key created =
+        reg::Key::create(root, "media\\0001\\PowerSettings").value();
+    BOOST_TEST(!created.write_u32_value("IdlePowerState", 2).fail);
+
+    // Reads merge the delta, the wrapped backend stays as it was
+    BOOST_TEST(psk.read_u32_value("IdlePowerState").value_or(0) == 3U);
+    BOOST_TEST(!psk.read_u32_value("ConservationIdleTime").has_value());
+    const reg::Key media(root, "media");
+    BOOST_TEST(media.get_subkeys_count().value_or(0) == 2U);
+    BOOST_TEST(media.enum_subkey_names(1).value_or("") == "0001");
+    std::string name_buf;
+    std::vector<uint8_t> data_buf;
+    std::vector<std::string> names;
+    for (uint32_t i = 0;; i++) {
+        const auto v = psk.enum_value(i, name_buf, data_buf);
+        if (!v) {
+            break;
+        }
+        names.emplace_back(v->name);
+    }
+    const std::vector<std::string> expected {"IdlePowerState",
+                                             "PerformanceIdleTime"};
+    BOOST_TEST(names == expected, boost::test_tools::per_element());
+    {
+        const reg::Key inner_root(backend, reg::SystemKey::LocalMachine);
+        const reg::Key inner_psk(inner_root, "media\\0000\\PowerSettings");
+        BOOST_TEST(inner_psk.read_u32_value("IdlePowerState").value_or(0) ==
+                   1U);
+        BOOST_TEST(!reg::Key(inner_root, "media\\0001").valid());
+    }
+
+    std::vector<std::string> changes;
+    overlay.for_each_change([&](const reg::OverlayBackend::Change &c) {
+        changes.push_back(std::format("{} {} {}", (int) c.kind, c.path,
+                                      c.value_name));
+    });
+    const std::vector<std::string> expected_changes {
+        "1 MEDIA\\0000\\powersettings IdlePowerState",
+        "1 MEDIA\\0000\\powersettings PerformanceIdleTime",
+        "2 MEDIA\\0000\\powersettings ConservationIdleTime",
+        "0 media\\0001 ",
+        "0 media\\0001\\PowerSettings ",
+        "1 media\\0001\\PowerSettings IdlePowerState",
+    };
+    BOOST_TEST(changes == expected_changes, boost::test_tools::per_element());
+
+    BOOST_TEST(!overlay.commit().fail);
+    BOOST_TEST(overlay.stats().keys == 0U);
+    const reg::Key inner_root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key inner_psk(inner_root, "media\\0000\\PowerSettings");
+    BOOST_TEST(inner_psk.read_u32_value("IdlePowerState").value_or(0) == 3U);
+    BOOST_TEST(!inner_psk.read_u32_value("ConservationIdleTime").has_value());
+    const reg::Key inner_created(inner_root, "media\\0001\\PowerSettings");
+    BOOST_TEST(inner_created.read_u32_value("IdlePowerState").value_or(0) ==
+               2U);
+
+    BOOST_TEST(!psk.write_u32_value("IdlePowerState", 0).fail);
+    overlay.discard();
+    BOOST_TEST(psk.read_u32_value("IdlePowerState").value_or(0) == 3U);
+}
+
+BOOST_AUTO_TEST_CASE(shared_key_is_read_from_many_threads) {
+    reg::MemBackend backend;
+    backend.create_key("media\\0000");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    reg::SharedKey mk(reg::Key(root, "media"));
+    BOOST_REQUIRE(mk);
+    mk->write_u32_value("Count", 7);
+    BOOST_TEST(mk.use_count() == 1U);
+
+    std::atomic<int> reads = 0;
+    {
+        std::vector<std::jthread> threads;
+        for (int t = 0; t < 8; t++) {
+            threads.emplace_back([&reads, mk] {
+                for (int i = 0; i < 100; i++) {
+                    const reg::SharedKey copy = mk;
+                    if (copy->read_u32_value("Count").value_or(0) == 7 &&
+                        copy->enum_subkey_names(0).value_or("") == "0000") {
+                        reads++;
+                    }
+                }
+            });
+        }
+    }
+    BOOST_TEST(reads.load() == 800);
+    BOOST_TEST(mk.use_count() == 1U);
+
+    reg::SharedKey other = mk;
+    BOOST_TEST(mk.use_count() == 2U);
+    reg::SharedKey moved = std::move(other);
+    BOOST_TEST(!other);
+    BOOST_TEST(moved->path() == "HKEY_LOCAL_MACHINE\\media");
+    moved = reg::SharedKey();
+    BOOST_TEST(mk.use_count() == 1U);
+    BOOST_TEST(reg::SharedKey().use_count() == 0U);
+}
+
+BOOST_AUTO_TEST_CASE(snapshot_copies_subtree) {
+    reg::MemBackend backend;
+    backend.create_key("other");
+    backend.create_key("class\\media\\0001");
+    backend.create_key("class\\media\\0000\\PowerSettings");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key mk(root, "class\\media");
+    root.write_subkey_u32_value("class\\media\\0000", "b", 2);
+    root.write_subkey_u32_value("class\\media\\0000", "A", 1);
+    root.write_subkey_u32_value("class\\media\\0000\\PowerSettings",
+                                "IdlePowerState", 3);
+    mk.write_string_value("Class", "MEDIA");
+
+    auto load_res = reg::Snapshot::load(mk);
+    BOOST_TEST(load_res.has_value());
+    reg::Snapshot &snapshot = load_res.value();
+    // The root and "class" on the path, then the subtree
+    BOOST_TEST(snapshot.keys_count() == 6U);
+    BOOST_TEST(snapshot.values_count() == 4U);
+    // The source may change, the copy does not follow it
+    const uint64_t write_time = mk.query_info().value().last_write_time;
+    mk.write_string_value("Class", "changed");
+
+    const reg::Key copy_root(snapshot, reg::SystemKey::LocalMachine);
+    BOOST_TEST(!reg::Key(copy_root, "other").valid());
+    const reg::Key copy_mk(copy_root, "CLASS\\Media");
+    BOOST_TEST(copy_mk.read_string_value("class").value_or("") == "MEDIA");
+    BOOST_TEST(copy_mk.query_info().value().last_write_time == write_time);
+    // Subkeys and values enumerate in the order of the source
+    const std::vector<std::string> expected {"0001", "0000"};
+    std::vector<std::string> names;
+    for (std::string_view name : copy_mk.subkeys()) {
+        names.emplace_back(name);
+    }
+    BOOST_TEST(names == expected, boost::test_tools::per_element());
+    const reg::Key copy_msk(copy_mk, "0000");
+    std::string name_buf;
+    std::vector<uint8_t> data_buf;
+    BOOST_TEST(copy_msk.enum_value(0, name_buf, data_buf).value().name == "b");
+    const std::array<std::string, 2> value_names {"a", "B"};
+    const std::vector<uint32_t> expected_values {1, 2};
+    BOOST_TEST(copy_msk.read_u32_values(value_names).value() ==
+                   expected_values,
+               boost::test_tools::per_element());
+    BOOST_TEST(copy_msk.write_u32_value("A", 0).error.code ==
+               reg::status::AccessDenied);
+
+    // Read from many threads at once without locks
+    std::vector<std::thread> threads;
+    std::atomic<uint32_t> ok {0};
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 1000; i++) {
+                const reg::Key psk(copy_mk, "0000\\PowerSettings");
+                ok += psk.read_u32_value("IdlePowerState").value_or(0) == 3;
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    BOOST_TEST(ok == 4000U);
+}
+
+BOOST_AUTO_TEST_CASE(subkey_index_finds_names) {
+    reg::MemBackend backend;
+    for (const char *name : {"USB\\VID_046D&PID_C52B", "USB\\VID_046D&PID_0825",
+                             "USB\\VID_8087&PID_0024", "USB\\ROOT_HUB30"}) {
+        backend.create_key(name);
+    }
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key usb(root, "USB");
+    auto index = reg::SubkeyIndex::build(usb).value();
+    BOOST_TEST(index.size() == 4U);
+
+    BOOST_TEST(index.find("vid_046d&pid_0825").value_or("") ==
+               "VID_046D&PID_0825");
+    BOOST_TEST(!index.find("VID_046D").has_value());
+    BOOST_TEST(index.find_exact("ROOT_HUB30").has_value());
+    BOOST_TEST(!index.find_exact("root_hub30").has_value());
+    const std::vector<std::string_view> expected {"VID_046D&PID_0825",
+                                                  "VID_046D&PID_C52B"};
+    BOOST_TEST(index.find_prefix("vid_046d&") == expected,
+               boost::test_tools::per_element());
+    BOOST_TEST(index.find_prefix("VID_1234").empty());
+
+    // Rebuilt only once the key has changed
+    BOOST_TEST(!index.refresh(usb).value());
+    backend.create_key("USB\\VID_1234&PID_0001");
+    BOOST_TEST(index.refresh(usb).value());
+    BOOST_TEST(index.size() == 5U);
+    BOOST_TEST(index.find_prefix("VID_1234").size() == 1U);
+}
+
+BOOST_AUTO_TEST_CASE(pool_runs_nested_tasks) {
+    std::atomic<int> done = 0;
+    reg::ThreadPool pool(4);
+    for (int i = 0; i < 8; i++) {
+        pool.submit([&] {
+            for (int j = 0; j < 8; j++) {
+                pool.submit([&] { done++; });
+            }
+            done++;
+        });
+    }
+    pool.wait();
+    BOOST_TEST(done.load() == 72);
+    BOOST_TEST(pool.size() == 4U);
+}
+
+BOOST_AUTO_TEST_CASE(search_prunes_and_streams_matches) {
+    reg::MemBackend backend;
+    for (int c = 0; c < 4; c++) {
+        for (int i = 0; i < 10; i++) {
+            const std::string path = std::format("Class\\{{{}}}\\{:04}", c, i);
+            backend.create_key(path + "\\Settings");
+            if (i % 3 == 0) {
+                backend.set_value(backend.root(reg::SystemKey::LocalMachine),
+                                  path.c_str(), "Match", reg::ValueType::U32,
+                                  &i, sizeof(i));
+            }
+        }
+        backend.create_key(std::format("Class\\{{{}}}\\Properties\\0000", c));
+    }
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key ck(root, "Class");
+
+    std::atomic<int> in_callback = 0;
+    std::vector<std::string> found;
+    const reg::SearchFilter filter {
+        .key_name =
+            [](std::string_view name, uint32_t depth) {
+                return name != "Properties" && depth < 3;
+            },
+        .key =
+            [](const reg::Key &key) {
+                return key.read_u32_value("Match").has_value();
+            },
+        .max_depth = 8,
+    };
+    const auto search_res =
+        reg::search(ck, filter, 4, [&](const reg::Key &key) {
+            BOOST_TEST(in_callback++ == 0);
+            found.push_back(key.path());
+            in_callback--;
+        });
+    BOOST_REQUIRE(search_res.has_value());
+    // 4 classes and 40 instances opened; Properties and Settings never are
+    BOOST_TEST(search_res->keys_opened == 44U);
+    BOOST_TEST(search_res->keys_pruned == 44U);
+    BOOST_TEST(search_res->matches == 16U);
+    BOOST_TEST(search_res->errors == 0U);
+    std::ranges::sort(found);
+    BOOST_REQUIRE(found.size() == 16U);
+    BOOST_TEST(found[0] == "HKEY_LOCAL_MACHINE\\Class\\{0}\\0000");
+    BOOST_TEST(found[15] == "HKEY_LOCAL_MACHINE\\Class\\{3}\\0009");
+
+    // Depth limit alone, everything matches
+    const auto depth_res = reg::search(
+        ck, reg::SearchFilter {.key_name = {}, .key = {}, .max_depth = 1}, 2,
+        [](const reg::Key &) {});
+    BOOST_TEST(depth_res.value().keys_opened == 4U);
+    BOOST_TEST(depth_res.value().matches == 4U);
+
+    const reg::Key missing(root, "Missing");
+    const auto missing_res = reg::search(
+        missing, reg::SearchFilter {.key_name = {}, .key = {}, .max_depth = 1},
+        2, [](const reg::Key &) {});
+    BOOST_REQUIRE(!missing_res.has_value());
+    BOOST_TEST(missing_res.error().code == reg::status::InvalidHandle);
+}
+
+// Minimal REGF hive writer for the hive backend tests
+struct TestHiveValue {
+    std::string name;
+    reg::ValueType type;
+    std::vector<uint8_t> data;
+};
+
+struct TestHiveKey {
+    std::string name;
+    std::vector<TestHiveKey> subkeys;
+    std::vector<TestHiveValue> values;
+
+    TestHiveKey &subkey(const std::string &subkey_name) {
+        return subkeys.emplace_back(TestHiveKey {subkey_name, {}, {}});
+    }
+};
+
+std::vector<uint8_t> utf16(std::string_view s) {
+    std::vector<uint8_t> bytes;
+    for (char c : s) {
+        bytes.push_back((uint8_t) c);
+        bytes.push_back(0);
+    }
+    bytes.insert(bytes.end(), {0, 0});
+    return bytes;
+}
+
+class TestHiveWriter {
+  public:
+    void save(const TestHiveKey &root, const std::string &path) {
+        bins_.assign(0x20, 0);
+        std::memcpy(bins_.data(), "hbin", 4);
+        const uint32_t root_cell = write_key(root, UINT32_MAX, 0x2c);
+        bins_.resize((bins_.size() + 0xfff) & ~0xfffULL);
+        store<uint32_t>(8, (uint32_t) bins_.size());
+
+        std::vector<uint8_t> base(0x1000);
+        std::memcpy(base.data(), "regf", 4);
+        store_at<uint32_t>(base, 0x04, 1); // sequence numbers
+        store_at<uint32_t>(base, 0x08, 1);
+        store_at<uint32_t>(base, 0x14, 1); // version 1.5
+        store_at<uint32_t>(base, 0x18, 5);
+        store_at<uint32_t>(base, 0x20, 1);
+        store_at<uint32_t>(base, 0x24, root_cell);
+        store_at<uint32_t>(base, 0x28, (uint32_t) bins_.size());
+        store_at<uint32_t>(base, 0x2c, 1);
+        uint32_t checksum = 0;
+        for (size_t i = 0; i < 0x1fc; i += 4) {
+            uint32_t dword;
+            std::memcpy(&dword, base.data() + i, 4);
+            checksum ^= dword;
+        }
+        store_at<uint32_t>(base, 0x1fc, checksum);
+
+        std::ofstream out(path, std::ios::binary);
+        out.write((const char *) base.data(), (std::streamsize) base.size());
+        out.write((const char *) bins_.data(), (std::streamsize) bins_.size());
+    }
+
+  private:
+    template <typename T>
+    static void store_at(std::vector<uint8_t> &v, size_t offset, T value) {
+        std::memcpy(v.data() + offset, &value, sizeof(value));
+    }
+
+    template <typename T> void store(size_t offset, T value) {
+        store_at(bins_, offset, value);
+    }
+
+    uint32_t alloc(size_t size) {
+        const size_t cell_size = (size + 4 + 7) & ~size_t {7};
+        const uint32_t offset = (uint32_t) bins_.size();
+        bins_.resize(bins_.size() + cell_size);
+        store<int32_t>(offset, -(int32_t) cell_size);
+        return offset;
+    }
+
+    uint32_t write_key(const TestHiveKey &key, uint32_t parent,
+                       uint16_t flags) {
+        const uint32_t nk = alloc(0x4c + key.name.size());
+        std::memcpy(bins_.data() + nk + 4, "nk", 2);
+        store<uint16_t>(nk + 4 + 0x02, flags | 0x20);
+        store<uint64_t>(nk + 4 + 0x04, 0x01d0000000000000);
+        store<uint32_t>(nk + 4 + 0x10, parent);
+        store<uint32_t>(nk + 4 + 0x1c, UINT32_MAX);
+        store<uint32_t>(nk + 4 + 0x28, UINT32_MAX);
+        store<uint16_t>(nk + 4 + 0x48, (uint16_t) key.name.size());
+        std::memcpy(bins_.data() + nk + 4 + 0x4c, key.name.data(),
+                    key.name.size());
+
+        std::vector<std::pair<uint32_t, uint32_t>> entries;
+        size_t max_name_len = 0;
+        for (const TestHiveKey &subkey : key.subkeys) {
+            uint32_t hash = 0;
+            for (char c : subkey.name) {
+                hash = hash * 37 + (uint32_t) std::toupper(c);
+            }
+            entries.emplace_back(write_key(subkey, nk, 0), hash);
+            max_name_len = std::max(max_name_len, subkey.name.size());
+        }
+        if (!entries.empty()) {
+            const uint32_t list = alloc(4 + 8 * entries.size());
+            std::memcpy(bins_.data() + list + 4, "lh", 2);
+            store<uint16_t>(list + 4 + 2, (uint16_t) entries.size());
+            for (size_t i = 0; i < entries.size(); i++) {
+                store<uint32_t>(list + 4 + 4 + 8 * i, entries[i].first);
+                store<uint32_t>(list + 4 + 8 + 8 * i, entries[i].second);
+            }
+            store<uint32_t>(nk + 4 + 0x14, (uint32_t) entries.size());
+            store<uint32_t>(nk + 4 + 0x1c, list);
+            store<uint32_t>(nk + 4 + 0x34, (uint32_t) max_name_len * 2);
+        }
+
+        if (!key.values.empty()) {
+            std::vector<uint32_t> vks;
+            for (const TestHiveValue &value : key.values) {
+                vks.push_back(write_value(value));
+            }
+            const uint32_t list = alloc(4 * vks.size());
+            std::memcpy(bins_.data() + list + 4, vks.data(), 4 * vks.size());
+            store<uint32_t>(nk + 4 + 0x24, (uint32_t) vks.size());
+            store<uint32_t>(nk + 4 + 0x28, list);
+        }
+        return nk;
+    }
+
+    uint32_t write_value(const TestHiveValue &value) {
+        const uint32_t vk = alloc(0x14 + value.name.size());
+        std::memcpy(bins_.data() + vk + 4, "vk", 2);
+        store<uint16_t>(vk + 4 + 0x02, (uint16_t) value.name.size());
+        store<uint32_t>(vk + 4 + 0x0c, std::to_underlying(value.type));
+        store<uint16_t>(vk + 4 + 0x10, 1);
+        std::memcpy(bins_.data() + vk + 4 + 0x14, value.name.data(),
+                    value.name.size());
+        const uint32_t size = (uint32_t) value.data.size();
+        if (size <= 4) {
+            store<uint32_t>(vk + 4 + 0x04, size | 0x80000000);
+            std::memcpy(bins_.data() + vk + 4 + 0x08, value.data.data(), size);
+        } else {
+            const uint32_t data = alloc(size);
+            std::memcpy(bins_.data() + data + 4, value.data.data(), size);
+            store<uint32_t>(vk + 4 + 0x04, size);
+            store<uint32_t>(vk + 4 + 0x08, data);
+        }
+        return vk;
+    }
+
+    std::vector<uint8_t> bins_;
+};
+
+// Temporary file name unique to the process and the call, so that test runs
+// in parallel do not overwrite each other's files
+std::filesystem::path unique_temp_path(std::string_view prefix) {
+    static const uint64_t run = std::random_device {}() |
+                                (uint64_t) std::random_device {}() << 32;
+    static std::atomic<uint32_t> counter = 0;
+    return std::filesystem::temp_directory_path() /
+           std::format("{}_{:016x}_{}", prefix, run, counter++);
+}
+
+struct TestHiveFile {
+    std::string path;
+
+    TestHiveFile(const TestHiveKey &root)
+        : path {unique_temp_path("reg_test_hive").string()} {
+        TestHiveWriter().save(root, path);
+    }
+
+    ~TestHiveFile() {
+        std::filesystem::remove(path);
+    }
+};
+
+TestHiveKey create_test_system_hive() {
+    const uint32_t idle_time = 0x12345678;
+    const uint32_t current = 1;
+
+    TestHiveKey root {"ROOT", {}, {}};
+    root.subkey("Select").values.push_back(
+        {"Current", reg::ValueType::U32,
+         {(const uint8_t *) &current, (const uint8_t *) &current + 4}});
+    TestHiveKey &media = root.subkey("ControlSet001")
+                             .subkey("Control")
+                             .subkey("Class")
+                             .subkey("{4d36e96c-e325-11ce-bfc1-08002be10318}");
+    TestHiveKey &device = media.subkey("0000");
+    device.values.push_back(
+        {"DriverDesc", reg::ValueType::String, utf16("High Definition Audio")});
+    device.subkey("PowerSettings")
+        .values.push_back(
+            {"PerformanceIdleTime", reg::ValueType::Binary,
+             {(const uint8_t *) &idle_time, (const uint8_t *) &idle_time + 4}});
+    media.subkey("Properties");
+    return root;
+}
+
+BOOST_AUTO_TEST_CASE(mem_read_multiple_values) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const uint32_t idle_time = 0x10;
+    const char desc[] = "Speakers";
+    root.write_u32_value("ConservationIdleTime", 0x20);
+    root.write_binary_value("PerformanceIdleTime",
+                            {(const uint8_t *) &idle_time, sizeof(idle_time)});
+    backend.set_value(backend.root(reg::SystemKey::LocalMachine), "",
+                      "DriverDesc", reg::ValueType::String, desc, sizeof(desc));
+
+    const std::array<std::string, 2> u32_names = {"PerformanceIdleTime",
+                                                  "ConservationIdleTime"};
+    const auto u32_res = root.read_u32_values(u32_names);
+    BOOST_REQUIRE(u32_res.has_value());
+    BOOST_TEST(u32_res.value() == (std::vector<uint32_t> {0x10, 0x20}),
+               boost::test_tools::per_element());
+
+    const std::array<std::string, 2> mixed_names = {"DriverDesc",
+                                                    "PerformanceIdleTime"};
+    const auto values_res = root.read_values(mixed_names);
+    BOOST_REQUIRE(values_res.has_value());
+    const reg::Values &values = values_res.value();
+    BOOST_TEST(values.data.size() == sizeof(desc) + sizeof(idle_time));
+    BOOST_TEST((values.entries[0].type == reg::ValueType::String));
+    BOOST_TEST(values.entries[1].offset == sizeof(desc));
+
+    const auto strings_res = root.read_string_values(mixed_names);
+    BOOST_REQUIRE(!strings_res.has_value());
+    BOOST_TEST(strings_res.error().code == reg::status::UnsupportedType);
+    BOOST_TEST(strings_res.error().msg() ==
+               "Failed to get multiple string values: Failed to get string "
+               "value 'PerformanceIdleTime'");
+
+    const std::array<std::string, 2> missing_names = {"ConservationIdleTime",
+                                                      "IdlePowerState"};
+    const auto missing_res = root.read_u32_values(missing_names);
+    BOOST_TEST(missing_res.error().code == reg::status::FileNotFound);
+    BOOST_TEST(missing_res.error().index == 1U);
+    BOOST_TEST(missing_res.error().msg() ==
+               "Failed to get multiple u32 values: Failed to get u32 value "
+               "'IdlePowerState'");
+    reg::Arena arena;
+    BOOST_TEST(root.read_string_values(missing_names, &arena).error().name ==
+               "IdlePowerState");
+}
+
+BOOST_AUTO_TEST_CASE(mem_typed_values) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+
+    BOOST_TEST(!root.write_u64_value("Qword", 0x1122334455667788).fail);
+    BOOST_TEST(root.read_u64_value("Qword").value_or(0) ==
+               0x1122334455667788U);
+    BOOST_TEST(root.read_u32_value("Qword").error().code ==
+               reg::status::UnsupportedType);
+    BOOST_TEST(root.query_value_size("Qword").value_or(0) == 8U);
+
+    // Longer than any fixed buffer guess
+    const std::string desc(300, 'x');
+    BOOST_TEST(!root.write_string_value("Desc", desc).fail);
+    BOOST_TEST(root.read_string_value("Desc").value_or("") == desc);
+    std::string buf;
+    BOOST_TEST(root.read_string_value("Desc", buf).value_or("") == desc);
+    const size_t capacity = buf.capacity();
+    BOOST_TEST(root.read_string_value("Desc", buf).value_or("") == desc);
+    BOOST_TEST(buf.capacity() == capacity);
+    BOOST_TEST(root.query_value_size("Desc", reg::ValueType::String)
+                   .value_or(0) == 301U);
+
+    BOOST_TEST(
+        !root.write_expand_string_value("Path", "%SystemRoot%\\x").fail);
+    BOOST_TEST(root.read_expand_string_value("Path", buf).value_or("") ==
+               "%SystemRoot%\\x");
+    BOOST_TEST(root.read_string_value("Path", buf).error().code ==
+               reg::status::UnsupportedType);
+
+    const std::array<std::string_view, 3> strings = {"a", "bc", "def"};
+    BOOST_TEST(!root.write_multi_string_value("List", strings).fail);
+    const auto list_res = root.read_multi_string_value("List", buf);
+    BOOST_REQUIRE(list_res.has_value());
+    BOOST_TEST(std::ranges::equal(list_res.value(), strings));
+    BOOST_TEST(!root.write_multi_string_value("Empty", {}).fail);
+    const auto empty_res = root.read_multi_string_value("Empty", buf);
+    BOOST_REQUIRE(empty_res.has_value());
+    BOOST_TEST((empty_res->begin() == std::default_sentinel));
+
+    std::vector<uint8_t> blob(1000);
+    for (size_t i = 0; i < blob.size(); i++) {
+        blob[i] = (uint8_t) i;
+    }
+    BOOST_TEST(!root.write_binary_value("Blob", blob).fail);
+    std::array<uint8_t, 16> small;
+    BOOST_TEST(root.read_binary_value("Blob", small).value_or(0) == 1000U);
+    std::vector<uint8_t> blob_buf;
+    const auto blob_res = root.read_binary_value("Blob", blob_buf);
+    BOOST_REQUIRE(blob_res.has_value());
+    BOOST_TEST(std::ranges::equal(blob_res.value(), blob));
+    BOOST_TEST(root.read_binary_value("Desc", blob_buf).error().msg() ==
+               "Failed to get binary value 'Desc'");
+}
+
+struct TestRecord {
+    std::string desc;
+    uint32_t idle_time;
+    uint32_t power_state;
+};
+
+template <> struct reg::RecordFields<TestRecord> {
+    static constexpr std::tuple fields {
+        Field {"DriverDesc", &TestRecord::desc},
+        Field {"PerformanceIdleTime", &TestRecord::idle_time},
+        Field {"IdlePowerState", &TestRecord::power_state},
+    };
+};
+
+BOOST_AUTO_TEST_CASE(mem_read_record) {
+    static_assert(reg::RecordSize<TestRecord> == 3);
+    static_assert(std::string_view(reg::record_value_names<TestRecord>[1]) ==
+                  "PerformanceIdleTime");
+
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const uint32_t idle_time = 0x10;
+    const std::string desc(300, 'd');
+    root.write_binary_value("PerformanceIdleTime",
+                            {(const uint8_t *) &idle_time, sizeof(idle_time)});
+    root.write_u32_value("IdlePowerState", 3);
+    backend.set_value(backend.root(reg::SystemKey::LocalMachine), "",
+                      "DriverDesc", reg::ValueType::String, desc.c_str(),
+                      (uint32_t) desc.size() + 1);
+
+    // The description does not fit into the inline buffer
+    const auto record_res = reg::read_record<TestRecord>(root);
+    BOOST_REQUIRE(record_res.has_value());
+    BOOST_TEST(record_res->desc == desc);
+    BOOST_TEST(record_res->idle_time == 0x10U);
+    BOOST_TEST(record_res->power_state == 3U);
+
+    root.write_u32_value("DriverDesc", 1);
+    const auto mismatch_res = reg::read_record<TestRecord>(root);
+    BOOST_REQUIRE(!mismatch_res.has_value());
+    BOOST_TEST(mismatch_res.error().code == reg::status::UnsupportedType);
+    BOOST_TEST(mismatch_res.error().index == 0U);
+    BOOST_TEST(mismatch_res.error().msg() ==
+               "Failed to read record value 'DriverDesc'");
+
+    backend.create_key("empty");
+    const reg::Key empty(root, "empty");
+    BOOST_TEST(reg::read_record<TestRecord>(empty).error().code ==
+               reg::status::FileNotFound);
+    empty.write_string_value("DriverDesc", "Speakers");
+    const auto missing_res = reg::read_record<TestRecord>(empty);
+    BOOST_REQUIRE(!missing_res.has_value());
+    BOOST_TEST(missing_res.error().index == 1U);
+    BOOST_TEST(missing_res.error().msg() ==
+               "Failed to read record value 'PerformanceIdleTime'");
+}
+
+struct PmrRecord {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    std::pmr::string desc;
+    uint32_t power_state;
+
+    PmrRecord() = default;
+    explicit PmrRecord(const allocator_type &alloc)
+        : desc {alloc}, power_state {0} {}
+};
+
+template <> struct reg::RecordFields<PmrRecord> {
+    static constexpr std::tuple fields {
+        Field {"DriverDesc", &PmrRecord::desc},
+        Field {"IdlePowerState", &PmrRecord::power_state},
+    };
+};
+
+BOOST_AUTO_TEST_CASE(pmr_reads_allocate_from_arena) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const std::string desc(300, 'd');
+    root.write_u32_value("IdlePowerState", 3);
+    root.write_string_value("DriverDesc", desc);
+
+    // Nothing may come from anywhere else than the buffer
+    std::array<std::byte, 16 * 1024> buffer;
+    std::pmr::monotonic_buffer_resource upstream(
+        buffer.data(), buffer.size(), std::pmr::null_memory_resource());
+    reg::Arena arena(1024, &upstream);
+    const auto owned = [&](const void *p) {
+        return p >= buffer.data() && p < buffer.data() + buffer.size();
+    };
+
+    const auto str_res = root.read_string_value("DriverDesc", &arena);
+    BOOST_TEST(std::string_view(str_res.value()) == desc);
+    BOOST_TEST(owned(str_res->data()));
+    const std::array<std::string, 2> names {"DriverDesc", "DriverDesc"};
+    const auto strs_res = root.read_string_values(names, &arena);
+    BOOST_TEST(strs_res.value().size() == 2U);
+    BOOST_TEST(std::string_view(strs_res->back()) == desc);
+    BOOST_TEST(owned(strs_res->back().data()));
+    const std::array<std::string, 1> u32_names {"IdlePowerState"};
+    const auto u32s_res = root.read_u32_values(u32_names, &arena);
+    BOOST_TEST(u32s_res.value().front() == 3U);
+    BOOST_TEST(root.read_u32_values(names, &arena).error().index == 0U);
+
+    const auto record_res = reg::read_record<PmrRecord>(root, &arena);
+    BOOST_TEST(std::string_view(record_res.value().desc) == desc);
+    BOOST_TEST(record_res->power_state == 3U);
+    BOOST_TEST(owned(record_res->desc.data()));
+    BOOST_TEST(arena.allocated() > 4 * desc.size());
+
+    // Many threads at once
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 100; i++) {
+                std::pmr::vector<uint32_t> values(4, 0, &arena);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    arena.release();
+    BOOST_TEST(arena.allocated() == 0U);
+}
+
+BOOST_AUTO_TEST_CASE(regfile_export_and_import_round_trip) {
+    reg::MemBackend backend;
+    backend.create_key("media\\0000\\PowerSettings");
+    backend.create_key("media\\Properties");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key mk(root, "media");
+    const reg::Key device(mk, "0000");
+    const reg::Key psk(device, "PowerSettings");
+    device.write_string_value("DriverDesc", "Speakers \"HD\" C:\\audio");
+    device.write_string_value("", "default");
+    device.write_u32_value("Flags", 0xa);
+    device.write_u64_value("Big", 0x1122334455667788);
+    device.write_expand_string_value("Path", "%SystemRoot%\\x");
+    const std::array<std::string_view, 2> strings = {"a", "\xc3\xa9t\xc3\xa9"};
+    device.write_multi_string_value("List", strings);
+    const uint32_t idle_time = 0xffffffff;
+    psk.write_binary_value("PerformanceIdleTime",
+                           {(const uint8_t *) &idle_time, sizeof(idle_time)});
+    std::vector<uint8_t> blob(100);
+    for (size_t i = 0; i < blob.size(); i++) {
+        blob[i] = (uint8_t) i;
+    }
+    psk.write_binary_value("Blob", blob);
+
+    std::ostringstream out;
+    const auto export_res = reg::export_reg(mk, out);
+    BOOST_REQUIRE(export_res.has_value());
+    BOOST_TEST(export_res->keys == 4U);
+    BOOST_TEST(export_res->values == 8U);
+    const std::string text = out.str();
+    BOOST_TEST(text.starts_with("Windows Registry Editor Version 5.00\r\n\r\n"
+                                "[HKEY_LOCAL_MACHINE\\media]\r\n"));
+    BOOST_TEST(text.contains("[HKEY_LOCAL_MACHINE\\media\\0000\\"
+                             "PowerSettings]\r\n"));
+    BOOST_TEST(text.contains(
+        "\"DriverDesc\"=\"Speakers \\\"HD\\\" C:\\\\audio\"\r\n"));
+    BOOST_TEST(text.contains("@=\"default\"\r\n"));
+    BOOST_TEST(text.contains("\"Flags\"=dword:0000000a\r\n"));
+    BOOST_TEST(text.contains("\"Big\"=hex(b):88,77,66,55,44,33,22,11\r\n"));
+    BOOST_TEST(text.contains("\"List\"=hex(7):61,00,00,00,e9,00,74,00,e9,00,"
+                             "00,00,00,00\r\n"));
+    BOOST_TEST(text.contains("\"PerformanceIdleTime\"=hex:ff,ff,ff,ff\r\n"));
+    // Long hex data is wrapped
+    BOOST_TEST(text.contains(",\\\r\n  "));
+
+    reg::MemBackend copy;
+    const reg::Key copy_root(copy, reg::SystemKey::LocalMachine);
+    std::istringstream in(text);
+    const auto import_res = reg::import_reg(copy_root, in);
+    BOOST_TEST(!import_res.fail, import_res.error.msg());
+    const reg::Key copy_mk(copy_root, "media");
+    BOOST_REQUIRE(copy_mk.valid());
+    std::ostringstream copy_out;
+    BOOST_REQUIRE(reg::export_reg(copy_mk, copy_out).has_value());
+    BOOST_TEST(copy_out.str() == text);
+    BOOST_TEST(reg::Key(copy_mk, "Properties").valid());
+}
+
+BOOST_AUTO_TEST_CASE(regfile_import_variants_and_errors) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+
+    // Version 4 keeps text in hex form as it is, values can be deleted
+    std::istringstream v4("REGEDIT4\n"
+                          "\n"
+                          "; comment\n"
+                          "[HKEY_LOCAL_MACHINE\\dev]\n"
+                          "\"Gone\"=dword:1\n"
+                          "\"Path\"=hex(2):25,41,25,\\\n"
+                          "  00\n"
+                          "\"Gone\"=-\n"
+                          "\"Missing\"=-\n");
+    const auto v4_res = reg::import_reg(root, v4);
+    BOOST_TEST(!v4_res.fail, v4_res.error.msg());
+    const reg::Key dev(root, "dev");
+    std::string buf;
+    BOOST_TEST(dev.read_expand_string_value("Path", buf).value_or("") ==
+               "%A%");
+    BOOST_TEST(dev.read_u32_value("Gone").error().code ==
+               reg::status::FileNotFound);
+
+    // UTF-16LE with a byte order mark, more values than fit in one batch
+    std::string utf8 = "Windows Registry Editor Version 5.00\r\n\r\n"
+                       "[HKEY_LOCAL_MACHINE\\many]\r\n";
+    for (size_t i = 0; i < 300; i++) {
+        utf8 += std::format("\"V{}\"=dword:{:08x}\r\n", i, i);
+    }
+    std::string utf16 = "\xff\xfe";
+    for (char c : utf8) {
+        utf16 += c;
+        utf16 += '\0';
+    }
+    std::istringstream wide(utf16);
+    const auto wide_res = reg::import_reg(root, wide);
+    BOOST_TEST(!wide_res.fail, wide_res.error.msg());
+    const reg::Key many(root, "many");
+    BOOST_TEST(many.read_u32_value("V299").value_or(0) == 299U);
+
+    std::istringstream no_header("[HKEY_LOCAL_MACHINE\\x]\n");
+    BOOST_TEST(reg::import_reg(root, no_header).error.code ==
+               reg::status::InvalidData);
+
+    std::istringstream other_root("REGEDIT4\n\n[HKEY_CURRENT_USER\\x]\n");
+    const auto other_res = reg::import_reg(root, other_root);
+    BOOST_TEST(other_res.error.code == reg::status::FileNotFound);
+    BOOST_TEST(other_res.error.msg() == "Failed to import .reg file at line "
+                                        "3 ('HKEY_CURRENT_USER\\x')");
+
+    std::istringstream bad_value("REGEDIT4\n[HKEY_LOCAL_MACHINE\\x]\n"
+                                 "\"A\"=dword:1\n\"B\"=word:1\n");
+    const auto bad_res = reg::import_reg(root, bad_value);
+    BOOST_TEST(bad_res.error.code == reg::status::InvalidData);
+    BOOST_TEST(bad_res.error.index == 4U);
+
+    std::istringstream delete_key("REGEDIT4\n[-HKEY_LOCAL_MACHINE\\x]\n");
+    BOOST_TEST(reg::import_reg(root, delete_key).error.code ==
+               reg::status::NotSupported);
+}
+
+BOOST_AUTO_TEST_CASE(hive_read_keys_and_values) {
+    const TestHiveFile file(create_test_system_hive());
+    reg::HiveBackend backend(file.path);
+    BOOST_REQUIRE(backend.valid());
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+
+    const reg::Key mk(root, "CurrentControlSet\\Control\\Class\\"
+                            "{4d36e96c-e325-11ce-bfc1-08002be10318}");
+    BOOST_REQUIRE(mk.valid());
+    BOOST_TEST(mk.get_subkeys_count().value_or(99) == 2U);
+    BOOST_TEST(mk.enum_subkey_names(0).value_or("error0") == "0000");
+    BOOST_TEST(mk.enum_subkey_names(1).value_or("error1") == "Properties");
+    BOOST_TEST(mk.enum_subkey_names(2).error().code ==
+               reg::status::NoMoreItems);
+
+    const reg::Key msk(mk, "0000");
+    BOOST_REQUIRE(msk.valid());
+    BOOST_TEST(msk.read_string_value("driverdesc").value_or("error") ==
+               "High Definition Audio");
+
+    const reg::Key psk(msk, "POWERSETTINGS");
+    BOOST_REQUIRE(psk.valid());
+    BOOST_TEST(psk.read_u32_value("PerformanceIdleTime").value_or(0) ==
+               0x12345678U);
+    BOOST_TEST(psk.read_u32_value("ConservationIdleTime").error().code ==
+               reg::status::FileNotFound);
+    const std::array<std::string, 1> driver_names = {"DriverDesc"};
+    const auto driver_res = msk.read_string_values(driver_names);
+    BOOST_REQUIRE(driver_res.has_value());
+    BOOST_TEST(driver_res.value()[0] == "High Definition Audio");
+    BOOST_TEST(psk.write_u32_value("PerformanceIdleTime", 0).error.code ==
+               reg::status::AccessDenied);
+}
+
+BOOST_AUTO_TEST_CASE(hive_patch_values_in_place) {
+    TestHiveKey hive {"ROOT", {}, {}};
+    TestHiveKey &ps = hive.subkey("PowerSettings");
+    ps.values.push_back({"IdleTime", reg::ValueType::Binary, {1, 2, 3, 4}});
+    ps.values.push_back(
+        {"Large", reg::ValueType::Binary, {1, 2, 3, 4, 5, 6, 7, 8}});
+    ps.values.push_back({"Desc", reg::ValueType::String, utf16("text")});
+    const TestHiveFile file(hive);
+    {
+        reg::HiveBackend backend(file.path, reg::MappedFile::Mode::ReadWrite);
+        BOOST_REQUIRE(backend.valid());
+        const reg::Key root(backend, reg::SystemKey::LocalMachine);
+        const reg::Key psk(root, "PowerSettings");
+        BOOST_TEST(!psk.write_u32_value("IdleTime", 0xffffffff).fail);
+        BOOST_TEST(psk.read_u32_value("IdleTime").value_or(0) == 0xffffffffU);
+        const std::array<uint8_t, 6> smaller = {9, 9, 9, 9, 9, 9};
+        BOOST_TEST(!psk.write_binary_value("Large", smaller).fail);
+
+        const std::array<uint8_t, 16> larger {};
+        BOOST_TEST(psk.write_binary_value("Large", larger).error.code ==
+                   reg::status::NotSupported);
+        BOOST_TEST(psk.write_binary_value("IdleTime", smaller).error.code ==
+                   reg::status::NotSupported);
+        BOOST_TEST(psk.write_u32_value("Missing", 1).error.code ==
+                   reg::status::NotSupported);
+        BOOST_TEST(psk.write_string_value("Desc", "text").error.code ==
+                   reg::status::NotSupported);
+        BOOST_TEST(reg::Key::create(root, "New").error().code ==
+                   reg::status::NotSupported);
+    }
+
+    // Reopened from the file, which is marked consistent again
+    std::ifstream in(file.path, std::ios::binary);
+    std::vector<uint8_t> base(0x200);
+    in.read((char *) base.data(), (std::streamsize) base.size());
+    std::array<uint32_t, 0x80> dwords;
+    std::memcpy(dwords.data(), base.data(), base.size());
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < 0x7f; i++) {
+        checksum ^= dwords[i];
+    }
+    BOOST_TEST(dwords[1] == 2U);
+    BOOST_TEST(dwords[2] == 2U);
+    BOOST_TEST(dwords[0x7f] == checksum);
+
+    reg::HiveBackend backend(file.path);
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key psk(root, "PowerSettings");
+    BOOST_TEST(psk.read_u32_value("IdleTime").value_or(0) == 0xffffffffU);
+    std::vector<uint8_t> buf;
+    const auto large_res = psk.read_binary_value("Large", buf);
+    BOOST_REQUIRE(large_res.has_value());
+    BOOST_TEST(large_res->size() == 6U);
+    BOOST_TEST(large_res.value()[5] == 9U);
+    BOOST_TEST(psk.read_string_value("Desc").value_or("error") == "text");
+}
+
+BOOST_AUTO_TEST_CASE(hive_rejects_invalid_file) {
+    const auto path = unique_temp_path("reg_test_bad");
+    std::ofstream(path, std::ios::binary) << std::string(0x2000, 'x');
+    {
+        reg::HiveBackend backend(path.string());
+        BOOST_TEST(!backend.valid());
+        BOOST_TEST(backend.error() == reg::status::BadDb);
+    }
+    std::filesystem::remove(path);
+
+    reg::HiveBackend missing((path / "missing").string());
+    BOOST_TEST(!missing.valid());
+    BOOST_TEST(missing.error() == reg::status::FileNotFound);
+}
+
+BOOST_AUTO_TEST_CASE(hive_rejects_counts_past_lists) {
+    TestHiveKey hive {"ROOT", {}, {}};
+    hive.subkey("PowerSettings");
+    hive.values.push_back({"Current", reg::ValueType::U32, {1, 0, 0, 0}});
+    const TestHiveFile file(hive);
+    {
+        // The root key is the first cell after the base block and the bin
+        // header; set its subkeys and values counts far past the lists
+        std::fstream f(file.path,
+                       std::ios::binary | std::ios::in | std::ios::out);
+        const uint32_t count = UINT32_MAX;
+        f.seekp(0x1024 + 0x14);
+        f.write((const char *) &count, sizeof(count));
+        f.seekp(0x1024 + 0x24);
+        f.write((const char *) &count, sizeof(count));
+    }
+    reg::HiveBackend backend(file.path);
+    BOOST_REQUIRE(backend.valid());
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+
+    BOOST_TEST(root.read_u32_value("Other").error().code ==
+               reg::status::BadDb);
+    BOOST_TEST(root.query_info().error().code == reg::status::BadDb);
+    BOOST_TEST(root.enum_subkey_names(1).error().code == reg::status::BadDb);
+    std::string name_buf;
+    std::vector<uint8_t> data_buf;
+    BOOST_TEST(root.enum_value(1, name_buf, data_buf).error().code ==
+               reg::status::BadDb);
+}
+
+BOOST_AUTO_TEST_CASE(overlay_commit_is_all_or_nothing) {
+    TestHiveKey hive {"ROOT", {}, {}};
+    hive.values.push_back({"Current", reg::ValueType::U32, {1, 0, 0, 0}});
+    hive.subkey("PowerSettings")
+        .values.push_back({"Desc", reg::ValueType::String, utf16("text")});
+    const TestHiveFile file(hive);
+    reg::HiveBackend backend(file.path, reg::MappedFile::Mode::ReadWrite);
+    BOOST_REQUIRE(backend.valid());
+
+    // The hive patches u32 values in place but cannot resize text, so the
+    // second key fails after the first one has been written
+    reg::OverlayBackend overlay(backend);
+    const reg::Key root(overlay, reg::SystemKey::LocalMachine);
+    BOOST_TEST(!root.write_u32_value("Current", 2).fail);
+    const reg::Key psk(root, "PowerSettings");
+    BOOST_TEST(!psk.write_string_value("Desc", "longer text").fail);
+
+    const reg::WriteResult res = overlay.commit();
+    BOOST_TEST(res.fail);
+    BOOST_TEST(res.error.code == reg::status::NotSupported);
+    BOOST_TEST(overlay.stats().keys == 2U);
+    const reg::Key inner_root(backend, reg::SystemKey::LocalMachine);
+    BOOST_TEST(inner_root.read_u32_value("Current").value_or(0) == 1U);
+}
+
+BOOST_AUTO_TEST_CASE(write_plan_applies_writes) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    root.write_subkey_u32_value("media\\0000", "IdlePowerState", 1);
+    backend.create_key("media\\0001");
+    const reg::Key first(root, "media\\0000");
+    const reg::Key second(root, "media\\0001");
+
+    reg::WritePlan plan;
+    plan.write_u32_value(first, "IdlePowerState", 3);
+    plan.write_u32_value(second, "IdlePowerState", 3);
+    const std::array<uint8_t, 4> binary = {0xff, 0xff, 0xff, 0xff};
+    plan.write_binary_value(first, "PerformanceIdleTime", binary);
+    BOOST_TEST(plan.size() == 3U);
+
+    BOOST_TEST(!plan.apply().fail);
+    BOOST_TEST(plan.size() == 0U);
+    BOOST_TEST(first.read_u32_value("IdlePowerState").value_or(0) == 3U);
+    BOOST_TEST(second.read_u32_value("IdlePowerState").value_or(0) == 3U);
+    BOOST_TEST(first.read_u32_value("PerformanceIdleTime").value_or(0) ==
+               0xffffffffU);
+}
+
+BOOST_AUTO_TEST_CASE(write_plan_rolls_back_on_failure) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    root.write_subkey_u32_value("media\\0000", "IdlePowerState", 1);
+    const reg::Key mem_key(root, "media\\0000");
+
+    // Hive files are read-only, so the second batch fails
+    const TestHiveFile file(create_test_system_hive());
+    reg::HiveBackend hive(file.path);
+    BOOST_REQUIRE(hive.valid());
+    const reg::Key hive_root(hive, reg::SystemKey::LocalMachine);
+
+    reg::WritePlan plan;
+    plan.write_u32_value(mem_key, "IdlePowerState", 3);
+    plan.write_u32_value(mem_key, "ConservationIdleTime", 3);
+    plan.write_u32_value(hive_root, "IdlePowerState", 3);
+
+    const reg::WriteResult res = plan.apply();
+    BOOST_REQUIRE(res.fail);
+    BOOST_TEST(res.error.code == reg::status::AccessDenied);
+    BOOST_TEST(res.error.msg() == "Failed to apply write plan");
+    BOOST_TEST(mem_key.read_u32_value("IdlePowerState").value_or(0) == 1U);
+    BOOST_TEST(mem_key.read_u32_value("ConservationIdleTime").error().code ==
+               reg::status::FileNotFound);
+
+    reg::WritePlan invalid_plan;
+    const reg::Key missing(root, "media\\0001");
+    invalid_plan.write_u32_value(mem_key, "IdlePowerState", 3);
+    invalid_plan.write_u32_value(missing, "IdlePowerState", 3);
+    const reg::WriteResult invalid_res = invalid_plan.apply();
+    BOOST_TEST(invalid_res.fail);
+    BOOST_TEST(invalid_res.error.code == reg::status::InvalidHandle);
+    BOOST_TEST(mem_key.read_u32_value("IdlePowerState").value_or(0) == 1U);
+}
+
+BOOST_AUTO_TEST_CASE(mem_watch_reports_changes) {
+    using namespace std::chrono_literals;
+    reg::MemBackend backend;
+    backend.create_key("media\\0000\\PowerSettings");
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    const reg::Key mk(root, "media");
+    const reg::Key psk(mk, "0000\\PowerSettings");
+
+    reg::Watch watch(mk);
+    BOOST_REQUIRE(watch.valid());
+    BOOST_TEST(!watch.wait(0ms).value_or(true));
+
+    // Changes made before waiting are not lost
+    psk.write_u32_value("IdlePowerState", 3);
+    BOOST_TEST(watch.wait(0ms).value_or(false));
+    BOOST_TEST(!watch.wait(0ms).value_or(true));
+
+    std::thread writer([&] {
+        std::this_thread::sleep_for(10ms);
+        root.write_subkey_u32_value("media\\0001", "IdlePowerState", 3);
+    });
+    BOOST_TEST(watch.wait(10s).value_or(false));
+    writer.join();
+
+    // Writes outside of the watched key do not wake it up
+    root.write_subkey_u32_value("other", "IdlePowerState", 3);
+    BOOST_TEST(!watch.wait(0ms).value_or(true));
+
+    // Stopping a watch ends a wait on it
+    reg::Handle w = reg::InvalidHandle;
+    BOOST_REQUIRE(backend.watch(backend.root(reg::SystemKey::LocalMachine),
+                                w) == reg::status::Success);
+    int32_t wait_res = reg::status::Success;
+    std::thread waiter([&] { wait_res = backend.wait_change(w, UINT32_MAX); });
+    std::this_thread::sleep_for(10ms);
+    backend.unwatch(w);
+    waiter.join();
+    BOOST_TEST(wait_res == reg::status::InvalidHandle);
+
+    // A watch of a missing key fails to wait instead of reaching the backend
+    reg::Watch missing(reg::Key(root, "missing"));
+    BOOST_TEST(!missing.valid());
+    const auto missing_res = missing.wait(0ms);
+    BOOST_REQUIRE(!missing_res.has_value());
+    BOOST_TEST(missing_res.error().code == reg::status::InvalidHandle);
+}
+
+BOOST_AUTO_TEST_CASE(stats_histogram_percentiles) {
+    using reg::stats::Histogram;
+    for (uint64_t ns : {0ULL, 7ULL, 8ULL, 1000ULL, 123456789ULL}) {
+        const size_t b = Histogram::bucket(ns);
+        BOOST_TEST(ns <= Histogram::bucket_max(b));
+        BOOST_TEST((b == 0 || ns > Histogram::bucket_max(b - 1)));
+    }
+    // A bucket is never wider than 1/8 of its values
+    BOOST_TEST(Histogram::bucket_max(Histogram::bucket(1000)) < 1125U);
+
+    Histogram h {};
+    for (uint64_t ns = 1; ns <= 100; ns++) {
+        h.add(ns * 1000);
+    }
+    BOOST_TEST(h.count() == 100U);
+    BOOST_TEST(h.max_ns == 100000U);
+    BOOST_TEST(h.percentile(0.5) >= 50000U);
+    BOOST_TEST(h.percentile(0.5) < 50000U * 9 / 8);
+    BOOST_TEST(h.percentile(1.0) == 100000U);
+}
+
+#ifdef REG_STATS
+BOOST_AUTO_TEST_CASE(stats_count_calls_and_errors) {
+    using reg::Operation;
+    const auto ops_before = reg::stats::snapshot().ops;
+    const auto &u32_before = ops_before[std::to_underlying(
+        Operation::ReadU32Value)];
+
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    root.write_u32_value("IdlePowerState", 3);
+    std::thread reader([&] {
+        (void) root.read_u32_value("IdlePowerState");
+        (void) root.read_u32_value("Missing");
+    });
+    reader.join();
+    (void) root.read_u32_value("Missing");
+
+    const auto ops = reg::stats::snapshot().ops;
+    const auto &u32 = ops[std::to_underlying(Operation::ReadU32Value)];
+    BOOST_TEST(u32.calls - u32_before.calls == 3U);
+    const auto errors_before =
+        u32_before.errors.contains(reg::status::FileNotFound)
+            ? u32_before.errors.at(reg::status::FileNotFound)
+            : 0;
+    BOOST_TEST(u32.errors.at(reg::status::FileNotFound) - errors_before ==
+               2U);
+    BOOST_TEST(u32.latency.count() - u32_before.latency.count() == 3U);
+}
+#endif // REG_STATS
+
+BOOST_AUTO_TEST_CASE(async_scan_reads_concurrently) {
+    reg::MemBackend backend;
+    const reg::Key root(backend, reg::SystemKey::LocalMachine);
+    for (uint32_t i = 0; i < 16; i++) {
+        root.write_subkey_u32_value(std::format("media\\{:04}", i),
+                                    "IdlePowerState", i);
+    }
+    backend.create_key("media\\Properties");
+    const reg::Key mk(root, "media");
+
+    reg::Executor ex(4);
+    // Reads the value of every subkey which has it, all reads at once
+    const auto read_instance =
+        [&](uint32_t idx) -> reg::Task<reg::ReadResult<uint32_t>> {
+        const auto name_res =
+            co_await reg::async::enum_subkey_names(ex, mk, idx);
+        if (!name_res.has_value()) {
+            co_return std::unexpected(name_res.error());
+        }
+        const reg::Key k =
+            co_await reg::async::open_key(ex, mk, name_res.value());
+        co_return co_await reg::async::read_u32_value(ex, k, "IdlePowerState");
+    };
+    const auto scan = [&]() -> reg::Task<std::vector<uint32_t>> {
+        const auto count_res = co_await reg::async::get_subkeys_count(ex, mk);
+        std::vector<reg::Task<reg::ReadResult<uint32_t>>> reads;
+        for (uint32_t i = 0; i < count_res.value_or(0); i++) {
+            reads.push_back(read_instance(i));
+        }
+        std::vector<uint32_t> values;
+        for (const auto &res : co_await reg::when_all(std::move(reads))) {
+            if (res.has_value()) {
+                values.push_back(res.value());
+            } else {
+                BOOST_TEST(res.error().code == reg::status::FileNotFound);
+            }
+        }
+        co_return values;
+    };
+
+    const std::vector<uint32_t> values = ex.run(scan());
+    BOOST_REQUIRE(values.size() == 16U);
+    for (uint32_t i = 0; i < 16; i++) {
+        BOOST_TEST(values[i] == i);
+    }
+    BOOST_TEST(ex.run(reg::when_all(
+                          std::vector<reg::Task<reg::ReadResult<uint32_t>>> {}))
+                   .empty());
 }
@@ -0,0 +1,233 @@
+#include "reg.h"
+#include <utility>
+#include <vector>
+#include <windows.h>
+
+namespace {
+
+DWORD value_type_to_flags(reg::ValueType type) {
+    switch (type) {
+    case reg::ValueType::String:
+        return RRF_RT_REG_SZ;
+    case reg::ValueType::ExpandString:
+        return RRF_RT_REG_EXPAND_SZ | RRF_NOEXPAND;
+    case reg::ValueType::Binary:
+        return RRF_RT_REG_BINARY;
+    case reg::ValueType::U32:
+        return RRF_RT_DWORD;
+    case reg::ValueType::MultiString:
+        return RRF_RT_REG_MULTI_SZ;
+    case reg::ValueType::U64:
+        return RRF_RT_QWORD;
+    default:
+        return RRF_RT_ANY;
+    }
+}
+
+// Key watched with RegNotifyChangeKeyValue and the event it signals
+struct Win32Watch {
+    HKEY k;
+    HANDLE event;
+};
+
+LSTATUS notify_change(const Win32Watch &watch) {
+    // Thread agnostic, so the watch survives the thread which has armed it
+    return RegNotifyChangeKeyValue(watch.k, TRUE,
+                                   REG_NOTIFY_CHANGE_NAME |
+                                       REG_NOTIFY_CHANGE_LAST_SET |
+                                       REG_NOTIFY_THREAD_AGNOSTIC,
+                                   watch.event, TRUE);
+}
+
+class Win32Backend : public reg::Backend {
+  public:
+    reg::Handle root(reg::SystemKey sk) override {
+        HKEY k;
+        switch (sk) {
+        case reg::SystemKey::LocalMachine:
+            k = HKEY_LOCAL_MACHINE;
+            break;
+        default:
+            k = HKEY_LOCAL_MACHINE; // fallback for now
+        }
+        return (reg::Handle) k;
+    }
+
+    int32_t open(reg::Handle parent, const char *subkey_name,
+                 reg::Access access, reg::Handle &k) override {
+        HKEY h = nullptr;
+        LSTATUS res = RegOpenKeyExA((HKEY) parent, subkey_name, 0,
+                                    std::to_underlying(access), &h);
+        k = (reg::Handle) h;
+        return res;
+    }
+
+    int32_t create(reg::Handle parent, const char *subkey_name,
+                   reg::Access access, reg::Handle &k) override {
+        HKEY h = nullptr;
+        LSTATUS res = RegCreateKeyExA(
+            (HKEY) parent, subkey_name, 0, nullptr, REG_OPTION_NON_VOLATILE,
+            std::to_underlying(access), nullptr, &h, nullptr);
+        k = (reg::Handle) h;
+        return res;
+    }
+
+    void close(reg::Handle k) override {
+        RegCloseKey((HKEY) k);
+    }
+
+    int32_t query_info(reg::Handle k, reg::KeyInfo &info) override {
+        DWORD subkeys_count = 0;
+        DWORD max_subkey_name_len = 0;
+        DWORD values_count = 0;
+        FILETIME last_write_time {};
+        LSTATUS res = RegQueryInfoKeyA((HKEY) k, 0, 0, 0, &subkeys_count,
+                                       &max_subkey_name_len, 0, &values_count,
+                                       0, 0, 0, &last_write_time);
+        info = {
+            .subkeys_count = subkeys_count,
+            .max_subkey_name_len = max_subkey_name_len,
+            .values_count = values_count,
+            .last_write_time =
+                ((uint64_t) last_write_time.dwHighDateTime << 32) |
+                last_write_time.dwLowDateTime,
+        };
+        return res;
+    }
+
+    int32_t enum_subkey(reg::Handle k, uint32_t idx, char *name,
+                        uint32_t &size) override {
+        DWORD len = size;
+        LSTATUS res = RegEnumKeyExA((HKEY) k, idx, name, &len, 0, 0, 0, 0);
+        size = len;
+        return res;
+    }
+
+    int32_t enum_value(reg::Handle k, uint32_t idx, char *name,
+                       uint32_t &name_size, reg::ValueType &type, void *data,
+                       uint32_t &size) override {
+        DWORD name_len = name_size;
+        DWORD value_type = 0;
+        DWORD len = size;
+        LSTATUS res = RegEnumValueA((HKEY) k, idx, name, &name_len, 0,
+                                    &value_type, (LPBYTE) data, &len);
+        if (res == ERROR_MORE_DATA) {
+            // Which buffer is too small is not reported, so both get the
+            // largest sizes of the key
+            DWORD max_name_len = 0;
+            DWORD max_len = 0;
+            LSTATUS info_res =
+                RegQueryInfoKeyA((HKEY) k, 0, 0, 0, 0, 0, 0, 0, &max_name_len,
+                                 &max_len, 0, 0);
+            if (info_res != ERROR_SUCCESS) {
+                return info_res;
+            }
+            name_size = max_name_len;
+            size = len > max_len ? len : max_len;
+            return res;
+        }
+        name_size = name_len;
+        size = len;
+        type = (reg::ValueType) value_type;
+        return res;
+    }
+
+    int32_t get_value(reg::Handle k, const char *value_name,
+                      reg::ValueType type, void *data,
+                      uint32_t &size) override {
+        DWORD len = size;
+        LSTATUS res = RegGetValueA((HKEY) k, 0, value_name,
+                                   value_type_to_flags(type), 0, data, &len);
+        size = len;
+        return res;
+    }
+
+    int32_t get_values(reg::Handle k, std::span<reg::ValueEntry> entries,
+                       void *data, uint32_t &size) override {
+        std::vector<VALENTA> val_list(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            val_list[i].ve_valuename = const_cast<char *>(entries[i].name);
+        }
+        DWORD len = size;
+        LSTATUS res = RegQueryMultipleValuesA((HKEY) k, val_list.data(),
+                                              (DWORD) val_list.size(),
+                                              (char *) data, &len);
+        size = len;
+        if (res != ERROR_SUCCESS || data == nullptr) {
+            return res;
+        }
+        for (size_t i = 0; i < entries.size(); i++) {
+            entries[i].type = (reg::ValueType) val_list[i].ve_type;
+            entries[i].offset =
+                (uint32_t) (val_list[i].ve_valueptr - (DWORD_PTR) data);
+            entries[i].size = val_list[i].ve_valuelen;
+        }
+        return res;
+    }
+
+    int32_t set_value(reg::Handle k, const char *subkey_name,
+                      const char *value_name, reg::ValueType type,
+                      const void *data, uint32_t size) override {
+        return RegSetKeyValueA((HKEY) k, subkey_name, value_name,
+                               std::to_underlying(type), data, size);
+    }
+
+    int32_t delete_value(reg::Handle k, const char *value_name) override {
+        return RegDeleteValueA((HKEY) k, value_name);
+    }
+
+    int32_t watch(reg::Handle k, reg::Handle &w) override {
+        HANDLE event = CreateEventA(0, FALSE, FALSE, 0);
+        if (event == nullptr) {
+            return GetLastError();
+        }
+        auto *watch = new Win32Watch {
+            .k = (HKEY) k,
+            .event = event,
+        };
+        LSTATUS res = notify_change(*watch);
+        if (res != ERROR_SUCCESS) {
+            unwatch((reg::Handle) watch);
+            return res;
+        }
+        w = (reg::Handle) watch;
+        return ERROR_SUCCESS;
+    }
+
+    int32_t wait_change(reg::Handle w, uint32_t timeout_ms) override {
+        if (w == reg::InvalidHandle) {
+            return ERROR_INVALID_HANDLE;
+        }
+        const Win32Watch &watch = *(const Win32Watch *) w;
+        const DWORD res = WaitForSingleObject(watch.event, timeout_ms);
+        if (res == WAIT_TIMEOUT) {
+            return WAIT_TIMEOUT;
+        }
+        if (res != WAIT_OBJECT_0) {
+            return GetLastError();
+        }
+        // Notifications fire once, it is armed again before the caller gets
+        // to look at the key
+        return notify_change(watch);
+    }
+
+    void unwatch(reg::Handle w) override {
+        const Win32Watch *watch = (const Win32Watch *) w;
+        if (watch == nullptr) {
+            return;
+        }
+        CloseHandle(watch->event);
+        delete watch;
+    }
+};
+
+} // namespace
+
+namespace reg {
+
+Backend &system_backend() {
+    static Win32Backend backend;
+    return backend;
+}
+
+} // namespace reg
@@ -0,0 +1,275 @@
+#include "write_plan.h"
+#include <algorithm>
+#include <cstring>
+#include <ranges>
+
+namespace {
+
+reg::WriteResult plan_failure(int32_t code, reg::Operation op,
+                              const std::string &name) {
+    return {
+        .fail = true,
+        .error =
+            reg::Error {
+                .code = code,
+                .op = op,
+                .name = name,
+                .index = 0,
+            },
+    };
+}
+
+} // namespace
+
+namespace reg {
+
+void WritePlan::write_u32_value(const Key &key, const std::string &value_name,
+                                uint32_t value) {
+    std::vector<uint8_t> data(sizeof(value));
+    std::memcpy(data.data(), &value, sizeof(value));
+    writes_.push_back(Write {
+        .key = &key,
+        .value_name = value_name,
+        .deleted = false,
+        .type = ValueType::U32,
+        .data = std::move(data),
+    });
+}
+
+void WritePlan::write_binary_value(const Key &key,
+                                   const std::string &value_name,
+                                   std::span<const uint8_t> data) {
+    write_value(key, value_name, ValueType::Binary, data);
+}
+
+void WritePlan::write_value(const Key &key, const std::string &value_name,
+                            ValueType type, std::span<const uint8_t> data) {
+    writes_.push_back(Write {
+        .key = &key,
+        .value_name = value_name,
+        .deleted = false,
+        .type = type,
+        .data = {data.begin(), data.end()},
+    });
+}
+
+void WritePlan::delete_value(const Key &key, const std::string &value_name) {
+    writes_.push_back(Write {
+        .key = &key,
+        .value_name = value_name,
+        .deleted = true,
+        .type = ValueType::None,
+        .data = {},
+    });
+}
+
+size_t WritePlan::size() const {
+    return writes_.size();
+}
+
+WriteResult WritePlan::apply() {
+    const std::vector<Write> writes = std::move(writes_);
+    writes_.clear();
+
+    for (const Write &w : writes) {
+        if (!w.key->valid()) {
+            return plan_failure(status::InvalidHandle,
+                                Operation::ApplyWritePlan, w.value_name);
+        }
+        if (w.data.size() > UINT32_MAX) {
+            return plan_failure(status::InvalidParameter,
+                                Operation::ApplyWritePlan, w.value_name);
+        }
+    }
+    const std::vector<Batch> plan_batches = batches(writes);
+
+    // Nothing is written until every old value is known
+    std::vector<OldValue> old_values(writes.size());
+    for (const Batch &batch : plan_batches) {
+        std::string failed_name;
+        const int32_t res = capture(writes, batch, old_values, failed_name);
+        if (res != status::Success) {
+            return plan_failure(res, Operation::ApplyWritePlan, failed_name);
+        }
+    }
+
+    for (size_t i = 0; i < plan_batches.size(); i++) {
+        const int32_t res = apply_batch(writes, plan_batches[i]);
+        if (res == status::Success) {
+            continue;
+        }
+        // The failed batch may be partly applied, so it is restored too
+        std::string failed_name;
+        const int32_t rb_res =
+            roll_back(writes, std::span(plan_batches).first(i + 1),
+                      old_values, failed_name);
+        if (rb_res != status::Success) {
+            return plan_failure(rb_res, Operation::RollBackWritePlan,
+                                failed_name);
+        }
+        return plan_failure(res, Operation::ApplyWritePlan, {});
+    }
+    return {
+        .fail = false,
+        .error = {},
+    };
+}
+
+std::vector<WritePlan::Batch>
+WritePlan::batches(std::span<const Write> writes) {
+    std::vector<Batch> result;
+    for (size_t i = 0; i < writes.size(); i++) {
+        const Key *key = writes[i].key;
+        const auto it = std::ranges::find_if(result, [&](const Batch &b) {
+            return b.key->backend_ == key->backend_ && b.key->k_ == key->k_;
+        });
+        if (it != result.end()) {
+            it->writes.push_back(i);
+        } else {
+            result.push_back(Batch {
+                .key = key,
+                .writes = {i},
+            });
+        }
+    }
+    return result;
+}
+
+int32_t WritePlan::apply_batch(std::span<const Write> writes,
+                               const Batch &batch) {
+    // Writes between deletes go as one batch, deletes one by one
+    const Key &key = *batch.key;
+    std::vector<ValueWrite> value_writes;
+    value_writes.reserve(batch.writes.size());
+    const auto flush = [&] {
+        const int32_t res = value_writes.empty()
+                                ? status::Success
+                                : key.backend_->set_values(key.k_,
+                                                           value_writes);
+        value_writes.clear();
+        return res;
+    };
+    for (size_t idx : batch.writes) {
+        const Write &w = writes[idx];
+        if (!w.deleted) {
+            value_writes.push_back(ValueWrite {
+                .name = w.value_name.c_str(),
+                .type = w.type,
+                .data = w.data.data(),
+                .size = (uint32_t) w.data.size(),
+            });
+            continue;
+        }
+        const int32_t flush_res = flush();
+        if (flush_res != status::Success) {
+            return flush_res;
+        }
+        // Already gone is as good as deleted
+        const int32_t res =
+            key.backend_->delete_value(key.k_, w.value_name.c_str());
+        if (res != status::Success && res != status::FileNotFound) {
+            return res;
+        }
+    }
+    return flush();
+}
+
+int32_t WritePlan::capture(std::span<const Write> writes, const Batch &batch,
+                           std::span<OldValue> old_values,
+                           std::string &failed_name) {
+    std::vector<std::string> names;
+    names.reserve(batch.writes.size());
+    for (size_t idx : batch.writes) {
+        names.push_back(writes[idx].value_name);
+    }
+    const auto store = [&](size_t idx, const Values &values, size_t entry) {
+        const ValueEntry &e = values.entries[entry];
+        const uint8_t *data = values.data.data() + e.offset;
+        old_values[idx] = OldValue {
+            .existed = true,
+            .type = e.type,
+            .data = {data, data + e.size},
+        };
+    };
+
+    // Usually all of them exist and one read is enough
+    const auto values_res = batch.key->read_values(names);
+    if (values_res.has_value()) {
+        for (size_t i = 0; i < batch.writes.size(); i++) {
+            store(batch.writes[i], values_res.value(), i);
+        }
+        return status::Success;
+    }
+    if (values_res.error().code != status::FileNotFound) {
+        return values_res.error().code;
+    }
+    for (size_t i = 0; i < batch.writes.size(); i++) {
+        const auto value_res =
+            batch.key->read_values(std::span(names).subspan(i, 1));
+        if (value_res.has_value()) {
+            store(batch.writes[i], value_res.value(), 0);
+        } else if (value_res.error().code == status::FileNotFound) {
+            old_values[batch.writes[i]] = OldValue {
+                .existed = false,
+                .type = ValueType::None,
+                .data = {},
+            };
+        } else {
+            failed_name = names[i];
+            return value_res.error().code;
+        }
+    }
+    return status::Success;
+}
+
+bool WritePlan::unchanged(const Key &key, const std::string &value_name,
+                          const OldValue &old) {
+    const auto value_res = key.read_values(std::span(&value_name, 1));
+    if (!value_res.has_value()) {
+        return !old.existed &&
+               value_res.error().code == status::FileNotFound;
+    }
+    const Values &value = value_res.value();
+    const ValueEntry &e = value.entries[0];
+    return old.existed && old.type == e.type &&
+           std::ranges::equal(old.data,
+                              std::span(value.data).subspan(e.offset, e.size));
+}
+
+int32_t WritePlan::roll_back(std::span<const Write> writes,
+                             std::span<const Batch> applied,
+                             std::span<const OldValue> old_values,
+                             std::string &failed_name) {
+    // Restores every value which has changed, reports the first one it could
+    // not restore
+    int32_t result = status::Success;
+    for (const Batch &batch : applied | std::views::reverse) {
+        const Key &key = *batch.key;
+        for (size_t idx : batch.writes | std::views::reverse) {
+            const OldValue &old = old_values[idx];
+            if (unchanged(key, writes[idx].value_name, old)) {
+                // E.g. the write which has failed, read-only keys stay valid
+                continue;
+            }
+            const char *name = writes[idx].value_name.c_str();
+            int32_t res;
+            if (old.existed) {
+                res = key.backend_->set_value(key.k_, "", name, old.type,
+                                              old.data.data(),
+                                              (uint32_t) old.data.size());
+            } else {
+                res = key.backend_->delete_value(key.k_, name);
+                if (res == status::FileNotFound) {
+                    res = status::Success;
+                }
+            }
+            if (res != status::Success && result == status::Success) {
+                result = res;
+                failed_name = name;
+            }
+        }
+    }
+    return result;
+}
+
+} // namespace reg
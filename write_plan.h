@@ -0,0 +1,70 @@
+#pragma once
+
+#include "reg.h"
+
+namespace reg {
+
+// Writes to values of one or more keys applied all or nothing. The writes
+// and deletes are queued first; apply() checks them, captures the values
+// they are going to overwrite or delete, and sends the writes of every key
+// to its backend as one batch. If any write fails, the captured values are
+// restored (and values which did not exist are deleted again), so no key is
+// left half updated.
+class WritePlan {
+  public:
+    // Queue a write. The key must stay open until the plan is applied.
+    void write_u32_value(const Key &key, const std::string &value_name,
+                         uint32_t value);
+    void write_binary_value(const Key &key, const std::string &value_name,
+                            std::span<const uint8_t> data);
+    void write_value(const Key &key, const std::string &value_name,
+                     ValueType type, std::span<const uint8_t> data);
+    // Queue a delete, of a value which may be missing already
+    void delete_value(const Key &key, const std::string &value_name);
+
+    size_t size() const;
+
+    // Applies the queued writes and clears the plan. On failure the error is
+    // the one which has stopped the plan, or the first one met while rolling
+    // back if the old values could not be restored.
+    WriteResult apply();
+
+  private:
+    struct Write {
+        const Key *key;
+        std::string value_name;
+        bool deleted;
+        ValueType type;
+        std::vector<uint8_t> data;
+    };
+
+    // Value overwritten by a write
+    struct OldValue {
+        bool existed;
+        ValueType type;
+        std::vector<uint8_t> data;
+    };
+
+    // Writes to the same key, in the order they were queued
+    struct Batch {
+        const Key *key;
+        std::vector<size_t> writes;
+    };
+
+    static std::vector<Batch> batches(std::span<const Write> writes);
+    static int32_t apply_batch(std::span<const Write> writes,
+                               const Batch &batch);
+    static int32_t capture(std::span<const Write> writes, const Batch &batch,
+                           std::span<OldValue> old_values,
+                           std::string &failed_name);
+    static bool unchanged(const Key &key, const std::string &value_name,
+                          const OldValue &old);
+    static int32_t roll_back(std::span<const Write> writes,
+                             std::span<const Batch> applied,
+                             std::span<const OldValue> old_values,
+                             std::string &failed_name);
+
+    std::vector<Write> writes_;
+};
+
+} // namespace reg